@@ -8,15 +8,18 @@
 #include "precision.h"
 
 #include "frechet.h"
+#include "fldcache.h"
+#include "groups.h"
 #include "measure.h"
 #include "mlfma.h"
 #include "cg.h"
+#include "util.h"
 
 /* Least-squares solution using CG. The residual must be precomputed. */
 real cgls (cplx *rn, cplx *sol, solveparm *slv,
 		measdesc *src, measdesc *obs, real regparm) {
 	long i, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
-	int j, k;
+	int j;
 	cplx *ifld, *pn, *scat, *adjcrt;
 	real rnorm, pnorm, lrnorm, lpnorm, alpha, beta, rninc;
 
@@ -27,64 +30,50 @@ real cgls (cplx *rn, cplx *sol, solveparm *slv,
 	scat = malloc (obs->count * sizeof(cplx));
 
 	/* Initialize some values. */
-	rnorm = 0;
-	for (i = 0; i < nelt; ++i) {
-		pn[i] = rn[i];
-		sol[i] = 0.0;
-		alpha = cabs (rn[i]);
-		rnorm += alpha * alpha;
-	}
+	memcpy (pn, rn, nelt * sizeof(cplx));
+	memset (sol, 0, nelt * sizeof(cplx));
+	rnorm = vnrm2 (rn, nelt);
 
 	/* Reduce the local norms into a global norm. */
-	MPI_Allreduce (MPI_IN_PLACE, &rnorm, 1, MPIREAL, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce (MPI_IN_PLACE, &rnorm, 1, MPIREAL, MPI_SUM, fmaconf.comm);
 	pnorm = (rninc = rnorm);
 
 	for (j = 0; j < slv->maxit; ++j) {
 		memset (adjcrt, 0, nelt * sizeof(cplx));
 		alpha = 0;
 		for (i = 0; i < src->count; ++i) {
-			/* Build the incident field. */
-			buildrhs (ifld, src->locations + 3 * i, src->plane, NULL);
-			/* Solve for the internal field. */
-			bicgstab (ifld, ifld, 0, slv->maxit, slv->epscg, 1);
+			/* Another group handles this transmitter. */
+			if (!grpmine (i)) continue;
+			/* Find the internal field. */
+			fcfield (ifld, src, i, slv);
 			/* Compute the Frechet derivative. */
 			frechet (pn, ifld, scat, obs, slv);
 			/* Compute the adjoint Frechet derivative. */
 			frechadj (scat, ifld, adjcrt, obs, slv);
 			/* Update the local norm. */
-			for (k = 0; k < obs->count; ++k) {
-				beta = cabs (scat[k]);
-				alpha += beta * beta;
-			}
+			alpha += vnrm2 (scat, obs->count);
 		}
 
+		/* Combine the contributions of all groups. */
+		grpsum (adjcrt, 2 * nelt, MPIREAL);
+		grpsum (&alpha, 1, MPIREAL);
+
 		alpha  = rnorm / (alpha + regparm * pnorm);
 		beta = rnorm;
 
 		/* Update the residual. */
-		for (i = 0, lrnorm = 0; i < nelt; ++i) {
-			rn[i] -= alpha * (adjcrt[i] + regparm * pn[i]);
-			rnorm = cabs (rn[i]);
-			lrnorm += rnorm * rnorm;
-		}
+		lrnorm = vupdnrm (rn, -alpha, adjcrt, -alpha * regparm, pn, nelt);
 
 		/* Reduce the new residual norm. */
-		MPI_Allreduce (&lrnorm, &rnorm, 1, MPIREAL, MPI_SUM, MPI_COMM_WORLD);
+		MPI_Allreduce (&lrnorm, &rnorm, 1, MPIREAL, MPI_SUM, fmaconf.comm);
 
 		beta = rnorm / beta;
 
-		pnorm = lpnorm = 0;
-
 		/* Update the solution and the search vector. */
-		for (i = 0, lpnorm = 0; i < nelt; ++i) {
-			sol[i] += alpha * pn[i];
-			pn[i] = rn[i] + beta * pn[i];
-			pnorm = cabs(pn[i]);
-			lpnorm += pnorm * pnorm;
-		}
+		lpnorm = vcgupd (sol, pn, rn, alpha, beta, nelt);
 
 		/* Reduce the new search norm. */
-		MPI_Allreduce (&lpnorm, &pnorm, 1, MPIREAL, MPI_SUM, MPI_COMM_WORLD);
+		MPI_Allreduce (&lpnorm, &pnorm, 1, MPIREAL, MPI_SUM, fmaconf.comm);
 
 		if (sqrt(rnorm / rninc) < slv->epscg) break;
 	}
@@ -113,13 +102,10 @@ real cgmn (cplx *rhs, cplx *sol, solveparm *slv,
 	asol = pn + nmeas;
 
 	/* Initialize some values. */
-	rnorm = 0;
-	for (i = 0; i < nmeas; ++i) {
-		pn[i] = rn[i] = rhs[i];
-		alpha = cabs (rhs[i]);
-		rnorm += alpha * alpha;
-		asol[i] = 0;
-	}
+	memcpy (rn, rhs, nmeas * sizeof(cplx));
+	memcpy (pn, rhs, nmeas * sizeof(cplx));
+	memset (asol, 0, nmeas * sizeof(cplx));
+	rnorm = vnrm2 (rhs, nmeas);
 
 	pnorm = (rninc = rnorm);
 
@@ -127,49 +113,45 @@ real cgmn (cplx *rhs, cplx *sol, solveparm *slv,
 		alpha = 0;
 		memset (adjcrt, 0, nelt * sizeof(cplx));
 		for (i = 0, mptr = pn; i < src->count; ++i, mptr += obs->count) {
-			/* Build the incident field. */
-			buildrhs (ifld, src->locations + 3 * i, src->plane, NULL);
-			/* Solve for the internal field. */
-			bicgstab (ifld, ifld, 0, slv->maxit, slv->epscg, 1);
+			/* Another group handles this transmitter. */
+			if (!grpmine (i)) continue;
+			/* Find the internal field. */
+			fcfield (ifld, src, i, slv);
 			/* Compute the adjoint Frechet derivative. */
 			frechadj (mptr, ifld, adjcrt, obs, slv);
 		}
 
-		for (i = 0, lrnorm = 0; i < nelt; ++i) {
-			alpha = cabs (adjcrt[i]);
-			lrnorm += alpha * alpha;
-		}
+		/* Combine the contributions of all groups. */
+		grpsum (adjcrt, 2 * nelt, MPIREAL);
+
+		lrnorm = vnrm2 (adjcrt, nelt);
 
-		MPI_Allreduce (&lrnorm, &alpha, 1, MPIREAL, MPI_SUM, MPI_COMM_WORLD);
+		MPI_Allreduce (&lrnorm, &alpha, 1, MPIREAL, MPI_SUM, fmaconf.comm);
 
 		alpha  = rnorm / (alpha + regparm * pnorm);
 		beta = rnorm;
 
+		/* Measurements of other groups remain zero until combined. */
+		memset (scat, 0, nmeas * sizeof(cplx));
 		for (i = 0, mptr = scat; i < src->count; ++i, mptr += obs->count) {
-			/* Build the incident field. */
-			buildrhs (ifld, src->locations + 3 * i, src->plane, NULL);
-			/* Solve for the internal field. */
-			bicgstab (ifld, ifld, 0, slv->maxit, slv->epscg, 1);
+			/* Another group handles this transmitter. */
+			if (!grpmine (i)) continue;
+			/* Find the internal field. */
+			fcfield (ifld, src, i, slv);
 			/* Compute the adjoint Frechet derivative. */
 			frechet (adjcrt, ifld, mptr, obs, slv);
 		}
 
+		/* Combine the contributions of all groups. */
+		grpsum (scat, 2 * nmeas, MPIREAL);
+
 		/* Update the residual. */
-		for (i = 0, rnorm = 0; i < nmeas; ++i) {
-			rn[i] -= alpha * (scat[i] + regparm * pn[i]);
-			lrnorm = cabs (rn[i]);
-			rnorm += lrnorm * lrnorm;
-		}
+		rnorm = vupdnrm (rn, -alpha, scat, -alpha * regparm, pn, nmeas);
 
 		beta = rnorm / beta;
 
 		/* Update the solution and the search vector. */
-		for (i = 0, pnorm = 0; i < nmeas; ++i) {
-			asol[i] += alpha * pn[i];
-			pn[i] = rn[i] + beta * pn[i];
-			lrnorm = cabs(pn[i]);
-			pnorm += lrnorm * lrnorm;
-		}
+		pnorm = vcgupd (asol, pn, rn, alpha, beta, nmeas);
 
 		if (sqrt(rnorm / rninc) < slv->epscg) break;
 	}
@@ -177,14 +159,17 @@ real cgmn (cplx *rhs, cplx *sol, solveparm *slv,
 	memset (sol, 0, nelt * sizeof(cplx));
 	/* Compute the adjoint acting on the RHS. */
 	for (i = 0, mptr = asol; i < src->count; ++i, mptr += obs->count) {
-		/* Build the incident field. */
-		buildrhs (ifld, src->locations + 3 * i, src->plane, NULL);
-		/* Solve for the internal field. */
-		bicgstab (ifld, ifld, 0, slv->maxit, slv->epscg, 1);
+		/* Another group handles this transmitter. */
+		if (!grpmine (i)) continue;
+		/* Find the internal field. */
+		fcfield (ifld, src, i, slv);
 		/* The contribution to the adjoint Frechet derivative. */
 		frechadj (mptr, ifld, sol, obs, slv);
 	}
 
+	/* Combine the contributions of all groups. */
+	grpsum (sol, 2 * nelt, MPIREAL);
+
 	free (ifld);
 	free (scat);
 
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "util.h"
+#include "fldcache.h"
+#include "ckpt.h"
+
+/* Identify checkpoint files and their layout version. */
+#define CKMAGIC 0x434b5054
+#define CKVERSION 1
+
+/* The largest number of segments in a checkpoint. */
+#define CKMAXSEG 32
+
+/* Segments are described to MPI in blocks of at most this many bytes,
+ * because block lengths in derived datatypes are limited to an int. */
+#define CKBLOCK (1L << 30)
+
+/* The local state of a checkpoint is a list of memory segments, registered
+ * in the same order on every process, optionally followed by the cached
+ * transmitter fields. The file holds a header, the segment sizes of every
+ * process and then the local state of each process in rank order, so a
+ * checkpoint can only be read with the process layout that wrote it.
+ * All I/O is collective over MPI_COMM_WORLD rather than a group
+ * communicator: a checkpoint captures the state of every group in one
+ * file, so every process must take part. */
+static void *ckptr[CKMAXSEG];
+static long cklen[CKMAXSEG];
+static int cknseg = 0;
+
+/* Forget the registered segments. */
+void ckclear (void) {
+	cknseg = 0;
+}
+
+/* Register len bytes at ptr as the next segment. Returns the number of
+ * registered segments, or -1 if there is no room. */
+int ckadd (void *ptr, long len) {
+	if (cknseg >= CKMAXSEG) return -1;
+
+	ckptr[cknseg] = ptr;
+	cklen[cknseg] = len;
+
+	return ++cknseg;
+}
+
+/* Build a datatype covering the first nseg registered segments, which are
+ * transferred in one collective operation. Large segments are split into
+ * several blocks of at most CKBLOCK bytes. */
+static MPI_Datatype cktype (int nseg) {
+	MPI_Datatype type;
+	MPI_Aint *disp, base;
+	int i, nblk, *len;
+	long k;
+
+	for (i = 0, nblk = 0; i < nseg; ++i)
+		nblk += (int)((cklen[i] + CKBLOCK - 1) / CKBLOCK);
+
+	disp = malloc (MAX(nblk, 1) * sizeof(MPI_Aint));
+	len = malloc (MAX(nblk, 1) * sizeof(int));
+
+	for (i = 0, nblk = 0; i < nseg; ++i) {
+		MPI_Get_address (ckptr[i], &base);
+		for (k = 0; k < cklen[i]; k += CKBLOCK, ++nblk) {
+			disp[nblk] = base + (MPI_Aint)k;
+			len[nblk] = (int)MIN(cklen[i] - k, CKBLOCK);
+		}
+	}
+
+	MPI_Type_create_hindexed (nblk, len, disp, MPI_BYTE, &type);
+	MPI_Type_commit (&type);
+
+	free (disp);
+	free (len);
+
+	return type;
+}
+
+/* Write the registered segments and, if usefc is true, the cached fields of
+ * all processes to fname. The file is written under a temporary name and
+ * renamed when complete, so an interrupted write leaves the previous
+ * checkpoint intact. Returns 1 on success, 0 otherwise. */
+int ckwrite (char *fname, int usefc) {
+	char tname[1024];
+	int rank, size, hdr[4], ok = 1, i;
+	long *sz;
+	MPI_Offset off, local;
+	MPI_Datatype type;
+	MPI_File fh;
+	MPI_Status stat;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_size (MPI_COMM_WORLD, &size);
+
+	snprintf (tname, sizeof(tname), "%s.tmp", fname);
+	if (MPI_File_open (MPI_COMM_WORLD, tname, MPI_MODE_WRONLY | MPI_MODE_CREATE,
+				MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+		if (!rank) fprintf (stderr, "ERROR: could not open %s.\n", tname);
+		return 0;
+	}
+	MPI_File_set_size (fh, 0);
+
+	/* Record the local segment sizes, including the cache. */
+	sz = malloc ((CKMAXSEG + 1) * sizeof(long));
+	memcpy (sz, cklen, cknseg * sizeof(long));
+	sz[cknseg] = usefc ? fcsize () : 0;
+	for (i = 0, local = 0; i <= cknseg; ++i) local += sz[i];
+
+	hdr[0] = CKMAGIC;
+	hdr[1] = CKVERSION;
+	hdr[2] = size;
+	hdr[3] = cknseg;
+
+	if (!rank) MPI_File_write_at (fh, 0, hdr, 4, MPI_INT, &stat);
+
+	off = 4 * sizeof(int) + (MPI_Offset)rank * (cknseg + 1) * sizeof(long);
+	MPI_File_write_at_all (fh, off, sz, (cknseg + 1) * sizeof(long), MPI_BYTE, &stat);
+
+	/* The local state follows the states of lower ranks. */
+	MPI_Exscan (&local, &off, 1, MPI_OFFSET, MPI_SUM, MPI_COMM_WORLD);
+	if (!rank) off = 0;
+	off += 4 * sizeof(int) + (MPI_Offset)size * (cknseg + 1) * sizeof(long);
+
+	type = cktype (cknseg);
+	if (MPI_File_write_at_all (fh, off, MPI_BOTTOM, 1, type, &stat) != MPI_SUCCESS) ok = 0;
+	MPI_Type_free (&type);
+
+	off += local - sz[cknseg];
+	if (usefc) fcsave (fh, off);
+
+	free (sz);
+
+	MPI_File_close (&fh);
+
+	MPI_Allreduce (MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+	if (ok && !rank && rename (tname, fname)) {
+		fprintf (stderr, "ERROR: could not rename %s.\n", tname);
+		ok = 0;
+	}
+	MPI_Bcast (&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+	return ok;
+}
+
+/* Read the registered segments, which must be the first segments of the
+ * checkpoint in fname with matching sizes, and, if usefc is true and every
+ * segment is registered, the cached fields. Returns 1 on success and 0 if
+ * the checkpoint is missing or does not match on any process. */
+int ckread (char *fname, int usefc) {
+	int rank, size, hdr[4], ok, i;
+	long *sz;
+	MPI_Offset off, local;
+	MPI_Datatype type;
+	MPI_File fh;
+	MPI_Status stat;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_size (MPI_COMM_WORLD, &size);
+
+	if (MPI_File_open (MPI_COMM_WORLD, fname, MPI_MODE_RDONLY,
+				MPI_INFO_NULL, &fh) != MPI_SUCCESS) return 0;
+
+	MPI_File_read_at_all (fh, 0, hdr, 4, MPI_INT, &stat);
+
+	ok = (hdr[0] == CKMAGIC && hdr[1] == CKVERSION &&
+			hdr[2] == size && hdr[3] >= cknseg);
+	MPI_Allreduce (MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+	if (!ok) {
+		if (!rank) fprintf (stderr, "ERROR: %s does not match this run.\n", fname);
+		MPI_File_close (&fh);
+		return 0;
+	}
+
+	/* Compare the saved segment sizes with the registered ones. */
+	sz = malloc ((hdr[3] + 1) * sizeof(long));
+	off = 4 * sizeof(int) + (MPI_Offset)rank * (hdr[3] + 1) * sizeof(long);
+	MPI_File_read_at_all (fh, off, sz, (hdr[3] + 1) * sizeof(long), MPI_BYTE, &stat);
+
+	for (i = 0, ok = 1; i < cknseg; ++i) ok = ok && (sz[i] == cklen[i]);
+	for (i = 0, local = 0; i <= hdr[3]; ++i) local += sz[i];
+
+	MPI_Allreduce (MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+	if (!ok) {
+		if (!rank) fprintf (stderr, "ERROR: %s does not match the local state.\n", fname);
+		free (sz);
+		MPI_File_close (&fh);
+		return 0;
+	}
+
+	MPI_Exscan (&local, &off, 1, MPI_OFFSET, MPI_SUM, MPI_COMM_WORLD);
+	if (!rank) off = 0;
+	off += 4 * sizeof(int) + (MPI_Offset)size * (hdr[3] + 1) * sizeof(long);
+
+	type = cktype (cknseg);
+	MPI_File_read_at_all (fh, off, MPI_BOTTOM, 1, type, &stat);
+	MPI_Type_free (&type);
+
+	/* The cache follows all of the segments. */
+	if (usefc && cknseg == hdr[3] && sz[hdr[3]] > 0)
+		fcrestore (fh, off + local - sz[hdr[3]]);
+
+	free (sz);
+	MPI_File_close (&fh);
+
+	return 1;
+}
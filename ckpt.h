@@ -0,0 +1,9 @@
+#ifndef __CKPT_H_
+#define __CKPT_H_
+
+void ckclear (void);
+int ckadd (void *, long);
+int ckwrite (char *, int);
+int ckread (char *, int);
+
+#endif /* __CKPT_H_ */
@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "compress.h"
+#include "util.h"
+
+/* The largest magnitudes of the quantized components. */
+#define Q16 32767
+#define Q8 127
+
+/* Return the size of one stored complex value in the specified format. */
+static size_t cvsize (int fmt) {
+	switch (fmt) {
+	case CV_I16:
+		return 2 * sizeof(int16_t);
+	case CV_I8:
+		return 2 * sizeof(int8_t);
+	default:
+		return sizeof(cplx);
+	}
+}
+
+/* Store the vector v of local length n in the most compact format for which
+ * the norm of the distributed quantization error does not exceed tol times the
+ * norm of v. A nonpositive tolerance forces full precision. Every process
+ * selects the same format, but the scales are local. Returns the format. */
+int cvstore (cvec *cv, cplx *v, long n, real tol) {
+	long j;
+	int fmt = CV_FULL;
+	real amax = 0., s16, s8, errs[3] = { 0., 0., 0. };
+
+	if (tol > 0) {
+		/* Find the largest component magnitude. */
+		for (j = 0; j < n; ++j) {
+			amax = MAX(amax, fabs(creal(v[j])));
+			amax = MAX(amax, fabs(cimag(v[j])));
+		}
+
+		if (amax <= 0) amax = 1.;
+		s16 = amax / Q16;
+		s8 = amax / Q8;
+
+		/* Measure the quantization errors for both formats. */
+#pragma omp parallel for default(shared) private(j) reduction(+:errs[:3])
+		for (j = 0; j < n; ++j) {
+			real re = creal(v[j]), im = cimag(v[j]), d;
+
+			d = re - s16 * rint(re / s16);
+			errs[0] += d * d;
+			d = im - s16 * rint(im / s16);
+			errs[0] += d * d;
+
+			d = re - s8 * rint(re / s8);
+			errs[1] += d * d;
+			d = im - s8 * rint(im / s8);
+			errs[1] += d * d;
+
+			errs[2] += re * re + im * im;
+		}
+
+		MPI_Allreduce (MPI_IN_PLACE, errs, 3, MPIREAL, MPI_SUM, fmaconf.comm);
+
+		tol *= tol * errs[2];
+		if (errs[1] <= tol) fmt = CV_I8;
+		else if (errs[0] <= tol) fmt = CV_I16;
+	}
+
+	/* Reallocate the storage if the format has changed. */
+	if (!cv->data || cv->fmt != fmt) {
+		free (cv->data);
+		cv->data = malloc (n * cvsize (fmt));
+	}
+
+	cv->fmt = fmt;
+
+	switch (fmt) {
+	case CV_I16:
+		cv->scale = amax / Q16;
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < n; ++j) {
+			((int16_t *)cv->data)[2 * j] = rint(creal(v[j]) / cv->scale);
+			((int16_t *)cv->data)[2 * j + 1] = rint(cimag(v[j]) / cv->scale);
+		}
+		break;
+	case CV_I8:
+		cv->scale = amax / Q8;
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < n; ++j) {
+			((int8_t *)cv->data)[2 * j] = rint(creal(v[j]) / cv->scale);
+			((int8_t *)cv->data)[2 * j + 1] = rint(cimag(v[j]) / cv->scale);
+		}
+		break;
+	default:
+		cv->scale = 1.;
+		memcpy (cv->data, v, n * sizeof(cplx));
+	}
+
+	return fmt;
+}
+
+/* Decompress the stored vector into v. */
+int cvload (cplx *v, cvec *cv, long n) {
+	memset (v, 0, n * sizeof(cplx));
+	return cvaxpy (v, 1., cv, n);
+}
+
+/* Augment v with a times the stored vector, decompressing on the fly. An
+ * empty vector or zero coefficient leaves v unchanged. */
+int cvaxpy (cplx *v, cplx a, cvec *cv, long n) {
+	long j;
+	cplx as;
+
+	if (!cv->data || a == 0) return 0;
+
+	as = a * cv->scale;
+
+	switch (cv->fmt) {
+	case CV_I16:
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < n; ++j)
+			v[j] += as * (((int16_t *)cv->data)[2 * j]
+					+ I * ((int16_t *)cv->data)[2 * j + 1]);
+		break;
+	case CV_I8:
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < n; ++j)
+			v[j] += as * (((int8_t *)cv->data)[2 * j]
+					+ I * ((int8_t *)cv->data)[2 * j + 1]);
+		break;
+	default:
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < n; ++j) v[j] += a * ((cplx *)cv->data)[j];
+	}
+
+	return 1;
+}
+
+/* Compute the inner product of the stored vector with the distributed v. */
+static cplx cvdot (cvec *cv, cplx *v, long n) {
+	/* Always compute the product in double precision to avoid rounding errors. */
+	complex double dp = 0.0;
+	long j;
+
+	switch (cv->fmt) {
+	case CV_I16:
+#pragma omp parallel for default(shared) private(j) reduction(+:dp)
+		for (j = 0; j < n; ++j)
+			dp += (((int16_t *)cv->data)[2 * j]
+				- I * ((int16_t *)cv->data)[2 * j + 1]) * v[j];
+		break;
+	case CV_I8:
+#pragma omp parallel for default(shared) private(j) reduction(+:dp)
+		for (j = 0; j < n; ++j)
+			dp += (((int8_t *)cv->data)[2 * j]
+				- I * ((int8_t *)cv->data)[2 * j + 1]) * v[j];
+		break;
+	default:
+#pragma omp parallel for default(shared) private(j) reduction(+:dp)
+		for (j = 0; j < n; ++j) dp += conj(((cplx *)cv->data)[j]) * v[j];
+	}
+
+	dp *= cv->scale;
+
+	/* Add in the contributions from other processors. */
+	MPI_Allreduce (MPI_IN_PLACE, &dp, 2, MPI_DOUBLE, MPI_SUM, fmaconf.comm);
+
+	return (cplx)dp;
+}
+
+/* Orthogonalize v against the nv stored vectors s with modified Gram-Schmidt,
+ * exactly as cmgs does for uncompressed vectors. */
+int cvmgs (cplx *v, cplx *c, cvec *s, long n, int nv) {
+	long j;
+	int i;
+	cplx cv;
+	real vnrm, lcrit;
+
+	/* Perform the first modified Gram Schmidt orthogonalization. */
+	for (i = 0, lcrit = 0.; i < nv; ++i) {
+		/* The projection of the vector onto the current basis. */
+		c[i] = cvdot (s + i, v, n);
+
+		/* Track the 1-norm of the projection column. */
+		lcrit += cabs(c[i]);
+
+		cvaxpy (v, -c[i], s + i, n);
+	}
+
+	/* Compute the norm of the vector. */
+	c[nv] = parnorm (v, n);
+	vnrm = creal(c[nv]);
+
+	/* Reorthogonalize if necessary. */
+	if (lcrit / vnrm > IMGS_L) {
+		for (i = 0; i < nv; ++i) {
+			/* Re-project the vector onto the current basis. */
+			cv = cvdot (s + i, v, n);
+
+			/* Update the projection. */
+			c[i] += cv;
+
+			/* Remove the remaining parallel component. */
+			cvaxpy (v, -cv, s + i, n);
+		}
+
+		/* Update the norm of the orthogonal vector. */
+		c[nv] = parnorm (v, n);
+		vnrm = creal(c[nv]);
+	}
+
+	/* Don't normalize if the norm is vanishing. */
+	if (vnrm < REAL_EPSILON) return n;
+
+	/* Finally, normalize the newly-created vector. */
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < n; ++j) v[j] /= vnrm;
+
+	return n;
+}
+
+/* Release the storage of a compressed vector. */
+void cvfree (cvec *cv) {
+	free (cv->data);
+	cv->data = NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef __COMPRESS_H_
+#define __COMPRESS_H_
+
+#include "precision.h"
+
+/* Storage formats for compressed vectors. */
+#define CV_FULL 0
+#define CV_I16 1
+#define CV_I8 2
+
+/* A locally stored portion of a distributed vector, kept at full precision or
+ * quantized to integers with a per-process scale. */
+typedef struct {
+	int fmt;
+	real scale;
+	void *data;
+} cvec;
+
+int cvstore (cvec *, cplx *, long, real);
+int cvload (cplx *, cvec *, long);
+int cvaxpy (cplx *, cplx, cvec *, long);
+int cvmgs (cplx *, cplx *, cvec *, long, int);
+void cvfree (cvec *);
+
+#endif /* __COMPRESS_H_ */
@@ -116,6 +116,9 @@ void getconfig (char *fname, solveparm *hislv, solveparm *loslv) {
 	/* The total number of basis functions in a box. */
 	fmaconf.bspboxvol = fmaconf.bspbox * fmaconf.bspbox * fmaconf.bspbox;
 
+	/* By default, each basis carries a single right-hand side. */
+	fmaconf.nrhs = 1;
+
 	/* Compute the number of finest-level groups for use with the FMM. */
 	fmaconf.nx = GEDIV(fmaconf.nx,fmaconf.bspbox);
 	fmaconf.ny = GEDIV(fmaconf.ny,fmaconf.bspbox);
@@ -160,6 +163,12 @@ void getconfig (char *fname, solveparm *hislv, solveparm *loslv) {
 	fgets (buf, 1024, fp);
 	sscanf (buf, "%d %d %lf", &(hislv->maxit), &(hislv->restart), rbuf);
 	hislv->epscg = (real) rbuf[0];
+	/* Subspace recycling, inner solves, projected initial guesses
+	 * and IDR(s) are enabled on the command line. */
+	hislv->idrdim = 0;
+	hislv->rcy = NULL;
+	hislv->inner = NULL;
+	hislv->gsp = NULL;
 
 	/* Read the low-accuracy iterative solver configuration, if desired. */
 	skipcomments (fp);
@@ -167,6 +176,10 @@ void getconfig (char *fname, solveparm *hislv, solveparm *loslv) {
 	if (loslv) {
 		sscanf (buf, "%d %d %lf", &(loslv->maxit), &(loslv->restart), rbuf);
 		loslv->epscg = (real) rbuf[0];
+		loslv->idrdim = 0;
+		loslv->rcy = NULL;
+		loslv->inner = NULL;
+		loslv->gsp = NULL;
 	}
 
 	fclose (fp);
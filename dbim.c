@@ -13,21 +13,59 @@
 #include "measure.h"
 #include "frechet.h"
 #include "direct.h"
+#include "precond.h"
 #include "config.h"
 #include "mlfma.h"
 #include "io.h"
 #include "cg.h"
+#include "fldcache.h"
+#include "groups.h"
+#include "mgrid.h"
+#include "lbfgs.h"
+#include "ckpt.h"
 
 #include "util.h"
 
 void usage (char *name) {
-	fprintf (stderr, "Usage: %s [-s #] [-r #] [-a #] [-n #] \n"
+	fprintf (stderr, "Usage: %s [-s #] [-r #] [-a #] [-n #] [-k k[,m]] [-I #] [-R] [-g #] [-F i[,t[,m]]] [-L] [-D] [-E q[,t]] [-S t[,l]] [-G #] [-B f[,s]] [-C #] [-Q #] [-T] [-w #] [-W] [-m] [-p] [-c]\n"
 			 "       -s <src> -r <obs> [-o <prefix>] -i <prefix>\n", name);
 	fprintf (stderr, "  -i: Specify input file prefix\n");
 	fprintf (stderr, "  -o: Specify output file prefix (defaults to input prefix)\n");
 	fprintf (stderr, "  -v #: The number of per-leap simultaneous views (default: 1)\n");
-	fprintf (stderr, "  -e #: The number of iterations for spectral radius estimation (default: none)\n");
+	fprintf (stderr, "  -e #: The maximum number of Lanczos iterations for spectral radius estimation\n"
+			 "      (default: none)\n");
 	fprintf (stderr, "  -a: Use ACA with specified tolerance for far-field transformations\n");
+	fprintf (stderr, "  -k k[,m]: Use GCRO-DR with k recycled vectors and cycles of m iterations (default: 4k)\n");
+	fprintf (stderr, "  -I #: Use IDR(s) with the specified shadow-space dimension for all solves\n");
+	fprintf (stderr, "  -R: Relax the far-field accuracy as the residual of each solve decreases\n");
+	fprintf (stderr, "  -g #: Project initial guesses from the specified number of previous solutions\n");
+	fprintf (stderr, "  -F i[,t[,m]]: Use FGMRES(m) (default: 20) for forward solves, with i inner iterations\n"
+			 "      that use far-field ranks truncated at relative tolerance t (default: 1e-2)\n");
+	fprintf (stderr, "  -L: Use single-precision operators for inner solves (mixed-precision builds)\n");
+	fprintf (stderr, "  -D: Solve once per DBIM iteration for receiver fields that make Frechet\n"
+			 "      derivatives dense products\n");
+	fprintf (stderr, "  -E q[,t]: Invert with q encoded sources per iteration, each superimposing\n"
+			 "      all sources with random signs (t = 0, default) or phases (t = 1)\n");
+	fprintf (stderr, "  -S t[,l]: Invert with principal sources whose singular values exceed t\n"
+			 "      relative to the largest, sketched with l random source combinations\n");
+	fprintf (stderr, "  -G #: Split the processes into the specified number of groups, each of which\n"
+			 "      handles its own transmitters\n");
+	fprintf (stderr, "  -B f[,s]: Use the Born approximation, without inner solves, for Frechet\n"
+			 "      derivatives in the first f iterations of the first pass and the first s\n"
+			 "      (default: 0) iterations of the second pass\n");
+	fprintf (stderr, "  -C #: Run the first DBIM pass on grids with up to 2^# times larger cells,\n"
+			 "      coarsest first, and the second pass on the full grid\n");
+	fprintf (stderr, "  -Q #: Replace the CG steps of the second pass with L-BFGS steps that keep\n"
+			 "      the specified number of correction pairs\n");
+	fprintf (stderr, "  -T: Loosen the solver tolerances of each DBIM step with Eisenstat-Walker\n"
+			 "      forcing terms from the decrease in the error, down to the configured values\n");
+	fprintf (stderr, "  -w #: Write a checkpoint to the output-prefixed file after every # updates\n"
+			 "      (default: none)\n");
+	fprintf (stderr, "  -W: Resume from the checkpoint, which requires the same processes and options\n");
+	fprintf (stderr, "  -m: Only update the contrast on the nonzero voxels of the input-prefixed\n"
+			 "      group-ordered mask file\n");
+	fprintf (stderr, "  -p: Use a block-Jacobi preconditioner built from the self-group interactions\n");
+	fprintf (stderr, "  -c: Add a coarse-grid correction to the preconditioner (implies -p)\n");
 	fprintf (stderr, "  -n: Specify number of points for near-field integration\n");
 	fprintf (stderr, "  -s: Specify the source location or range\n");
 	fprintf (stderr, "  -r: Specify the observer range\n");
@@ -37,8 +75,8 @@ void usage (char *name) {
 real dbimerr (cplx *error, cplx *rn, cplx *field,
 	solveparm *hislv, solveparm *loslv, measdesc *src, measdesc *obs) {
 	cplx *rhs, *crt, *err, *fldptr;
-	real errnorm = 0, lerr, errd = 0;
-	int j, i, nit;
+	real errnorm[2] = { 0., 0. }, lerr, *loc;
+	int j, i, nit, warm;
 	long k, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
 
 	if (!error) err = malloc (obs->count * sizeof(cplx));
@@ -49,36 +87,58 @@ real dbimerr (cplx *error, cplx *rn, cplx *field,
 
 	if (rn) memset (rn, 0, nelt * sizeof(cplx));
 
+	/* Transmitters are solved one at a time rather than with the block
+	 * solvers: each carries its own cached field and warm start, and
+	 * the groups already spread transmitters across the processes. */
 	for (j = 0, fldptr = field; j < src->count; ++j, fldptr += obs->count) {
-		/* Build the right-hand side for the specified location. Use
-		 * point sources, rather than plane waves, for excitation. */
-		buildrhs (rhs, src->locations + 3 * j, src->plane, NULL);
+		/* Another group handles this transmitter. */
+		if (!grpmine (j)) {
+			if (error) {
+				memset (err, 0, obs->count * sizeof(cplx));
+				err += obs->count;
+			}
+			continue;
+		}
+
+		loc = src->locations + 3 * j;
+
+		/* Reuse the total field if it is known for this contrast. */
+		if (!fcload (crt, loc, src->plane, hislv->epscg)) {
+			/* Build the right-hand side for the specified location. Use
+			 * point sources, rather than plane waves, for excitation. */
+			srcrhs (rhs, src, j);
+
+			/* Start from the field for the previous contrast, if known. */
+			warm = fcguess (crt, loc, src->plane);
+
+			MPI_Barrier (fmaconf.comm);
+			/* Run the iterative solver. The solution is stored in crt. */
+			for (i = 0, nit = 1; i < hislv->restart && nit > 0; ++i)
+				nit = itsolve (rhs, crt, i || warm, hislv, 1);
 
-		MPI_Barrier (MPI_COMM_WORLD);
-		/* Run the iterative solver. The solution is stored in the RHS. */
-		for (i = 0, nit = 1; i < hislv->restart && nit > 0; ++i)
-			nit = bicgstab (rhs, crt, i, hislv->maxit, hislv->epscg, 1);
+			/* Keep the field for the Frechet derivatives. */
+			fcstore (crt, loc, src->plane, hislv->epscg);
+		}
 
 		/* Convert total field into contrast current. */
-		for (k = 0; k < nelt; ++k)
-			crt[k] *= fmaconf.contrast[k];
+		vmuladd (rhs, crt, fmaconf.contrast, NULL, nelt);
 
-		MPI_Barrier (MPI_COMM_WORLD);
+		MPI_Barrier (fmaconf.comm);
 
 		/* Evaluate the scattered field. */
-		farfield (crt, obs, err);
+		farfield (rhs, obs, err);
 
 		/* Compute the error vector. */
 		for (k = 0; k < obs->count; ++k) {
 			err[k] = fldptr[k] - err[k];
 			lerr = cabs(err[k]);
-			errnorm += lerr * lerr;
+			errnorm[0] += lerr * lerr;
 			lerr = cabs(fldptr[k]);
-			errd += lerr * lerr;
+			errnorm[1] += lerr * lerr;
 		}
 
 		/* Evaluate the adjoint Frechet derivative. */
-		if (rn) frechadj (err, rhs, rn, obs, loslv);
+		if (rn) frechadj (err, crt, rn, obs, loslv);
 		/* Save this error column, if storage is available. */
 		if (error) err += obs->count;
 	}
@@ -86,7 +146,284 @@ real dbimerr (cplx *error, cplx *rn, cplx *field,
 	free (rhs);
 	if (!error && err) free (err);
 
-	return sqrt(errnorm / errd);
+	/* Combine the contributions of all groups. */
+	grpsum (errnorm, 2, MPIREAL);
+	if (error) grpsum (error, 2 * src->count * obs->count, MPIREAL);
+	if (rn) grpsum (rn, 2 * nelt, MPIREAL);
+
+	return sqrt(errnorm[0] / errnorm[1]);
+}
+
+/* Read a contrast file, written for groups with fbpb cells per dimension, and
+ * average it onto the current grid. Returns the number of groups read. */
+static int getctlev (cplx *crt, char *fname, int *gsize, int fbpb) {
+	cplx *buf;
+	int n;
+
+	if (fbpb == fmaconf.bspbox)
+		return getctgrp (crt, fname, gsize, fmaconf.bslist,
+				fmaconf.numbases, fmaconf.bspbox);
+
+	buf = malloc ((long)fmaconf.numbases * fbpb * fbpb * fbpb * sizeof(cplx));
+	n = getctgrp (buf, fname, gsize, fmaconf.bslist, fmaconf.numbases, fbpb);
+	mgrestrict (crt, buf, fbpb);
+	free (buf);
+
+	return n;
+}
+
+/* Add an update to the contrast and refresh any solver state that
+ * depends on the scattering operator. */
+void ctupdate (cplx *crt, solveparm *slv) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+
+	/* Only unknowns in the inversion mask are updated. */
+	roiapply (crt);
+	vaxpby (fmaconf.contrast, 1., crt, 1., nelt);
+
+	/* The preconditioner depends on the contrast. */
+	if (pcready()) pcbuild ();
+
+	/* The recycled space must satisfy C = A U for the new operator. */
+	if (slv->rcy) recupdate (slv->rcy);
+
+	/* Previous solutions no longer satisfy the system. */
+	if (slv->gsp) slv->gsp->ntot = 0;
+
+	/* Cached total fields belong to the old contrast, but remain useful
+	 * as initial guesses. */
+	fcclear ();
+	rcvclear ();
+}
+
+/* The sufficient-decrease constant and the maximum number of backtracking
+ * steps for the quasi-Newton line search. */
+#define QNARMIJO 1e-4
+#define QNMAXLS 4
+
+/* The minimum number of Lanczos iterations for the curvature estimate that
+ * scales the first quasi-Newton step. */
+#define QNSPECIT 5
+
+/* The regularized objective of the quasi-Newton mode is half the squared
+ * measurement misfit, fm, plus gamma / 2 times the squared distance of the
+ * contrast from the anchor anc, as for the Tikhonov terms of the CG steps.
+ * The misfit gradient is gm, and dnrm is the squared norm of the measurements.
+ * Take one L-BFGS step with a backtracking line search on the measurement
+ * residual and update fm and gm. A failed search returns to the best contrast
+ * tried, or the starting one, and discards the history. Returns the relative
+ * residual at the new contrast. */
+real qnstep (qnspace *qn, cplx *gm, real *fm, cplx *anc, real gamma,
+		real h0, real dnrm, cplx *field, solveparm *hislv,
+		solveparm *loslv, measdesc *src, measdesc *obs) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	cplx *g, *p, *dc, *rn;
+	real f0, f1, fbest, d0, alpha, abest, anew, dist, err = 0;
+	int j, ok;
+
+	g = malloc (4L * nelt * sizeof(cplx));
+	p = g + nelt;
+	dc = p + nelt;
+	rn = dc + nelt;
+
+	/* The objective and its gradient at the current contrast. */
+	vaxpby (dc, 1., fmaconf.contrast, 0., nelt);
+	vaxpby (dc, -1., anc, 1., nelt);
+	dist = parnorm (dc, nelt);
+	f0 = *fm + 0.5 * gamma * dist * dist;
+	vaxpby (g, 1., gm, 0., nelt);
+	vaxpby (g, gamma, dc, 1., nelt);
+
+	/* Fall back to steepest descent if curvature has been lost. */
+	if ((d0 = qndir (p, g, qn, h0)) >= 0) {
+		qnreset (qn);
+		d0 = qndir (p, g, qn, h0);
+	}
+
+	/* Try the full step first and backtrack along the parabola through
+	 * the objective values and the initial slope. Trials only need the
+	 * misfit, not its gradient. */
+	ctupdate (p, hislv);
+	for (j = 0, alpha = 1., abest = 0., fbest = f0; ; ++j) {
+		err = dbimerr (NULL, NULL, field, hislv, loslv, src, obs);
+
+		vaxpby (dc, 1., fmaconf.contrast, 0., nelt);
+		vaxpby (dc, -1., anc, 1., nelt);
+		dist = parnorm (dc, nelt);
+		f1 = 0.5 * err * err * dnrm + 0.5 * gamma * dist * dist;
+
+		if (f1 < fbest) {
+			fbest = f1;
+			abest = alpha;
+		}
+
+		if ((ok = (f1 <= f0 + QNARMIJO * alpha * d0)) || j == QNMAXLS - 1) break;
+
+		anew = -0.5 * d0 * alpha * alpha / (f1 - f0 - d0 * alpha);
+		anew = MIN(MAX(anew, 0.1 * alpha), 0.5 * alpha);
+
+		vaxpby (dc, anew - alpha, p, 0., nelt);
+		ctupdate (dc, hislv);
+		alpha = anew;
+	}
+
+	/* Without sufficient decrease, never keep a step that went uphill. */
+	if (!ok && abest != alpha) {
+		vaxpby (dc, abest - alpha, p, 0., nelt);
+		ctupdate (dc, hislv);
+		alpha = abest;
+	}
+
+	/* The misfit gradient is the negative adjoint of the residual. After
+	 * an accepted trial, its total fields are still cached. */
+	err = dbimerr (NULL, rn, field, hislv, loslv, src, obs);
+	*fm = 0.5 * err * err * dnrm;
+	vaxpby (gm, -1., rn, 0., nelt);
+
+	/* Record the step and the change in the full gradient. A failed line
+	 * search invalidates the curvature history. */
+	if (ok) {
+		vaxpby (p, alpha, p, 0., nelt);
+		vaxpby (dc, gamma, dc, 0., nelt);
+		vaxpby (dc, 1., gm, 1., nelt);
+		vaxpby (dc, -1., g, 1., nelt);
+		qnpush (qn, p, dc);
+	} else qnreset (qn);
+
+	free (g);
+
+	return err;
+}
+
+/* The initial and largest forcing term, and the scale, of the second choice
+ * of Eisenstat and Walker with exponent 2. */
+#define EWMAX 0.5
+#define EWGAMMA 0.9
+
+/* The largest forward tolerance relative to the error. */
+#define EWFWD 0.1
+
+/* The state of the inexact-Newton controller: the forcing term, the last
+ * relative residual error (zero before the first), the configured forward
+ * and low-accuracy tolerances and the inner-solve tolerance. */
+typedef struct {
+	real eta, err, tol[2], innertol;
+} ewctl;
+
+/* Set the tolerances for the forcing term eta and the error err. Forward
+ * solves are loosened in proportion to the forcing term, but are kept
+ * below a fraction of the error; CG and Frechet solves stop at the forcing
+ * term. Neither is tighter than configured. */
+static void ewtols (ewctl *ew, real eta, real err, solveparm *hislv, solveparm *loslv) {
+	real hi;
+
+	hi = MIN(ew->tol[0] * eta / ew->tol[1], EWFWD * err);
+	hi = MAX(hi, ew->tol[0]);
+
+	/* Frechet derivatives reuse the cached forward fields only if they
+	 * were found with at least the required accuracy. */
+	loslv->epscg = MAX(MAX(eta, ew->tol[1]), MAX(hi, hislv->epscg));
+	hislv->epscg = hi;
+	if (hislv->inner) hislv->inner->epscg = MAX(ew->innertol, hi);
+}
+
+/* Start the controller with the loosest forcing term. */
+void ewinit (ewctl *ew, real innertol, solveparm *hislv, solveparm *loslv) {
+	ew->tol[0] = hislv->epscg;
+	ew->tol[1] = loslv->epscg;
+	ew->innertol = innertol;
+	ew->eta = MAX(EWMAX, ew->tol[1]);
+	ew->err = 0;
+
+	/* The error of the guess is not yet known. */
+	ewtols (ew, ew->eta, 1., hislv, loslv);
+}
+
+/* Update the forcing term for the error err, using the second choice of
+ * Eisenstat and Walker with their safeguard against sudden tightening, and
+ * set the tolerances for the next step. The forcing term never grows or
+ * exceeds the error, so the solves tighten as the inversion converges even
+ * when the decrease of the error stalls. If final is true, the configured
+ * tolerances are restored at once, so the CG and Frechet solves of this step
+ * and all solves that follow are fully accurate. */
+void ewupdate (ewctl *ew, real err, int final, solveparm *hislv, solveparm *loslv) {
+	real eta, safe;
+
+	/* A step that did not decrease the error keeps the forcing term. */
+	if (ew->err > 0 && err < ew->err) {
+		eta = err / ew->err;
+		eta = EWGAMMA * eta * eta;
+		safe = EWGAMMA * ew->eta * ew->eta;
+		if (safe > 0.1) eta = MAX(eta, safe);
+		ew->eta = MIN(eta, ew->eta);
+	}
+
+	ew->eta = MAX(MIN(ew->eta, err), ew->tol[1]);
+
+	ew->err = err;
+
+	if (final) {
+		ewtols (ew, ew->tol[1], 0., hislv, loslv);
+		/* Cached fields from looser forward solves are solved again
+		 * when the Frechet derivatives need them. */
+		loslv->epscg = MAX(ew->tol[1], hislv->epscg);
+	} else ewtols (ew, ew->eta, err, hislv, loslv);
+}
+
+/* The position and scalar state of an inversion at a checkpoint: the grid
+ * level, the pass, the iteration and sub-iteration, the first iteration
+ * number of the level or pass, and the current solver tolerances. */
+typedef struct {
+	int lev, pass, it, sub, base;
+	real gamma, sigma, regparm[3], qnsig, qnfm, qndnrm, eps[2];
+	ewctl ew;
+} ckstate;
+
+/* Continue the inexact-Newton controller saved in ck. */
+static void ewrestore (ewctl *ew, ckstate *ck, solveparm *hislv, solveparm *loslv) {
+	*ew = ck->ew;
+	hislv->epscg = ck->eps[0];
+	loslv->epscg = ck->eps[1];
+	if (hislv->inner) hislv->inner->epscg = MAX(ew->innertol, ck->eps[0]);
+}
+
+/* Write (save is true) or read the checkpoint fname, which holds the state
+ * ck, the contrast, the solver spaces and spectral vector, any encoded
+ * sources and quasi-Newton history and, if usefc is true, the field cache.
+ * Returns 1 on success. */
+static int ckdbim (char *fname, int save, int usefc, ckstate *ck, cplx *spvec,
+		recspace *rcy, guesspace *gsp, measdesc *esrc, qnspace *qn, cplx *qngm) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+
+	ckclear ();
+	ckadd (ck, sizeof(ckstate));
+	ckadd (fmaconf.contrast, nelt * sizeof(cplx));
+	if (spvec) ckadd (spvec, nelt * sizeof(cplx));
+
+	if (rcy->kmax > 0) {
+		ckadd (&(rcy->k), sizeof(int));
+		ckadd (rcy->u, 2L * rcy->kmax * nelt * sizeof(cplx));
+	}
+
+	if (gsp->nmax > 0) {
+		ckadd (&(gsp->ntot), sizeof(int));
+		ckadd (gsp->x, 2L * gsp->nmax * nelt * sizeof(cplx));
+	}
+
+	if (esrc) {
+		ckadd (esrc->locations, 3L * esrc->count * sizeof(real));
+		ckadd (esrc->code, (long)esrc->count * esrc->ncode * sizeof(cplx));
+	}
+
+	if (qngm) {
+		ckadd (&(qn->k), sizeof(int));
+		ckadd (&(qn->next), sizeof(int));
+		ckadd (qn->s, 2L * qn->m * qn->n * sizeof(cplx));
+		ckadd (qn->rho, qn->m * sizeof(real));
+		ckadd (qngm, 2L * nelt * sizeof(cplx));
+	}
+
+	return save ? ckwrite (fname, usefc) : ckread (fname, usefc);
 }
 
 /* Establish the regularization parameter using an adapation of the
@@ -95,293 +432,909 @@ real scalereg (real fact, real mse) {
 	return fact * mse * mse * mse;
 }
 
-int main (int argc, char **argv) {
-	char ch, *inproj = NULL, *outproj = NULL, **arglist,
-	     fname[1024], *srcspec = NULL, *obspec = NULL;
-	int mpirank, mpisize, i, nmeas, dbimit[2], q, stride = 1,
-	    gsize[3], specit = 0, useaca = 0, numsrcpts = 5;
-	cplx *rn, *crt, *field, *fldptr, *error, *refct;
-	real errnorm = 0, tolerance[2], regparm[4], erninc,
-	      trange[2], prange[2], crtmse = 0.0, gamma, sigma = 1.0;
+/* The configuration and state of an inversion, shared by all grid levels
+ * and both passes. */
+typedef struct {
+	/* The project names and the checkpoint file. */
+	char *inproj, *outproj, ckname[1024];
+	/* Options selected on the command line. */
+	int specit, useaca, numsrcpts, usepc, userecv, useenc, enctype,
+	    nsketch, mglev, qnmem, usemask, ckint, useew, stride;
+	real acatol, prtol, innertol;
+	/* The iterations, Born iterations and tolerances of both passes and
+	 * the regularization parameters. */
+	int dbimit[2], bornit[2];
+	real tolerance[2], regparm[4];
+	/* The grid size and the cells per group dimension of the input files. */
+	int gsize[3], fbpb;
+	/* The solver configuration and the spaces shared by all solves. */
 	solveparm hislv, loslv;
-	measdesc obsmeas, srcmeas, ssrc;
-	long nelt, j;
-	real acatol = -1;
+	recspace rcy;
+	innerparm inner;
+	guesspace gsp;
+	qnspace qn;
+	ewctl ew;
+	/* The checkpoint state, whether the inversion resumes from it, whether
+	 * the next iteration continues it and the updates since the last. */
+	ckstate ck;
+	int resume, rsm, nupd;
+	/* The measurements, the transmitters of each step and sub-iteration
+	 * and their fields. */
+	measdesc obsmeas, srcmeas, ssrc, esrc, *tsrc;
+	cplx *field, *tfld, *efield, *error;
+	int tmeas;
+	/* Vectors on the current grid. */
+	long nelt;
+	cplx *rn, *crt, *refct, *spvec, *qngm, *qnanc;
+	/* The regularization, the errors and the quasi-Newton scalars. */
+	real gamma, sigma, errnorm, crtmse, qnsig, qnfm, qndnrm;
+} dbimrun;
+
+/* Draw new encoded sources and encode the measured fields to match. */
+static void newenc (dbimrun *run) {
+	encsrc (&(run->esrc), &(run->srcmeas), run->useenc, run->enctype);
+	encfield (run->efield, run->field, &(run->esrc), run->obsmeas.count);
+	/* Fields of old encodings may now be replaced. */
+	fcclear ();
+}
+
+/* Estimate the spectral radius and scale the regularization parameters
+ * by it in place of the previous estimate. */
+static void specscale (dbimrun *run) {
+	int mpirank;
 
-	MPI_Init (&argc, &argv);
 	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
-	MPI_Comm_size (MPI_COMM_WORLD, &mpisize);
 
-	if (!mpirank) fprintf (stderr, "Square-cell acoustic MLFMA.\n");
+	run->regparm[0] /= run->sigma;
+	run->regparm[1] /= run->sigma;
+	run->regparm[2] /= run->sigma;
+	if (!mpirank) fprintf (stderr, "Spectral radius estimation (up to %d iterations, %ld bytes per process)\n",
+			run->specit, (run->specit + 1L) * run->nelt * sizeof(cplx));
+	run->sigma = specrad (run->specit, &(run->loslv), &(run->srcmeas), &(run->obsmeas), run->spvec);
+	if (!mpirank) fprintf (stderr, "Spectral radius: %g\n", run->sigma);
+	run->regparm[0] *= run->sigma;
+	run->regparm[1] *= run->sigma;
+	run->regparm[2] *= run->sigma;
+}
 
-	arglist = argv;
+/* Save the state before iteration it and sub-iteration sub of the given
+ * pass on grid level lev, with iterations numbered from base, if enough
+ * updates have been made since the last checkpoint. */
+static void cksave (dbimrun *run, int lev, int pass, int it, int sub, int base) {
+	ckstate *ck = &(run->ck);
+	int mpirank;
 
-	while ((ch = getopt (argc, argv, "i:o:s:r:a:n:v:e:")) != -1) {
-		switch (ch) {
-		case 'i':
-			inproj = optarg;
-			break;
-		case 'o':
-			outproj = optarg;
-			break;
-		case'v':
-			stride = strtol(optarg, NULL, 0);
-			break;
-		case 'e':
-			specit = strtol(optarg, NULL, 0);
-			break;
-		case 'a':
-			acatol = strtod(optarg, NULL);
-			useaca = 1;
-			break;
-		case 'n':
-			numsrcpts = strtol(optarg, NULL, 0);
-			break;
-		case 'r':
-			obspec = optarg;
-			break;
-		case 's':
-			srcspec = optarg;
-			break;
-		default:
-			if (!mpirank) usage (arglist[0]);
-			MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
-		}
+	if (run->ckint < 1 || run->nupd < run->ckint) return;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+
+	ck->lev = lev; ck->pass = pass; ck->it = it; ck->sub = sub; ck->base = base;
+	ck->gamma = run->gamma; ck->sigma = run->sigma;
+	memcpy (ck->regparm, run->regparm, 3 * sizeof(real));
+	ck->qnsig = run->qnsig; ck->qnfm = run->qnfm; ck->qndnrm = run->qndnrm;
+	ck->eps[0] = run->hislv.epscg; ck->eps[1] = run->loslv.epscg; ck->ew = run->ew;
+
+	/* The quasi-Newton history only exists in the second pass. */
+	if (ckdbim (run->ckname, 1, run->useenc < 1, ck, run->spvec, &(run->rcy),
+				&(run->gsp), run->useenc > 0 ? &(run->esrc) : NULL,
+				&(run->qn), pass ? run->qngm : NULL)) run->nupd = 0;
+	else if (!mpirank) fprintf (stderr, "WARNING: Could not write checkpoint.\n");
+}
+
+/* Restore the full state saved in the checkpoint for the given pass on the
+ * current grid. The solver state belongs to the saved contrast. */
+static void ckresume (dbimrun *run, int pass) {
+	ckstate *ck = &(run->ck);
+	long nelt = run->nelt;
+	int mpirank;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+
+	/* The quasi-Newton history is part of the saved second pass. */
+	if (pass && run->qnmem > 0) {
+		qninit (&(run->qn), run->qnmem, nelt);
+		run->qngm = malloc (2L * nelt * sizeof(cplx));
+		run->qnanc = run->qngm + nelt;
 	}
 
-	if (!inproj || !srcspec || !obspec) {
-		if (!mpirank) usage (arglist[0]);
+	if (run->useenc > 0) encsrc (&(run->esrc), &(run->srcmeas), run->useenc, run->enctype);
+	if (!ckdbim (run->ckname, 0, run->useenc < 1, ck, run->spvec, &(run->rcy),
+				&(run->gsp), run->useenc > 0 ? &(run->esrc) : NULL,
+				&(run->qn), pass ? run->qngm : NULL)) {
+		if (!mpirank) fprintf (stderr, "ERROR: Could not read checkpoint %s.\n", run->ckname);
 		MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
 	}
 
-	if (!outproj) outproj = inproj;
+	if (pcready ()) pcbuild ();
+	rcvclear ();
+	if (run->useenc > 0) encfield (run->efield, run->field, &(run->esrc), run->obsmeas.count);
+
+	run->sigma = ck->sigma;
+	memcpy (run->regparm, ck->regparm, 3 * sizeof(real));
+	if (run->useew) ewrestore (&(run->ew), ck, &(run->hislv), &(run->loslv));
+	run->gamma = ck->gamma;
+	run->qnsig = ck->qnsig;
+	run->qnfm = ck->qnfm;
+	run->qndnrm = ck->qndnrm;
+}
 
-	if (!mpirank) fprintf (stderr, "Reading configuration file.\n");
+/* Choose the transmitters used by the inversion steps and allocate the
+ * storage for the transmitters of each sub-iteration. Principal sources
+ * and their projected fields are fixed, so they are found once. */
+static void srcinit (dbimrun *run) {
+	int mpirank, i;
+	measdesc *ssrc = &(run->ssrc);
 
-	/* Read the basic configuration for only one observation shell. */
-	sprintf (fname, "%s.input", inproj);
-	getconfig (fname, &hislv, &loslv);
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
 
-	/* Read the DBIM-specific configuration. */
-	sprintf (fname, "%s.dbimin", inproj);
-	getdbimcfg (fname, dbimit, regparm, tolerance);
+	if (run->useenc > 0) {
+		/* Encoded sources and their fields are drawn in each iteration. */
+		run->esrc.locations = NULL;
+		run->esrc.code = NULL;
+		run->efield = malloc (run->useenc * run->obsmeas.count * sizeof(cplx));
+		run->tsrc = &(run->esrc);
+		run->tfld = run->efield;
+	} else if (run->prtol > 0) {
+		i = prinsrc (&(run->esrc), &(run->srcmeas), run->prtol, run->nsketch);
+		if (!mpirank) fprintf (stderr, "Reduced %d sources to %d principal sources.\n",
+				run->srcmeas.count, i);
+		run->efield = malloc (MAX(i, 1) * run->obsmeas.count * sizeof(cplx));
+		encfield (run->efield, run->field, &(run->esrc), run->obsmeas.count);
+		run->tsrc = &(run->esrc);
+		run->tfld = run->efield;
+	} else {
+		run->tsrc = &(run->srcmeas);
+		run->tfld = run->field;
+	}
 
-	/* Convert the source range format to an explicit location list. */
-	buildsrc (&srcmeas, srcspec);
-	/* Do the same for the observation locations. */
-	buildobs (&obsmeas, obspec);
-	/* The total number of measurements. */
-	nmeas = srcmeas.count * obsmeas.count;
+	/* The number of measurements used in each inversion step. */
+	run->tmeas = (run->useenc > 0 ? run->useenc : run->tsrc->count) * run->obsmeas.count;
+
+	/* Set the number of per-leap transmissions. */
+	ssrc->count = run->stride = MAX(1, run->stride);
+	/* Allocate the transmitter specifications. */
+	ssrc->locations = malloc(3 * ssrc->count * sizeof(real));
+	/* Blank the interpolation matrices. */
+	ssrc->imat[0] = ssrc->imat[1] = NULL;
+	/* The transmitters share the source type. */
+	ssrc->plane = run->srcmeas.plane;
+
+	/* Subsets of encoded sources need their own weights. */
+	ssrc->code = NULL;
+	if (run->tsrc != &(run->srcmeas)) {
+		ssrc->ncode = run->srcmeas.count;
+		ssrc->srcloc = run->srcmeas.locations;
+		ssrc->code = malloc (ssrc->count * ssrc->ncode * sizeof(cplx));
+	}
+
+	/* The error storage vector for a single transmitter group. */
+	run->error = malloc (ssrc->count * run->obsmeas.count * sizeof(cplx));
+}
+
+/* Build the operators and vectors for grid level lev. The contrast is
+ * interpolated from gct, with cbpb cells per group dimension, which is
+ * released; if gct is NULL, this is the first grid and the contrast is
+ * read from the guess file. */
+static void levinit (dbimrun *run, int lev, cplx *gct, int cbpb) {
+	char fname[1024];
+	int mpirank, i, q;
+	long nelt;
+	real trange[2], prange[2];
+	measdesc *obs = &(run->obsmeas);
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+
+	/* Coarsen the cells within each finest-level group. */
+	mgsetlev (lev);
+	if (run->mglev > 0 && !mpirank)
+		fprintf (stderr, "Grid level %d: cell size %g\n", lev, fmaconf.cell);
 
 	/* Initialize ScaleME and find the local basis set. */
-	ScaleME_preconf (useaca);
+	ScaleME_preconf (run->useaca);
 	ScaleME_getListOfLocalBasis (&(fmaconf.numbases), &(fmaconf.bslist));
 
-	nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	nelt = run->nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
 
-	/* Allocate the RHS vector, residual vector and contrast. */
-	fmaconf.contrast = malloc (3L * nelt * sizeof(cplx));
-	rn = fmaconf.contrast + nelt;
-	crt = rn + nelt;
+	/* Allocate the guess space, if desired. */
+	if (run->gsp.nmax > 0) {
+		run->gsp.x = malloc (2L * run->gsp.nmax * nelt * sizeof(cplx));
+		run->gsp.w = run->gsp.x + run->gsp.nmax * nelt;
+		run->gsp.ntot = 0;
+	}
 
-	/* Store the grid size for writing of contrast values. */
-	gsize[0] = fmaconf.nx; gsize[1] = fmaconf.ny; gsize[2] = fmaconf.nz;
+	/* Allocate the recycled space, if desired. */
+	if (run->rcy.kmax > 0) {
+		run->rcy.u = malloc (2L * run->rcy.kmax * nelt * sizeof(cplx));
+		run->rcy.c = run->rcy.u + run->rcy.kmax * nelt;
+		run->rcy.k = 0;
+	}
 
-	if (!mpirank) fprintf (stderr, "Reading local portion of contrast file.\n");
-	/* Read the guess contrast for the local basis set. */
-	sprintf (fname, "%s.guess", inproj);
-	/* First try the group-ordered file, then try the old matrix format. */
-	getctgrp (fmaconf.contrast, fname, gsize,
-			fmaconf.bslist, fmaconf.numbases, fmaconf.bspbox);
+	/* Allocate the RHS vector, residual vector and contrast. */
+	fmaconf.contrast = malloc (3L * nelt * sizeof(cplx));
+	run->rn = fmaconf.contrast + nelt;
+	run->crt = run->rn + nelt;
+
+	/* Successive spectral-radius estimates start from the last
+	 * leading singular vector. */
+	if (run->specit > 0) run->spvec = calloc (nelt, sizeof(cplx));
+
+	if (gct) {
+		/* Interpolate the contrast recovered on the coarser grid. */
+		mgprolong (fmaconf.contrast, gct, cbpb);
+		free (gct);
+	} else {
+		if (!mpirank) fprintf (stderr, "Reading local portion of contrast file.\n");
+		/* Read the guess contrast for the local basis set. */
+		sprintf (fname, "%s.guess", run->inproj);
+		getctlev (fmaconf.contrast, fname, run->gsize, run->fbpb);
+	}
 
 	/* Read the reference contrast for the local basis set. */
 	if (!mpirank)  fprintf (stderr, "Reading local portion of reference file.\n");
-	refct = malloc (nelt * sizeof(cplx));
-	sprintf (fname, "%s.reference", inproj);
+	run->refct = malloc (nelt * sizeof(cplx));
+	sprintf (fname, "%s.reference", run->inproj);
 	/* If the reference file is not found, set the reference to NULL to avoid
-	 * checking the MSE at each step. Try both formats. */
-	if (!getctgrp (refct, fname, gsize, fmaconf.bslist,
-				fmaconf.numbases, fmaconf.bspbox)) {
-		free (refct);
-		refct = NULL;
+	 * checking the MSE at each step. */
+	if (!getctlev (run->refct, fname, run->gsize, run->fbpb)) {
+		free (run->refct);
+		run->refct = NULL;
+	}
+
+	/* Restrict the unknowns to the nonzero voxels of the mask. */
+	if (run->usemask) {
+		sprintf (fname, "%s.mask", run->inproj);
+		q = getctlev (run->crt, fname, run->gsize, run->fbpb) ? roiinit (run->crt) : 0;
+		MPI_Allreduce (MPI_IN_PLACE, &q, 1, MPI_INT, MPI_SUM, fmaconf.comm);
+		if (q < 1) {
+			if (!mpirank) fprintf (stderr, "WARNING: Ignoring empty or missing inversion mask.\n");
+			roifree ();
+		} else if (!mpirank) fprintf (stderr, "Inversion mask covers %d of %d groups.\n",
+				q, fmaconf.gnumbases);
 	}
 
-	/* First build the integration rules that will be used. */
-	bldintrules (numsrcpts, 0);
 	/* Precalculate some values for the FMM and direct interactions. */
-	fmmprecalc (acatol, useaca);
-	i = dirprecalc (numsrcpts);
+	fmmprecalc (run->acatol, run->useaca);
+	i = dirprecalc (run->numsrcpts);
 	if (!mpirank) fprintf (stderr, "Finished precomputing %d near interactions.\n", i);
 
+	/* Truncate the inner far-field ranks for this grid. */
+	if (run->hislv.inner) {
+		run->inner.rank = farrank (run->innertol);
+		if (run->useaca && !mpirank) fprintf (stderr, "Inner far-field rank: %d of %d\n",
+				run->inner.rank, fmaconf.acarank);
+	}
+
+	/* Factor the diagonal blocks for the preconditioner. */
+	if (run->usepc) {
+		/* The coarse grid has one cell for each finest-level group. */
+		if (run->usepc > 1 && !pccoarse() && !mpirank)
+			fprintf (stderr, "WARNING: Coarse grid is too large, skipping correction.\n");
+		pcbuild ();
+		if (!mpirank) fprintf (stderr, "Built block-Jacobi preconditioner.\n");
+	}
+
 	/* Finish the ScaleME initialization. */
 	ScaleME_postconf ();
 
-	/* Allocate the observation array. */
-	field = malloc (nmeas * sizeof(cplx));
-
-	/* Read the measurements and compute their norm. */
-	getfields (inproj, field, obsmeas.count, srcmeas.count, &erninc);
+	if (!gct) srcinit (run);
 
 	/* Build the root interpolation matrix for measurements. */
-	ScaleME_buildRootInterpMat (obsmeas.imat, fmaconf.interpord,
-			obsmeas.ntheta, obsmeas.nphi, obsmeas.trange, obsmeas.prange);
+	ScaleME_buildRootInterpMat (obs->imat, fmaconf.interpord,
+			obs->ntheta, obs->nphi, obs->trange, obs->prange);
 
 	/* Build the root interpolation matrix for adjoint Frechet fields. Note the
 	 * angular shift since the incoming fields have to be flipped. */
-	trange[0] = M_PI - obsmeas.trange[0];
-	trange[1] = M_PI - obsmeas.trange[1];
-	prange[0] = M_PI + obsmeas.prange[0];
-	prange[1] = M_PI + obsmeas.prange[1];
-	ScaleME_buildRootInterpMat (obsmeas.imat + 1, fmaconf.interpord,
-			obsmeas.ntheta, obsmeas.nphi, trange, prange);
+	trange[0] = M_PI - obs->trange[0];
+	trange[1] = M_PI - obs->trange[1];
+	prange[0] = M_PI + obs->prange[0];
+	prange[1] = M_PI + obs->prange[1];
+	ScaleME_buildRootInterpMat (obs->imat + 1, fmaconf.interpord,
+			obs->ntheta, obs->nphi, trange, prange);
+
+	/* Allocate the receiver fields for the Frechet derivatives. */
+	if (run->userecv) {
+		rcvinit (obs);
+		if (!mpirank) fprintf (stderr, "Receiver fields use %ld bytes per process.\n", rcvmemory ());
+	}
+
+	if ((run->bornit[0] > 0 || run->bornit[1] > 0) && !gct) {
+		if (!mpirank) fprintf (stderr, "Born derivatives for %d and %d iterations of the two passes.\n",
+				run->bornit[0], run->bornit[1]);
+
+		/* The Born derivative and its adjoint must agree. */
+		setborn (1);
+		run->errnorm = frechcheck (obs, &(run->loslv));
+		if (!mpirank) fprintf (stderr, "Born adjoint relative mismatch: %g\n", run->errnorm);
+		run->errnorm = 0;
+	}
+
+	/* Cache the total field of every transmitter within a DBIM step.
+	 * Only the current encoded or principal sources are reused, but
+	 * spectral-radius estimates cycle through all transmitters. */
+	q = run->useenc > 0 ? run->useenc : run->tsrc->count;
+	i = fcinit (run->specit > 0 ? MAX(run->srcmeas.count, q) : q);
+	if (!mpirank) {
+		if (i < 0) fprintf (stderr, "WARNING: Field cache unavailable.\n");
+		else fprintf (stderr, "Field cache stored %s.\n", i == FC_DISK ?
+				"on local disk" : (i == FC_PACK ? "compressed" : "in memory"));
+	}
 
 	MPI_Barrier (MPI_COMM_WORLD);
 
 	if (!mpirank) fprintf (stderr, "Initialization complete.\n");
+}
 
-	/* Set the number of per-leap transmissions. */
-	ssrc.count = stride = MAX(1,stride);
-	/* Allocate the transmitter specifications. */
-	ssrc.locations = malloc(3 * ssrc.count * sizeof(real));
-	/* Blank the interpolation matrices. */
-	ssrc.imat[0] = ssrc.imat[1] = NULL;
+/* Release the operators and vectors of the current grid. */
+static void levfree (dbimrun *run) {
+	ScaleME_finalizeParHostFMA ();
+	freedircache ();
+	fmmfree ();
+	pcfree ();
+	fcfree ();
+	rcvfree ();
+	roifree ();
 
-	/* The error storage vector for a single transmitter group. */
-	error = malloc (ssrc.count * obsmeas.count * sizeof(cplx));
+	free (fmaconf.contrast);
+	if (run->refct) free (run->refct);
+	if (run->gsp.nmax > 0) free (run->gsp.x);
+	if (run->rcy.kmax > 0) free (run->rcy.u);
+	if (run->spvec) free (run->spvec);
+
+	fmaconf.contrast = run->rn = run->crt = NULL;
+	run->refct = run->spvec = NULL;
+}
+
+/* Write the contrast after iteration it and report its errors. */
+static void itreport (dbimrun *run, int it) {
+	char fname[1024];
+	int mpirank;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+
+	sprintf (fname, "%s.inverse.%03d", run->outproj, it);
+	/* Every group holds the same contrast. */
+	if (!grpindex ()) prtctgrp (fname, fmaconf.contrast, run->gsize,
+			fmaconf.bslist, fmaconf.numbases, fmaconf.bspbox);
+
+	if (run->refct) run->crtmse = mse (fmaconf.contrast, run->refct, run->nelt, 1);
+
+	if (!mpirank) fprintf (stderr, "Iteration %d: RRE: %g, MSE: %g\n", it, run->errnorm, run->crtmse);
+}
+
+/* Run the leapfrogging first pass on grid level lev from iteration i0,
+ * with iterations numbered from base. If first is true, this is the first
+ * grid of the inversion. Returns the number of iterations to skip in the
+ * numbering of the next grid. */
+static int firstpass (dbimrun *run, int lev, int base, int i0, int first) {
+	int mpirank, i, q;
+	cplx *fldptr;
+	measdesc *ssrc = &(run->ssrc), *tsrc = run->tsrc, *obs = &(run->obsmeas);
+	solveparm *hislv = &(run->hislv), *loslv = &(run->loslv);
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+
+	/* The spectral radius is that of the derivative used at the start. */
+	setborn (run->bornit[0] > i0);
 
 	/* Calculate the spectral radius, if desired. */
-	if (specit > 0 && dbimit[0] > 0) {
-		if (!mpirank) fprintf (stderr, "Spectral radius estimation (%d iterations)\n", specit);
-		sigma = specrad (specit, &loslv, &srcmeas, &obsmeas);
-		if (!mpirank) fprintf (stderr, "Spectral radius: %g\n", sigma);
-		regparm[0] *= sigma;
-		regparm[1] *= sigma;
-		regparm[2] *= sigma;
+	if (run->specit > 0 && run->dbimit[0] > 0 && !run->rsm) specscale (run);
+
+	/* The forcing terms continue through all grids and both passes. */
+	if (run->useew && first && !run->rsm) {
+		ewinit (&(run->ew), run->innertol, hislv, loslv);
+		if (!mpirank) fprintf (stderr, "Adaptive tolerances: forward %g, Frechet %g\n",
+				hislv->epscg, loslv->epscg);
 	}
 
 	/* Start a two-pass DBIM with low tolerances first. */
-	if (!mpirank) fprintf (stderr, "First DBIM pass (%d iterations)\n", dbimit[0]);
-	for (i = 0, gamma = regparm[0]; i < dbimit[0]; ++i) {
+	if (!mpirank) fprintf (stderr, "First DBIM pass (%d iterations)\n", run->dbimit[0]);
+	if (!run->rsm) run->gamma = run->regparm[0];
+	for (i = i0; i < run->dbimit[0]; ++i) {
+		/* Leave the Born approximation after the specified iterations. */
+		if (i == run->bornit[0] && run->bornit[0] > 0) {
+			setborn (0);
+			if (!mpirank) fprintf (stderr, "Switching to distorted-background derivatives.\n");
+		}
+
+		/* Draw new encoded sources for each iteration, except
+		 * for a resumed iteration, which keeps the saved ones. */
+		if (run->useenc > 0 && !run->rsm) newenc (run);
+
 		/* Use the leapfrogging (Kaczmarz-like) method. */
-		for (q = 0; q < srcmeas.count; q += stride) {
-			fldptr = field + q * obsmeas.count;
+		for (q = run->rsm ? run->ck.sub : 0, run->rsm = 0; q < tsrc->count; q += run->stride) {
+			/* Save the state before the next update when due. */
+			cksave (run, lev, 0, i, q, base);
+
+			fldptr = run->tfld + q * obs->count;
 
 			/* Don't use more transmitters than available. */
-			ssrc.count = MIN(srcmeas.count - q, stride);
+			ssrc->count = MIN(tsrc->count - q, run->stride);
 
-			/* Set the transmitter locations. */
-			memcpy (ssrc.locations, srcmeas.locations + 3 * q, 3 * ssrc.count * sizeof(real));
-			errnorm = dbimerr (error, NULL, fldptr, &hislv, &loslv, &ssrc, &obsmeas);
+			/* Set the transmitter locations and any encoding weights. */
+			memcpy (ssrc->locations, tsrc->locations + 3 * q, 3 * ssrc->count * sizeof(real));
+			if (ssrc->code) memcpy (ssrc->code, tsrc->code + q * tsrc->ncode,
+					ssrc->count * tsrc->ncode * sizeof(cplx));
+			run->errnorm = dbimerr (run->error, NULL, fldptr, hislv, loslv, ssrc, obs);
 
 			/* Solve the system with CG for minimum norm. */
-			cgmn (error, crt, &loslv, &ssrc, &obsmeas, gamma);
+			cgmn (run->error, run->crt, loslv, ssrc, obs, run->gamma);
 
 			/* Update the background. */
-			for (j = 0; j < nelt; ++j)
-				fmaconf.contrast[j] += crt[j];
+			ctupdate (run->crt, hislv);
+			++(run->nupd);
 
-			if (refct) crtmse = mse (fmaconf.contrast, refct, nelt, 1);
+			if (run->refct) run->crtmse = mse (fmaconf.contrast, run->refct, run->nelt, 1);
 
 			if (!mpirank)
-				fprintf (stderr, "Sub-iteration %d/%d: RRE: %g, MSE: %g\n", i, q, errnorm, crtmse);
+				fprintf (stderr, "Sub-iteration %d/%d: RRE: %g, MSE: %g\n",
+						base + i, q, run->errnorm, run->crtmse);
 		}
 
 		if (!mpirank) fprintf (stderr, "Reassess DBIM error.\n");
-		errnorm = dbimerr (NULL, NULL, field, &hislv, &loslv, &srcmeas, &obsmeas);
-
-		sprintf (fname, "%s.inverse.%03d", outproj, i);
-		prtctgrp (fname, fmaconf.contrast, gsize, fmaconf.bslist,
-				fmaconf.numbases, fmaconf.bspbox);
-
-		if (refct) crtmse = mse (fmaconf.contrast, refct, nelt, 1);
-
-		if (!mpirank) fprintf (stderr, "Iteration %d: RRE: %g, MSE: %g\n", i, errnorm, crtmse);
-		if (errnorm < tolerance[0]) break;
+		run->errnorm = dbimerr (NULL, NULL, run->tfld, hislv, loslv, tsrc, obs);
+
+		itreport (run, base + i);
+		if (run->errnorm < run->tolerance[0]) break;
+
+		/* Set the tolerances of the next iteration, which are the
+		 * configured ones if it ends the inversion. */
+		if (run->useew) {
+			ewupdate (&(run->ew), run->errnorm, run->dbimit[1] < 1 && !lev
+					&& i + 2 >= run->dbimit[0], hislv, loslv);
+			if (!mpirank) fprintf (stderr, "Adaptive tolerances: forward %g, Frechet %g\n",
+					hislv->epscg, loslv->epscg);
+		}
 
 		/* Skip regularization adjustment unless the skip count has
 		 * been met or the parameter is already small enough. */
-		if ((i + 1) % (int)(regparm[3]) || gamma <= regparm[1]) continue;
+		if ((i + 1) % (int)(run->regparm[3]) || run->gamma <= run->regparm[1]) continue;
 
 		/* Perform scaling of the regularization parameter. */
-		gamma = scalereg(regparm[0], errnorm);
+		run->gamma = scalereg(run->regparm[0], run->errnorm);
 		if (!mpirank)
-			fprintf (stderr, "Regularization parameter: %g\n", gamma);
+			fprintf (stderr, "Regularization parameter: %g\n", run->gamma);
 	}
 
-	free (error);
-	error = NULL;
+	/* Number the iterations on the next grid after these. */
+	if (i < run->dbimit[0]) ++i;
+	return i;
+}
+
+/* Start the quasi-Newton steps of the second pass at the current contrast,
+ * which becomes the anchor of the regularization. */
+static void qnsetup (dbimrun *run) {
+	int mpirank;
+	long nelt = run->nelt;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+
+	/* The objective must stay fixed, so encoded sources are drawn once. */
+	if (run->useenc > 0) newenc (run);
+
+	qninit (&(run->qn), run->qnmem, nelt);
+	run->qngm = malloc (2L * nelt * sizeof(cplx));
+	run->qnanc = run->qngm + nelt;
+	memcpy (run->qnanc, fmaconf.contrast, nelt * sizeof(cplx));
+	run->qndnrm = vnrm2 (run->tfld, run->tmeas);
+
+	/* Scale the first step by the largest curvature of the misfit. */
+	run->qnsig = specrad (MAX(run->specit, QNSPECIT), &(run->loslv),
+			run->tsrc, &(run->obsmeas), run->spvec);
+	if (!mpirank) fprintf (stderr, "L-BFGS with %d pairs, initial curvature %g\n",
+			run->qnmem, run->qnsig);
+
+	/* Find the misfit and its gradient at the starting contrast. */
+	run->errnorm = dbimerr (NULL, run->rn, run->tfld, &(run->hislv),
+			&(run->loslv), run->tsrc, &(run->obsmeas));
+	run->qnfm = 0.5 * run->errnorm * run->errnorm * run->qndnrm;
+	vaxpby (run->qngm, -1., run->rn, 0., nelt);
+}
+
+/* Run the second pass on the fine grid, with iterations numbered from
+ * pass, continuing from the checkpoint if the inversion is resumed. */
+static void secondpass (dbimrun *run, int pass) {
+	int mpirank, i, usemn;
+	solveparm *hislv = &(run->hislv), *loslv = &(run->loslv);
+	measdesc *tsrc = run->tsrc, *obs = &(run->obsmeas);
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
 
-	/* Conduct non-leapfrog iterations now. */
-	if (i < dbimit[0]) ++i;
+	free (run->error);
+	run->error = NULL;
+
+	/* Conduct non-leapfrog iterations now, possibly from the checkpoint. */
+	i = run->resume ? run->ck.it : pass;
+	run->dbimit[1] += pass;
 
 	/* If the number of measurements is less than the number of pixels,
 	 * use the minimum-norm conjugate gradient. */
-	if (nmeas < fmaconf.gnumbases) error = malloc (nmeas * sizeof(cplx));
-
-	/* Recalculate the spectral radius, if desired. */
-	if (specit > 0 && dbimit[1] > 0) {
-		regparm[0] /= sigma;
-		regparm[1] /= sigma;
-		regparm[2] /= sigma;
-		if (!mpirank) fprintf (stderr, "Spectral radius estimation (%d iterations)\n", specit);
-		sigma = specrad (specit, &loslv, &srcmeas, &obsmeas);
-		if (!mpirank) fprintf (stderr, "Spectral radius: %g\n", sigma);
-		regparm[0] *= sigma;
-		regparm[1] *= sigma;
-		regparm[2] *= sigma;
-	}
-
-	/* Set the regularization parameter for the next set of iterations. */
-	gamma = scalereg(regparm[2], errnorm);
-
-	if (!mpirank) fprintf (stderr, "Second DBIM pass (%d iterations)\n", dbimit[1]);
-	for (dbimit[1] += i; i < dbimit[1]; ++i) {
-		errnorm = 0;
-		if (nmeas < fmaconf.gnumbases) {
-			/* Find the minimum-norm solution. */
-			errnorm = dbimerr (error, NULL, field, &hislv, &loslv, &srcmeas, &obsmeas);
-			cgmn (error, crt, &loslv, &srcmeas, &obsmeas, gamma);
-		} else {
-			/* Find the least-squares solution. */
-			errnorm = dbimerr (NULL, rn, field, &hislv, &loslv, &srcmeas, &obsmeas);
-			cgls (rn, crt, &loslv, &srcmeas, &obsmeas, gamma);
+	usemn = run->tmeas < fmaconf.gnumbases;
+	if (usemn) run->error = malloc (run->tmeas * sizeof(cplx));
+
+	/* The second pass starts with its own Born iterations. */
+	setborn (run->bornit[1] > i - pass);
+
+	if (run->resume) ckresume (run, 1);
+	else {
+		/* Recalculate the spectral radius, if desired. */
+		if (run->specit > 0 && run->dbimit[1] > 0) specscale (run);
+
+		/* Set the regularization parameter for the next set of iterations. */
+		run->gamma = scalereg(run->regparm[2], run->errnorm);
+
+		/* Quasi-Newton steps replace the CG steps of the second pass. */
+		if (run->qnmem > 0 && run->dbimit[1] > 0) qnsetup (run);
+	}
+
+	if (!mpirank) fprintf (stderr, "Second DBIM pass (%d iterations)\n", run->dbimit[1]);
+	for (; i < run->dbimit[1]; ++i) {
+		run->errnorm = 0;
+
+		/* Save the state before the next update when due. */
+		cksave (run, 0, 1, i, 0, pass);
+
+		/* Leave the Born approximation after the specified iterations. */
+		if (i - pass == run->bornit[1] && run->bornit[1] > 0) {
+			setborn (0);
+			if (!mpirank) fprintf (stderr, "Switching to distorted-background derivatives.\n");
 		}
 
-		for (j = 0; j < nelt; ++j) fmaconf.contrast[j] += crt[j];
+		if (run->qnmem > 0) {
+			/* Take a quasi-Newton step with a line search. */
+			run->errnorm = qnstep (&(run->qn), run->qngm, &(run->qnfm), run->qnanc,
+					run->gamma, 1. / (run->qnsig + run->gamma), run->qndnrm,
+					run->tfld, hislv, loslv, tsrc, obs);
+			++(run->nupd);
 
-		sprintf (fname, "%s.inverse.%03d", outproj, i);
-		prtctgrp (fname, fmaconf.contrast, gsize, fmaconf.bslist,
-				fmaconf.numbases, fmaconf.bspbox);
+			/* Set the tolerances of the next step. */
+			if (run->useew) ewupdate (&(run->ew), run->errnorm,
+					i + 2 >= run->dbimit[1], hislv, loslv);
+		} else {
+			/* Draw new encoded sources for each iteration. */
+			if (run->useenc > 0) newenc (run);
+
+			if (usemn) run->errnorm = dbimerr (run->error, NULL,
+					run->tfld, hislv, loslv, tsrc, obs);
+			else run->errnorm = dbimerr (NULL, run->rn,
+					run->tfld, hislv, loslv, tsrc, obs);
+
+			/* The CG tolerance of this step follows the error. */
+			if (run->useew) ewupdate (&(run->ew), run->errnorm,
+					i + 2 >= run->dbimit[1], hislv, loslv);
 
-		if (refct) crtmse = mse (fmaconf.contrast, refct, nelt, 1);
+			/* Find the minimum-norm or least-squares solution. */
+			if (usemn) cgmn (run->error, run->crt, loslv, tsrc, obs, run->gamma);
+			else cgls (run->rn, run->crt, loslv, tsrc, obs, run->gamma);
 
-		if (!mpirank) fprintf (stderr, "Iteration %d: RRE: %g, MSE: %g\n", i, errnorm, crtmse);
-		if (errnorm < tolerance[1]) break;
+			ctupdate (run->crt, hislv);
+			++(run->nupd);
+		}
+
+		itreport (run, i);
+		if (run->errnorm < run->tolerance[1]) break;
 
 		/* Skip regularization adjustment unless the skip count has
 		 * been met or the parameter is already small enough. */
-		if ((i + 1) % (int)(regparm[3]) || gamma <= regparm[1]) continue;
+		if ((i + 1) % (int)(run->regparm[3]) || run->gamma <= run->regparm[1]) continue;
 
-		/* Perform scaling of the regularization parameter. */
-		gamma = scalereg(regparm[2], errnorm);
+		/* Perform scaling of the regularization parameter. L-BFGS steps
+		 * penalize the distance to the fixed anchor, but CG steps each
+		 * update, so the two modes minimize different functionals. */
+		run->gamma = scalereg(run->regparm[2], run->errnorm);
 		if (!mpirank)
-			fprintf (stderr, "Regularization parameter: %g\n", gamma);
+			fprintf (stderr, "Regularization parameter: %g\n", run->gamma);
+
+		/* The curvature pairs include the regularization term. */
+		if (run->qnmem > 0) qnreset (&(run->qn));
 	}
+}
 
-	ScaleME_finalizeParHostFMA ();
+int main (int argc, char **argv) {
+	char ch, **arglist, fname[1024], *srcspec = NULL, *obspec = NULL;
+	int mpirank, mpisize, ngroups = 1, uselow = 0, userelax = 0, useidr = 0,
+	    lev, lev0, base, i0, cbpb = 0;
+	cplx *gct = NULL;
+	real erninc;
+	dbimrun run;
+	char *rcyspec = NULL, *innerspec = NULL, *encspec = NULL, *bornspec = NULL;
 
-	freedircache ();
+	MPI_Init (&argc, &argv);
+	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+	MPI_Comm_size (MPI_COMM_WORLD, &mpisize);
 
-	free (fmaconf.contrast);
-	free (fmaconf.radpats);
-	free (field);
-	if (error) free (error);
-	delmeas (&srcmeas);
-	delmeas (&obsmeas);
-	delmeas (&ssrc);
+	if (!mpirank) fprintf (stderr, "Square-cell acoustic MLFMA.\n");
+
+	arglist = argv;
+
+	/* Start with every option off and every pointer NULL. */
+	memset (&run, 0, sizeof(dbimrun));
+	run.stride = 1;
+	run.numsrcpts = 5;
+	run.enctype = ENC_SIGN;
+	run.acatol = -1;
+	run.prtol = -1;
+	run.innertol = 1e-2;
+	run.sigma = 1.0;
+
+	/* No guess space is used by default. */
+	run.gsp.nmax = run.gsp.ntot = 0;
+
+	while ((ch = getopt (argc, argv, "i:o:s:r:a:n:v:e:k:I:g:F:E:S:G:B:C:Q:w:RLDTWmpc")) != -1) {
+		switch (ch) {
+		case 'i':
+			run.inproj = optarg;
+			break;
+		case 'o':
+			run.outproj = optarg;
+			break;
+		case'v':
+			run.stride = strtol(optarg, NULL, 0);
+			break;
+		case 'e':
+			run.specit = strtol(optarg, NULL, 0);
+			break;
+		case 'a':
+			run.acatol = strtod(optarg, NULL);
+			run.useaca = 1;
+			break;
+		case 'p':
+			run.usepc = MAX(run.usepc, 1);
+			break;
+		case 'c':
+			run.usepc = 2;
+			break;
+		case 'k':
+			rcyspec = optarg;
+			break;
+		case 'I':
+			useidr = strtol(optarg, NULL, 0);
+			break;
+		case 'R':
+			userelax = 1;
+			break;
+		case 'L':
+			uselow = 1;
+			break;
+		case 'D':
+			run.userecv = 1;
+			break;
+		case 'T':
+			run.useew = 1;
+			break;
+		case 'm':
+			run.usemask = 1;
+			break;
+		case 'w':
+			run.ckint = strtol(optarg, NULL, 0);
+			break;
+		case 'W':
+			run.resume = 1;
+			break;
+		case 'E':
+			encspec = optarg;
+			break;
+		case 'G':
+			ngroups = strtol(optarg, NULL, 0);
+			break;
+		case 'B':
+			bornspec = optarg;
+			break;
+		case 'C':
+			run.mglev = strtol(optarg, NULL, 0);
+			break;
+		case 'Q':
+			run.qnmem = strtol(optarg, NULL, 0);
+			break;
+		case 'S':
+			run.prtol = strtod(strtok(optarg, ","), NULL);
+			if ((optarg = strtok(NULL, ","))) run.nsketch = strtol(optarg, NULL, 0);
+			break;
+		case 'g':
+			run.gsp.nmax = strtol(optarg, NULL, 0);
+			break;
+		case 'F':
+			innerspec = optarg;
+			break;
+		case 'n':
+			run.numsrcpts = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			obspec = optarg;
+			break;
+		case 's':
+			srcspec = optarg;
+			break;
+		default:
+			if (!mpirank) usage (arglist[0]);
+			MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+	}
+
+	if (!run.inproj || !srcspec || !obspec) {
+		if (!mpirank) usage (arglist[0]);
+		MPI_Abort (MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	if (!run.outproj) run.outproj = run.inproj;
+
+	/* Each group of processes runs its own FMM. */
+	ngroups = grpsplit (ngroups);
+	if (ngroups > 1 && !mpirank)
+		fprintf (stderr, "Using %d groups of %d processes.\n", ngroups, mpisize / ngroups);
+
+#ifndef MIXEDPREC
+	if (uselow) {
+		if (!mpirank) fprintf (stderr, "WARNING: Single-precision operators require a mixed-precision build.\n");
+		uselow = 0;
+	}
+#endif /* MIXEDPREC */
+
+	if (!mpirank) fprintf (stderr, "Reading configuration file.\n");
+
+	/* Read the basic configuration for only one observation shell. */
+	sprintf (fname, "%s.input", run.inproj);
+	getconfig (fname, &(run.hislv), &(run.loslv));
+
+	/* IDR(s) replaces BiCG-STAB when no other solver is selected. */
+	run.hislv.idrdim = run.loslv.idrdim = MAX(useidr, 0);
+
+	/* All solves share the operator, so they can share a guess space. */
+	if (run.gsp.nmax > 0) run.hislv.gsp = run.loslv.gsp = &(run.gsp);
+
+	/* All solves share the operator, so they can share a recycled space. */
+	run.rcy.kmax = run.rcy.k = 0;
+	if (rcyspec) {
+		run.rcy.kmax = strtol(strtok(rcyspec, ","), NULL, 0);
+		if ((rcyspec = strtok(NULL, ","))) run.rcy.m = strtol(rcyspec, NULL, 0);
+		else run.rcy.m = 4 * run.rcy.kmax;
+		run.rcy.m = MAX(run.rcy.m, run.rcy.kmax + 1);
+	}
+	if (run.rcy.kmax > 0) run.hislv.rcy = run.loslv.rcy = &(run.rcy);
+
+	/* Read the DBIM-specific configuration. */
+	sprintf (fname, "%s.dbimin", run.inproj);
+	getdbimcfg (fname, run.dbimit, run.regparm, run.tolerance);
+
+	/* Convert the source range format to an explicit location list. */
+	buildsrc (&(run.srcmeas), srcspec);
+	/* Do the same for the observation locations. */
+	buildobs (&(run.obsmeas), obspec);
+
+	/* Encoded sources replace the individual sources in the inversion. */
+	if (encspec) {
+		run.useenc = strtol(strtok(encspec, ","), NULL, 0);
+		if ((encspec = strtok(NULL, ","))) run.enctype = strtol(encspec, NULL, 0);
+	}
+
+	/* The number of Born iterations that start each pass. */
+	if (bornspec) {
+		run.bornit[0] = strtol(strtok(bornspec, ","), NULL, 0);
+		if ((bornspec = strtok(NULL, ","))) run.bornit[1] = strtol(bornspec, NULL, 0);
+	}
+
+	/* Random encodings and principal sources are exclusive. */
+	if (run.useenc > 0 && run.prtol > 0) {
+		if (!mpirank) fprintf (stderr, "WARNING: Ignoring principal sources for encoded sources.\n");
+		run.prtol = -1;
+	}
+
+	/* Coarse grids, if desired, only serve the first pass. */
+	if (run.dbimit[0] < 1) run.mglev = 0;
+	run.fbpb = fmaconf.bspbox;
+	run.mglev = mginit (run.mglev);
+	if (run.mglev > 0 && !mpirank)
+		fprintf (stderr, "First DBIM pass uses %d coarse grids.\n", run.mglev);
+
+	/* Find the position of the saved inversion, if desired. */
+	sprintf (run.ckname, "%s.ckpt", run.outproj);
+	if (run.resume) {
+		ckclear ();
+		ckadd (&(run.ck), sizeof(ckstate));
+		if (!ckread (run.ckname, 0) || run.ck.lev > run.mglev) {
+			if (!mpirank) fprintf (stderr, "WARNING: No usable checkpoint, starting from the guess.\n");
+			memset (&(run.ck), 0, sizeof(ckstate));
+			run.resume = 0;
+		} else if (!mpirank) fprintf (stderr, "Resuming pass %d at iteration %d.\n",
+				run.ck.pass + 1, run.ck.it + run.ck.base);
+	}
+
+	/* A resumed inversion starts on the grid of the checkpoint. */
+	lev0 = run.resume ? run.ck.lev : run.mglev;
+
+	/* Store the grid size for writing of contrast values. */
+	run.gsize[0] = fmaconf.nx; run.gsize[1] = fmaconf.ny; run.gsize[2] = fmaconf.nz;
+
+	/* First build the integration rules that will be used. */
+	bldintrules (run.numsrcpts, 0);
+
+	/* Configure the cheap inner operator for the high-accuracy solves.
+	 * Only the low-rank far-field factors can be truncated. */
+	if (innerspec) {
+		run.inner.maxit = strtol(strtok(innerspec, ","), NULL, 0);
+		run.inner.restart = 20;
+		if ((innerspec = strtok(NULL, ","))) {
+			run.innertol = strtod(innerspec, NULL);
+			if ((innerspec = strtok(NULL, ",")))
+				run.inner.restart = strtol(innerspec, NULL, 0);
+		}
+		run.inner.epscg = MAX(run.innertol, run.hislv.epscg);
+		run.inner.lowprec = uselow;
+		run.hislv.inner = &(run.inner);
+
+		if (uselow && !mpirank)
+			fprintf (stderr, "Inner solves use single-precision operators.\n");
+		else if (!run.useaca && !mpirank)
+			fprintf (stderr, "WARNING: Inner solves use the full operator without ACA.\n");
+	} else if (uselow && !mpirank)
+		fprintf (stderr, "WARNING: Single-precision operators are only used for inner solves.\n");
+
+	/* Relaxation truncates the far-field ranks, which requires ACA. */
+	if (userelax && !run.useaca) {
+		if (!mpirank) fprintf (stderr, "WARNING: Relaxed products require ACA far-field transformations.\n");
+		userelax = 0;
+	}
+	setrelax (userelax);
+
+	/* Allocate the observation array. */
+	run.field = malloc (run.srcmeas.count * run.obsmeas.count * sizeof(cplx));
+
+	/* Read the measurements and compute their norm. */
+	getfields (run.inproj, run.field, run.obsmeas.count, run.srcmeas.count, &erninc);
+
+	/* Run the first pass on each coarse grid, coarsest first, and finish
+	 * with the setup of the fine grid for the second pass. */
+	for (lev = lev0, base = run.ck.base; lev >= 0; --lev) {
+		if (lev < lev0) {
+			/* Keep the contrast for prolongation to the finer grid. */
+			gct = mggather (fmaconf.contrast);
+			cbpb = fmaconf.bspbox;
+
+			/* Release everything built for the coarser grid. */
+			ScaleME_delRootInterpMat (run.obsmeas.imat);
+			ScaleME_delRootInterpMat (run.obsmeas.imat + 1);
+			levfree (&run);
+		}
+
+		/* The prolonged contrast is released with the setup. */
+		levinit (&run, lev, gct, cbpb);
+		gct = NULL;
+
+		/* The fine grid only runs the second pass after coarse grids or
+		 * when the second pass is resumed. */
+		if (!lev && (run.mglev > 0 || run.ck.pass > 0)) break;
+
+		/* Continue the first pass from the checkpoint. */
+		i0 = 0;
+		if (run.resume) {
+			ckresume (&run, 0);
+			i0 = run.ck.it;
+			run.rsm = 1;
+			run.resume = 0;
+		}
+
+		base += firstpass (&run, lev, base, i0, lev == lev0);
+	}
+
+	secondpass (&run, base);
+
+	levfree (&run);
+	grpfree ();
+
+	free (run.field);
+	if (run.error) free (run.error);
+	delmeas (&(run.srcmeas));
+	delmeas (&(run.obsmeas));
+	delmeas (&(run.ssrc));
+	if (run.tsrc != &(run.srcmeas)) {
+		delmeas (&(run.esrc));
+		free (run.efield);
+	}
 	delintrules ();
 
-	if (refct) free (refct);
+	if (run.qngm) {
+		qnfree (&(run.qn));
+		free (run.qngm);
+	}
 
 	MPI_Barrier (MPI_COMM_WORLD);
 	MPI_Finalize ();
@@ -41,6 +41,14 @@ static cplx *gridints, *rhsbuf;
 static int nbors, nfftprod, nfft, nebox;
 static FFTW_PLAN fplan, bplan;
 
+#ifdef MIXEDPREC
+/* Single-precision Green's function spectra and transforms. */
+static lcplx *lgridints;
+static LFFTW_PLAN lfplan, lbplan;
+
+static void lowinteract (int, int *, int);
+#endif /* MIXEDPREC */
+
 /* Compare two box indices for sorting and searching. */
 int idxcomp (const void *vl, const void *vr) {
 	int *bl = (int *)vl, *br = (int *)vr;
@@ -64,7 +72,7 @@ int mkdircache () {
 	cplx *rhsptr;
 	int nbs, *bslist, i, *idx, *boxidx, rank;
 
-	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_rank (fmaconf.comm, &rank);
 
 	/* Get the complete list of locally required basis functions. */
 	ScaleME_getLocallyReqBasis (&nbs, &bslist);
@@ -93,17 +101,17 @@ int mkdircache () {
 	/* Allocate the list of boxes. */
 	boxlist = calloc (nebox, sizeof(boxdesc));
 
-	/* Allocate the backend array. */
-	rhsptr = rhsbuf = FFTW_MALLOC (nebox * nfftprod * sizeof(cplx));
+	/* Allocate the backend array, with room for each right-hand side. */
+	rhsptr = rhsbuf = FFTW_MALLOC (nebox * nfftprod * fmaconf.nrhs * sizeof(cplx));
 
 	fprintf (stderr, "Rank %d: Expanded FFT buffer size size: %ld bytes\n",
-			rank, nebox * nfftprod * sizeof(cplx));
+			rank, nebox * nfftprod * fmaconf.nrhs * sizeof(cplx));
 
 	/* Set up the first box structure. */
 	memcpy (boxlist[0].index, boxidx, 3 * sizeof(int));
 	omp_init_lock (&(boxlist[0].lock));
 	boxlist[0].rhs = rhsptr;
-	rhsptr += nfftprod;
+	rhsptr += nfftprod * fmaconf.nrhs;
 
 	/* Now loop through all bases and set up the box cache pointers. */
 	for (nebox = i = 1, idx = boxidx + 3; i < nbs; ++i, idx += 3) {
@@ -114,7 +122,7 @@ int mkdircache () {
 		memcpy (boxlist[nebox].index, idx, 3 * sizeof(int));
 		omp_init_lock (&(boxlist[nebox].lock));
 		boxlist[nebox].rhs = rhsptr;
-		rhsptr += nfftprod;
+		rhsptr += nfftprod * fmaconf.nrhs;
 
 		/* Count this box. */
 		++nebox;
@@ -137,18 +145,36 @@ void clrdircache () {
 	for (i = 0; i < nebox; ++i) boxlist[i].fill = 0;
 }
 
+/* Return the local storage, in bytes, of the near-field Green's function
+ * spectra and the direct-interaction cache. */
+long dirmemory (void) {
+	long ngrid = (long)nfftprod * (long)nbors * (long)nbors * (long)nbors, sz;
+
+	sz = ngrid * sizeof(cplx) + (long)nebox * nfftprod * fmaconf.nrhs * sizeof(cplx);
+#ifdef MIXEDPREC
+	sz += ngrid * sizeof(lcplx);
+#endif /* MIXEDPREC */
+
+	return sz;
+}
+
 /* Free the allocated memory in the direct-interaction cache structure. */
 void freedircache () {
 	FFTW_FREE (rhsbuf);
 	FFTW_FREE (gridints);
+#ifdef MIXEDPREC
+	LFFTW_FREE (lgridints);
+#endif /* MIXEDPREC */
 	free (boxlist);
 }
 
 /* Check the cache for the given RHS. If it exists, return the pre-cached copy.
  * Otherwise, cache the provided copy and take the DFT before returning a pointer
- * to the cache bin. */
+ * to the cache bin. With multiple right-hand sides, the bin holds one expanded
+ * grid for each, stored consecutively. When the low-precision operator is
+ * active, the bin holds single-precision grids instead. */
 cplx *cacheboxrhs (int bsl, int boxkey) {
-	int l, i;
+	int l, i, k;
 	boxdesc key, *lbox;
 	cplx *bptr, *rhs;
 
@@ -169,26 +195,50 @@ cplx *cacheboxrhs (int bsl, int boxkey) {
 
 	/* Cache miss. Fill the box. */
 	if (!(lbox->fill)) {
-		/* Clear the cache storage. */
-		memset (bptr, 0, nfftprod * sizeof(cplx));
-
 		/* Grab the local input vector for caching. */
 		rhs = (cplx *)ScaleME_getInputVec (boxkey);
 
-		/* Populate the local grid. */
-		for (i = 0; i < fmaconf.bspboxvol; ++i) {
-			/* Find the position in the local box. */
-			GRID(key.index, i, fmaconf.bspbox, fmaconf.bspbox);
+#ifdef MIXEDPREC
+		if (fmaconf.lowprec) {
+			lcplx *lbptr = (lcplx *)bptr;
 
-			/* The index into the RHS array. */
-			l = IDX(nfft,key.index[0],key.index[1],key.index[2]);
+			memset (lbptr, 0, nfftprod * fmaconf.nrhs * sizeof(lcplx));
 
-			/* Fill the expanded FFT grid. */
-			bptr[l] = rhs[i];
+			for (k = 0; k < fmaconf.nrhs; ++k) {
+				for (i = 0; i < fmaconf.bspboxvol; ++i) {
+					GRID(key.index, i, fmaconf.bspbox, fmaconf.bspbox);
+					l = IDX(nfft,key.index[0],key.index[1],key.index[2]);
+					lbptr[l + k * nfftprod] = (lcplx)rhs[i + k * fmaconf.bspboxvol];
+				}
+
+				LFFTW_EXECUTE_DFT (lfplan, lbptr + k * nfftprod, lbptr + k * nfftprod);
+			}
+
+			lbox->fill = 1;
+			omp_unset_lock (&(lbox->lock));
+			return bptr;
 		}
+#endif /* MIXEDPREC */
 
-		/* Transform the cached RHS. */
-		FFTW_EXECUTE_DFT (fplan, bptr, bptr);
+		/* Clear the cache storage. */
+		memset (bptr, 0, nfftprod * fmaconf.nrhs * sizeof(cplx));
+
+		for (k = 0; k < fmaconf.nrhs; ++k) {
+			/* Populate the local grid. */
+			for (i = 0; i < fmaconf.bspboxvol; ++i) {
+				/* Find the position in the local box. */
+				GRID(key.index, i, fmaconf.bspbox, fmaconf.bspbox);
+
+				/* The index into the RHS array. */
+				l = IDX(nfft,key.index[0],key.index[1],key.index[2]);
+
+				/* Fill the expanded FFT grid. */
+				bptr[l + k * nfftprod] = rhs[i + k * fmaconf.bspboxvol];
+			}
+
+			/* Transform the cached RHS. */
+			FFTW_EXECUTE_DFT (fplan, bptr + k * nfftprod, bptr + k * nfftprod);
+		}
 
 		/* Mark the cache spot as full. */
 		lbox->fill = 1;
@@ -243,12 +293,62 @@ int greencache (cplx *grf, int n, real k0, real cell) {
 	return n;
 }
 
+/* Fill the dense gnumbases-by-gnumbases matrix gmat with the Green's
+ * interactions between whole finest-level groups, treating each group as a
+ * single cell of width fmaconf.grplen. The scaling matches that of the
+ * near-field interactions between individual cells. */
+int coarsegreen (cplx *gmat) {
+	int nmax, ncache;
+	cplx *grc;
+	real scale = fmaconf.k0 * fmaconf.k0;
+
+	/* Cache every unique group separation. */
+	nmax = MAX(fmaconf.nx, MAX(fmaconf.ny, fmaconf.nz));
+	ncache = PPYR(nmax);
+	grc = malloc (ncache * sizeof(cplx));
+	greencache (grc, ncache, fmaconf.k0, fmaconf.grplen);
+
+#pragma omp parallel default(shared)
+{
+	int i, j, ip, jp, kp, oi[3], oj[3], idx[3];
+
+#pragma omp for
+	for (j = 0; j < fmaconf.gnumbases; ++j) {
+		GRID(oj, j, fmaconf.nx, fmaconf.ny);
+
+		for (i = 0; i < fmaconf.gnumbases; ++i) {
+			GRID(oi, i, fmaconf.nx, fmaconf.ny);
+
+			/* The group separation in each dimension. */
+			ip = abs (oi[0] - oj[0]);
+			jp = abs (oi[1] - oj[1]);
+			kp = abs (oi[2] - oj[2]);
+
+			/* Sort the separations for the packed cache. */
+			idx[0] = MAX(ip, MAX(jp, kp));
+			idx[2] = MIN(ip, MIN(jp, kp));
+			idx[1] = ip + jp + kp - idx[0] - idx[2];
+
+			gmat[i + (long)j * fmaconf.gnumbases] =
+				scale * grc[PPYR(idx[0]) + PTRI(idx[1]) + idx[2]];
+		}
+	}
+}
+
+	free (grc);
+
+	return fmaconf.gnumbases;
+}
+
 /* Precompute some values for the direct interactions. */
 int dirprecalc (int numsrcpts) {
 	int totbpnbr, nborsvol, rank, sepmax, ncache;
+#ifdef MIXEDPREC
+	int l;
+#endif /* MIXEDPREC */
 	cplx *grc;
 
-	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_rank (fmaconf.comm, &rank);
 
 	/* The number of neighbor boxes per dimension. */
 	nbors = nborsvol = 2 * fmaconf.numbuffer + 1;
@@ -306,6 +406,22 @@ int dirprecalc (int numsrcpts) {
 	}
 }
 
+#ifdef MIXEDPREC
+	/* Plan the single-precision transforms before filling the array,
+	 * because planning overwrites its contents. */
+	lgridints = LFFTW_MALLOC (totbpnbr * sizeof(lcplx));
+	lfplan = LFFTW_PLAN_DFT_3D (nfft, nfft, nfft,
+			lgridints, lgridints, FFTW_FORWARD, FFTW_MEASURE);
+	lbplan = LFFTW_PLAN_DFT_3D (nfft, nfft, nfft,
+			lgridints, lgridints, FFTW_BACKWARD, FFTW_MEASURE);
+
+	/* Copy the spectra to single precision. */
+	for (l = 0; l < totbpnbr; ++l) lgridints[l] = (lcplx)gridints[l];
+
+	fprintf (stderr, "Rank %d: Single-precision Green's function grid size: %ld bytes\n",
+			rank, totbpnbr * sizeof(lcplx));
+#endif /* MIXEDPREC */
+
 	/* Allocate the local cache structure. */
 	mkdircache ();
 
@@ -315,15 +431,67 @@ int dirprecalc (int numsrcpts) {
 	return nfftprod;
 }
 
-/* Evaluate at a group of observers the fields due to a group of sources. */
+/* Build the dense interaction matrix blk between the cells of a single group,
+ * stored in column-major order with leading dimension fmaconf.bspboxvol. Each
+ * column is found by applying the self-interaction spectrum to a unit source
+ * through the same FFT path used by blockinteract. */
+int selfblock (cplx *blk) {
+	int nb = fmaconf.numbuffer;
+	cplx *gptr;
+
+	/* Point to the Green's function for the center box. */
+	gptr = gridints + nfftprod * IDX(nbors,nb,nb,nb);
+
+#pragma omp parallel default(shared)
+{
+	int i, j, l, idx[3];
+	cplx *buf;
+
+	buf = FFTW_MALLOC (nfftprod * sizeof(cplx));
+
+#pragma omp for
+	for (j = 0; j < fmaconf.bspboxvol; ++j) {
+		/* Place a unit source in the expanded grid. */
+		memset (buf, 0, nfftprod * sizeof(cplx));
+		GRID(idx, j, fmaconf.bspbox, fmaconf.bspbox);
+		buf[IDX(nfft,idx[0],idx[1],idx[2])] = 1.;
+
+		/* Convolve the source with the Green's function. */
+		FFTW_EXECUTE_DFT (fplan, buf, buf);
+		for (l = 0; l < nfftprod; ++l) buf[l] *= gptr[l];
+		FFTW_EXECUTE_DFT (bplan, buf, buf);
+
+		/* Extract the field at each cell in the group. */
+		for (i = 0; i < fmaconf.bspboxvol; ++i) {
+			GRID(idx, i, fmaconf.bspbox, fmaconf.bspbox);
+			blk[i + j * fmaconf.bspboxvol] = buf[IDX(nfft,idx[0],idx[1],idx[2])];
+		}
+	}
+
+	FFTW_FREE (buf);
+}
+
+	return fmaconf.bspboxvol;
+}
+
+/* Evaluate at a group of observers the fields due to a group of sources. When
+ * multiple right-hand sides are packed into each basis, each Green's function
+ * spectrum is applied to all of them while it is resident in cache. */
 void blockinteract (int tkey, int tct, int *skeys, int *scts, int numsrc) {
-	int i, l, boxoff[3], idx[3], *obslist, *srclist;
-	cplx *buf, *gptr, *bptr;
+	int i, k, l, boxoff[3], idx[3], *obslist, *srclist;
+	cplx *buf, *gptr, *bptr, *bufp;
 	cplx *cobs;
 
+#ifdef MIXEDPREC
+	if (fmaconf.lowprec) {
+		lowinteract (tkey, skeys, numsrc);
+		return;
+	}
+#endif /* MIXEDPREC */
+
 	/* Clear the local output buffer. */
-	buf = FFTW_MALLOC (nfftprod * sizeof(cplx));
-	memset (buf, 0, nfftprod * sizeof(cplx));
+	buf = FFTW_MALLOC (nfftprod * fmaconf.nrhs * sizeof(cplx));
+	memset (buf, 0, nfftprod * fmaconf.nrhs * sizeof(cplx));
 
 	/* Find the output vector segment and the target basis list. */
 	obslist = ScaleME_getBasisList (tkey);
@@ -358,19 +526,25 @@ void blockinteract (int tkey, int tct, int *skeys, int *scts, int numsrc) {
 
 		/* Convolve the source field with the Green's function and
 		 * augment the field at the target. */
-		for (i = 0; i < nfftprod; ++i) buf[i] += gptr[i] * bptr[i];
+		for (k = 0, bufp = buf; k < fmaconf.nrhs; ++k, bufp += nfftprod, bptr += nfftprod)
+			for (i = 0; i < nfftprod; ++i) bufp[i] += gptr[i] * bptr[i];
 	}
 
-	/* Inverse transform the grid in place. */
-	FFTW_EXECUTE_DFT (bplan, buf, buf);
+	for (k = 0, bufp = buf; k < fmaconf.nrhs; ++k, bufp += nfftprod) {
+		/* Inverse transform the grid in place. */
+		FFTW_EXECUTE_DFT (bplan, bufp, bufp);
+
+		/* Augment with output with the local convolution. */
+		/* Note that each ScaleME "basis" is actually a finest-level group. */
+		for (l = 0; l < fmaconf.bspboxvol; ++l) {
+			GRID(idx, l, fmaconf.bspbox, fmaconf.bspbox);
 
-	/* Augment with output with the local convolution. */
-	/* Note that each ScaleME "basis" is actually a finest-level group. */
-	for (l = 0; l < fmaconf.bspboxvol; ++l) {
-		GRID(idx, l, fmaconf.bspbox, fmaconf.bspbox);
+			/* Augment the RHS. */
+			cobs[l] += bufp[IDX(nfft,idx[0],idx[1],idx[2])];
+		}
 
-		/* Augment the RHS. */
-		cobs[l] += buf[IDX(nfft,idx[0],idx[1],idx[2])];
+		/* Move to the output for the next right-hand side. */
+		cobs += fmaconf.bspboxvol;
 	}
 
 	FFTW_FREE (buf);
@@ -378,6 +552,57 @@ void blockinteract (int tkey, int tct, int *skeys, int *scts, int numsrc) {
 	return;
 }
 
+#ifdef MIXEDPREC
+/* Evaluate the near-field interactions as in blockinteract, but convolve with
+ * the single-precision spectra. Only the output is in double precision. */
+static void lowinteract (int tkey, int *skeys, int numsrc) {
+	int i, k, l, boxoff[3], idx[3], *obslist, *srclist;
+	lcplx *buf, *gptr, *bptr, *bufp;
+	cplx *cobs;
+
+	buf = LFFTW_MALLOC (nfftprod * fmaconf.nrhs * sizeof(lcplx));
+	memset (buf, 0, nfftprod * fmaconf.nrhs * sizeof(lcplx));
+
+	obslist = ScaleME_getBasisList (tkey);
+	cobs = (cplx *)ScaleME_getOutputVec (tkey);
+
+	GRID (boxoff, obslist[0], fmaconf.nx, fmaconf.ny);
+	boxoff[0] -= fmaconf.numbuffer;
+	boxoff[1] -= fmaconf.numbuffer;
+	boxoff[2] -= fmaconf.numbuffer;
+
+	for (l = 0; l < numsrc; ++l) {
+		srclist = ScaleME_getBasisList (skeys[l]);
+
+		/* The cache holds single-precision spectra in this mode. */
+		bptr = (lcplx *)cacheboxrhs (srclist[0], skeys[l]);
+
+		GRID (idx, srclist[0], fmaconf.nx, fmaconf.ny);
+		idx[0] -= boxoff[0];
+		idx[1] -= boxoff[1];
+		idx[2] -= boxoff[2];
+
+		gptr = lgridints + nfftprod * IDX(nbors,idx[0],idx[1],idx[2]);
+
+		for (k = 0, bufp = buf; k < fmaconf.nrhs; ++k, bufp += nfftprod, bptr += nfftprod)
+			for (i = 0; i < nfftprod; ++i) bufp[i] += gptr[i] * bptr[i];
+	}
+
+	for (k = 0, bufp = buf; k < fmaconf.nrhs; ++k, bufp += nfftprod) {
+		LFFTW_EXECUTE_DFT (lbplan, bufp, bufp);
+
+		for (l = 0; l < fmaconf.bspboxvol; ++l) {
+			GRID(idx, l, fmaconf.bspbox, fmaconf.bspbox);
+			cobs[l] += (cplx)bufp[IDX(nfft,idx[0],idx[1],idx[2])];
+		}
+
+		cobs += fmaconf.bspboxvol;
+	}
+
+	LFFTW_FREE (buf);
+}
+#endif /* MIXEDPREC */
+
 /* Build the scaled, extended Green's function grf on an expanded cubic grid
  * with values taken from the cache grc. */
 int greengrid (cplx *grf, int m, int mex, int *off, real k0, cplx *grc) {
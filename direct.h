@@ -8,11 +8,14 @@ int dirprecalc (int);
 
 cplx *cacheboxrhs (int, int);
 void blockinteract(int, int, int *, int *, int);
+int selfblock (cplx *);
 
 int mkdircache ();
 void clrdircache ();
 void freedircache ();
+long dirmemory (void);
 
 int greencache (cplx *, int, real, real);
+int coarsegreen (cplx *);
 
 #endif /* __DIRECT_H_ */
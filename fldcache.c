@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "measure.h"
+#include "itsolver.h"
+#include "compress.h"
+#include "memplan.h"
+#include "fldcache.h"
+
+/* The fraction of free node memory the cache may occupy. */
+#define FCFRAC 0.5
+/* The compression error relative to the tolerance of the cached solve. */
+#define FCSAFE 0.1
+
+/* The states of a cache slot. Stale fields belong to a previous contrast
+ * and serve only as initial guesses. */
+#define FCS_EMPTY 0
+#define FCS_STALE 1
+#define FCS_VALID 2
+
+/* Each slot holds the total field for one transmitter location and type,
+ * with the tolerance of the solve that produced it. Fields are kept in
+ * memory, possibly compressed, or in a local scratch file. */
+static int fcmax = 0, fccount = 0, fcmode = FC_FULL;
+static real *fcloc = NULL, *fctol = NULL;
+static int *fcplane = NULL, *fcstat = NULL;
+static cvec *fcvec = NULL;
+static FILE *fcfile = NULL;
+
+/* Find the slot for the specified transmitter, or -1 if there is none. */
+static int fcfind (real *loc, int plane) {
+	int i;
+
+	for (i = 0; i < fccount; ++i)
+		if (fcplane[i] == plane && !memcmp (fcloc + 3 * i, loc, 3 * sizeof(real)))
+			return i;
+
+	return -1;
+}
+
+/* Copy the field in slot i into fld. Returns 1 if every process succeeds. */
+static int fcread (cplx *fld, int i) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int ok;
+
+	if (fcmode != FC_DISK) return cvload (fld, fcvec + i, nelt);
+
+	/* A failed read on any process is a miss on all of them. */
+	fseek (fcfile, i * nelt * sizeof(cplx), SEEK_SET);
+	ok = (fread (fld, sizeof(cplx), nelt, fcfile) == (size_t)nelt);
+	MPI_Allreduce (MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, fmaconf.comm);
+	return ok;
+}
+
+/* Allocate a cache for the specified number of transmitters. The storage
+ * mode is the most accurate one that fits in the free memory of every
+ * process; the mode is returned. */
+int fcinit (int nmax) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol,
+	     need = (long)nmax * nelt * sizeof(cplx), avail;
+	int ok;
+
+	fcfree ();
+
+	avail = (long)(FCFRAC * memavail ());
+
+	/* Quantized fields usually take a quarter of the full storage. */
+	if (need <= avail) fcmode = FC_FULL;
+	else if (need / 4 <= avail) fcmode = FC_PACK;
+	else fcmode = FC_DISK;
+
+	/* Compression is collective, so all processes use the same mode. */
+	MPI_Allreduce (MPI_IN_PLACE, &fcmode, 1, MPI_INT, MPI_MAX, fmaconf.comm);
+
+	/* Every process needs a scratch file for disk storage. */
+	if (fcmode == FC_DISK) {
+		ok = ((fcfile = tmpfile ()) != NULL);
+		MPI_Allreduce (MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, fmaconf.comm);
+		if (!ok) {
+			fcfree ();
+			return -1;
+		}
+	}
+
+	fcmax = nmax;
+	fccount = 0;
+	fcloc = malloc (4L * nmax * sizeof(real));
+	fctol = fcloc + 3 * nmax;
+	fcplane = malloc (2L * nmax * sizeof(int));
+	fcstat = fcplane + nmax;
+	if (fcmode != FC_DISK) fcvec = calloc (nmax, sizeof(cvec));
+
+	return fcmode;
+}
+
+/* Copy the cached field for the specified transmitter into fld, if it was
+ * solved to at least the tolerance tol. Returns 1 on a hit, 0 otherwise. */
+int fcload (cplx *fld, real *loc, int plane, real tol) {
+	int i;
+
+	if ((i = fcfind (loc, plane)) < 0) return 0;
+	if (fcstat[i] != FCS_VALID || fctol[i] > tol) return 0;
+
+	return fcread (fld, i);
+}
+
+/* Copy the most recent field for the specified transmitter into fld, even if
+ * it belongs to a previous contrast, to serve as an initial guess. Returns 1
+ * if a field was found, 0 otherwise. */
+int fcguess (cplx *fld, real *loc, int plane) {
+	int i;
+
+	if ((i = fcfind (loc, plane)) < 0 || fcstat[i] == FCS_EMPTY) return 0;
+
+	return fcread (fld, i);
+}
+
+/* Cache the field for the specified transmitter, solved to tolerance tol,
+ * replacing any previous entry. This must be called by all processes.
+ * Returns 0 if every slot holds a valid field. */
+int fcstore (cplx *fld, real *loc, int plane, real tol) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i, ok;
+
+	if ((i = fcfind (loc, plane)) < 0) {
+		/* A full cache replaces the first field that is not valid. */
+		if (fccount < fcmax) i = fccount++;
+		else for (i = 0; i < fcmax && fcstat[i] == FCS_VALID; ++i);
+		if (i >= fcmax) return 0;
+		memcpy (fcloc + 3 * i, loc, 3 * sizeof(real));
+		fcplane[i] = plane;
+	}
+
+	fctol[i] = tol;
+	fcstat[i] = FCS_VALID;
+
+	if (fcmode != FC_DISK) {
+		cvstore (fcvec + i, fld, nelt, fcmode == FC_PACK ? FCSAFE * tol : 0);
+		return 1;
+	}
+
+	fseek (fcfile, i * nelt * sizeof(cplx), SEEK_SET);
+	ok = (fwrite (fld, sizeof(cplx), nelt, fcfile) == (size_t)nelt);
+	MPI_Allreduce (MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, fmaconf.comm);
+
+	/* Drop an entry that could not be written by every process. */
+	if (!ok) fcstat[i] = FCS_EMPTY;
+	return ok;
+}
+
+/* Find the total field for transmitter i in src, using the cached field if
+ * one is available and solving and caching otherwise. A stale field for the
+ * transmitter is the initial guess for the solve. Returns 1 on a hit. */
+int fcfield (cplx *fld, measdesc *src, int i, solveparm *slv) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	real *loc = src->locations + 3 * i;
+	cplx *rhs;
+	int guess;
+
+	if (fcload (fld, loc, src->plane, slv->epscg)) return 1;
+
+	/* Build the incident field and solve for the internal field. */
+	rhs = malloc (nelt * sizeof(cplx));
+	srcrhs (rhs, src, i);
+	guess = fcguess (fld, loc, src->plane);
+	itsolve (rhs, fld, guess, slv, 1);
+	free (rhs);
+
+	fcstore (fld, loc, src->plane, slv->epscg);
+	return 0;
+}
+
+/* Mark all cached fields stale, which must be done whenever the contrast
+ * changes. The fields are retained as initial guesses. */
+void fcclear (void) {
+	int i;
+
+	for (i = 0; i < fccount; ++i)
+		if (fcstat[i] == FCS_VALID) fcstat[i] = FCS_STALE;
+}
+
+void fcfree (void) {
+	int i;
+
+	if (fcvec) {
+		for (i = 0; i < fcmax; ++i) cvfree (fcvec + i);
+		free (fcvec);
+	}
+
+	if (fcfile) fclose (fcfile);
+	if (fcloc) free (fcloc);
+	if (fcplane) free (fcplane);
+
+	fcvec = NULL;
+	fcfile = NULL;
+	fcloc = fctol = NULL;
+	fcplane = fcstat = NULL;
+	fcmax = fccount = 0;
+}
+
+/* Return the bytes needed to save the occupied slots of the cache. Each slot
+ * is saved as its key, tolerance and state, followed by the local field. */
+long fcsize (void) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i, n;
+
+	for (i = 0, n = 0; i < fccount; ++i) if (fcstat[i] != FCS_EMPTY) ++n;
+
+	return sizeof(int) + n * (6L * sizeof(real) + nelt * sizeof(cplx));
+}
+
+/* Write the occupied slots of the cache to fh at byte offset off. This must
+ * be called by all processes. Returns the number of slots written. */
+int fcsave (MPI_File fh, MPI_Offset off) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	real meta[6];
+	cplx *fld;
+	int i, n;
+	MPI_Status stat;
+
+	for (i = 0, n = 0; i < fccount; ++i) if (fcstat[i] != FCS_EMPTY) ++n;
+	MPI_File_write_at (fh, off, &n, 1, MPI_INT, &stat);
+	off += sizeof(int);
+
+	fld = malloc (nelt * sizeof(cplx));
+
+	for (i = 0; i < fccount; ++i) {
+		if (fcstat[i] == FCS_EMPTY) continue;
+
+		/* An unreadable field is saved as a zero guess. */
+		if (!fcread (fld, i)) memset (fld, 0, nelt * sizeof(cplx));
+
+		memcpy (meta, fcloc + 3 * i, 3 * sizeof(real));
+		meta[3] = fctol[i];
+		meta[4] = fcplane[i];
+		meta[5] = fcstat[i];
+
+		MPI_File_write_at (fh, off, meta, 6, MPIREAL, &stat);
+		off += 6 * sizeof(real);
+		MPI_File_write_at (fh, off, fld, 2 * nelt, MPIREAL, &stat);
+		off += nelt * sizeof(cplx);
+	}
+
+	free (fld);
+
+	return n;
+}
+
+/* Read slots written by fcsave from fh at byte offset off into the cache,
+ * which must be initialized. This must be called by all processes. Returns
+ * the number of slots read. */
+int fcrestore (MPI_File fh, MPI_Offset off) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	real meta[6];
+	cplx *fld;
+	int i, j, n;
+	MPI_Status stat;
+
+	MPI_File_read_at (fh, off, &n, 1, MPI_INT, &stat);
+	off += sizeof(int);
+
+	fld = malloc (nelt * sizeof(cplx));
+
+	for (i = 0; i < n; ++i) {
+		MPI_File_read_at (fh, off, meta, 6, MPIREAL, &stat);
+		off += 6 * sizeof(real);
+		MPI_File_read_at (fh, off, fld, 2 * nelt, MPIREAL, &stat);
+		off += nelt * sizeof(cplx);
+
+		/* Restore the state, which may be stale, of a stored field. */
+		fcstore (fld, meta, (int)meta[4], meta[3]);
+		if ((j = fcfind (meta, (int)meta[4])) >= 0 && fcstat[j] != FCS_EMPTY)
+			fcstat[j] = (int)meta[5];
+	}
+
+	free (fld);
+
+	return n;
+}
@@ -0,0 +1,28 @@
+#ifndef __FLDCACHE_H_
+#define __FLDCACHE_H_
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "measure.h"
+#include "itsolver.h"
+
+/* Storage modes for cached total fields. */
+#define FC_FULL 0
+#define FC_PACK 1
+#define FC_DISK 2
+
+int fcinit (int);
+int fcload (cplx *, real *, int, real);
+int fcguess (cplx *, real *, int);
+int fcstore (cplx *, real *, int, real);
+int fcfield (cplx *, measdesc *, int, solveparm *);
+void fcclear (void);
+void fcfree (void);
+
+long fcsize (void);
+int fcsave (MPI_File, MPI_Offset);
+int fcrestore (MPI_File, MPI_Offset);
+
+#endif /* __FLDCACHE_H_ */
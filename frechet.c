@@ -1,7 +1,19 @@
+#include <stdio.h>
 #include <string.h>
 
 #include <mpi.h>
 
+/* Pull in the CBLAS header. */
+#ifdef _MACOSX
+#include <Accelerate/Accelerate.h>
+#else
+#ifdef _ATLAS
+#include <cblas.h>
+#else
+#include <gsl_cblas.h>
+#endif /* _ATLAS */
+#endif /* _MACOSX */
+
 #include "ScaleME.h"
 
 #include "precision.h"
@@ -10,30 +22,192 @@
 #include "itsolver.h"
 #include "measure.h"
 #include "frechet.h"
+#include "fldcache.h"
+#include "groups.h"
+#include "memplan.h"
+#include "util.h"
+
+/* The fraction of free node memory the Lanczos basis may occupy. */
+#define SPFRAC 0.5
+
+/* The receiver fields are the total fields, for the current contrast, of
+ * plane waves incident from the flipped observation directions, scaled as the
+ * adjoint Frechet fields. By reciprocity, the Frechet derivative and its
+ * adjoint are products with this block. The local rows of each field are
+ * stored consecutively. */
+static cplx *rcvfld = NULL;
+static measdesc *rcvobs = NULL;
+static int rcvstale = 1, rcvwarm = 0;
+
+/* The inversion mask flags the local unknowns that may change, and lists
+ * the local groups that hold any of them. Without a mask, all unknowns may
+ * change. */
+static unsigned char *roiflag = NULL;
+static int *roigrp = NULL, roicount = 0;
+
+/* Restrict the Frechet derivatives, and thus the contrast updates, to the
+ * nonzero entries of the local mask. Returns the number of local groups
+ * that hold unknowns. */
+int roiinit (cplx *mask) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i, any;
+
+	roifree ();
+
+	roiflag = malloc (nelt * sizeof(unsigned char));
+	roigrp = malloc (fmaconf.numbases * sizeof(int));
+
+	for (i = 0, roicount = 0; i < fmaconf.numbases; ++i) {
+		for (j = 0, any = 0; j < fmaconf.bspboxvol; ++j) {
+			roiflag[i * fmaconf.bspboxvol + j] = (mask[i * fmaconf.bspboxvol + j] != 0);
+			any |= roiflag[i * fmaconf.bspboxvol + j];
+		}
+		if (any) roigrp[roicount++] = i;
+	}
+
+	return roicount;
+}
+
+void roifree (void) {
+	if (roiflag) free (roiflag);
+	if (roigrp) free (roigrp);
+	roiflag = NULL;
+	roigrp = NULL;
+	roicount = 0;
+}
+
+/* Zero the entries of x outside the inversion mask, if there is one. */
+void roiapply (cplx *x) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+
+	if (!roiflag) return;
+
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < nelt; ++j) if (!roiflag[j]) x[j] = 0;
+}
+
+/* Select whether the Frechet derivatives use the Born approximation, which
+ * scatters the perturbation currents into the free-space background rather
+ * than the current contrast. No inner solves are required. */
+static int frborn = 0;
+
+void setborn (int born) {
+	frborn = born;
+}
+
+/* Allocate receiver fields for the observations obs. The fields are solved
+ * when first needed. */
+int rcvinit (measdesc *obs) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+
+	rcvfree ();
+
+	rcvfld = malloc (nelt * obs->count * sizeof(cplx));
+	rcvobs = obs;
+	rcvstale = 1;
+	rcvwarm = 0;
+
+	return obs->count;
+}
+
+/* Mark the receiver fields out of date, which must be done whenever the
+ * contrast changes. The old fields are initial guesses for the new ones. */
+void rcvclear (void) {
+	rcvstale = 1;
+}
+
+void rcvfree (void) {
+	if (rcvfld) free (rcvfld);
+	rcvfld = NULL;
+	rcvobs = NULL;
+}
+
+/* Return the local storage, in bytes, of the receiver fields. */
+long rcvmemory (void) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+
+	if (!rcvfld) return 0;
+	return nelt * rcvobs->count * sizeof(cplx);
+}
+
+/* Returns 1 if receiver fields for obs are available, solving for them if
+ * they are out of date, and 0 if they are not in use. */
+static int rcvready (measdesc *obs, solveparm *slv) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	cplx *rhs, *smag, scale;
+	int r;
+
+	if (!rcvfld || obs != rcvobs) return 0;
+	if (!rcvstale) return 1;
+
+	rhs = malloc ((nelt + (long)obs->count) * sizeof(cplx));
+	smag = rhs + nelt;
+
+	/* Compensate for FMM incoming signature scaling, as in frechadj. */
+	scale = I * fmaconf.k0 * fmaconf.k0;
+
+	for (r = 0; r < obs->count; ++r) {
+		/* Build the incident plane wave for this receiver. */
+		memset (smag, 0, obs->count * sizeof(cplx));
+		smag[r] = 1. / scale;
+		ScaleME_setRootFarFld (obs->imat[1], rhs, &smag);
+
+		/* Solve for the total field, starting from the previous one. */
+		itsolve (rhs, rcvfld + r * nelt, rcvwarm, slv, 1);
+	}
+
+	free (rhs);
+
+	rcvstale = 0;
+	rcvwarm = 1;
+
+	return 1;
+}
 
 /* Computes a contribution to the Frechet derivative for one transmitter. */
 int frechet (cplx *crt, cplx *fld,
 		cplx *sol, measdesc *obs, solveparm *slv) {
-	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
-	cplx *zwork, *zwcrt;
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	cplx *zwork, *zwcrt, factor, czero = 0.;
 
 	/* Set up the workspaces. */
 	zwork = malloc (2L * nelt * sizeof(cplx));
 	zwcrt = zwork + nelt;
 
-	/* Given the test vector and field distribution, compute the currents. */
-	for (j = 0; j < nelt; ++j) zwcrt[j] = crt[j] * fld[j];
+	/* Given the test vector and field distribution, compute the currents.
+	 * Only unknowns in the inversion mask contribute. */
+	vmuladd (zwcrt, crt, fld, NULL, nelt);
+	roiapply (zwcrt);
+
+	/* In the Born approximation, the currents radiate directly. */
+	if (frborn) {
+		farfield (zwcrt, obs, sol);
+		free (zwork);
+		return obs->count;
+	}
+
+	/* The derivative is the transpose of the adjoint, a product of the
+	 * receiver fields with the currents. */
+	if (rcvready (obs, slv)) {
+		factor = fmaconf.k0 * fmaconf.k0 * fmaconf.cellvol;
+		GEMV (CblasColMajor, CblasTrans, nelt, obs->count, &factor,
+				rcvfld, nelt, zwcrt, 1, &czero, sol, 1);
+		MPI_Allreduce (MPI_IN_PLACE, sol, 2 * obs->count,
+				MPIREAL, MPI_SUM, fmaconf.comm);
+
+		free (zwork);
+		return obs->count;
+	}
 
 	/* Compute the RHS for the given current distribution.
 	 * Store it in the buffer space. */
 	ScaleME_applyParFMA (zwcrt, zwork);
 
 	/* Compute the Frechet derivative field. */
-	bicgstab (zwork, zwork, 0, slv->maxit, slv->epscg, 1);
+	itsolve (zwork, zwork, 0, slv, 1);
 
 	/* Convert this into a current distribution. */
-	for (j = 0; j < nelt; ++j)
-		zwork[j] = fmaconf.contrast[j] * zwork[j] + zwcrt[j];
+	vmuladd (zwork, fmaconf.contrast, zwork, zwcrt, nelt);
 
 	/* Compute the measured scattered field. */
 	farfield (zwork, obs, sol);
@@ -44,104 +218,244 @@ int frechet (cplx *crt, cplx *fld,
 
 int frechadj (cplx *mag, cplx *fld,
 		cplx *sol, measdesc *obs, solveparm *slv) {
-	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	long j, k, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
 	real factor = fmaconf.k0 * fmaconf.k0 * fmaconf.cellvol;
-	cplx *zwork, *smag, scale;
+	cplx *zwork, *smag, scale, cone = 1., czero = 0.;
 
 	/* Temporary workspaces. */
 	zwork = malloc ((nelt + (long)obs->count) * sizeof(cplx));
 	smag = zwork + nelt;
 
-	/* Compensate incident field for FMM incoming signature scaling. */
-	scale = I * fmaconf.k0 * fmaconf.k0;
+	if (!frborn && rcvready (obs, slv)) {
+		/* Conjugate for back-propagation. The receiver fields are
+		 * already scaled. */
+		for (j = 0; j < obs->count; ++j) smag[j] = conj(mag[j]);
+
+		/* Combine the receiver fields for the adjoint field. */
+		GEMV (CblasColMajor, CblasNoTrans, nelt, obs->count, &cone,
+				rcvfld, nelt, smag, 1, &czero, zwork, 1);
+	} else {
+		/* Compensate incident field for FMM incoming signature scaling. */
+		scale = I * fmaconf.k0 * fmaconf.k0;
+
+		/* Conjugate for back-propagtion. Scale to compensate for
+		 * scaling of incoming far-field signature. */
+		for (j = 0; j < obs->count; ++j)
+			smag[j] = conj(mag[j]) / scale;
+
+		/* Compute the RHS for the provided magnitude distribution. */
+		ScaleME_setRootFarFld (obs->imat[1], zwork, &smag);
+
+		/* Compute the adjoint Frechet derivative field. The incident
+		 * field suffices in the Born approximation, but without the
+		 * solve the field must still be divided by the cell volume
+		 * on the diagonal of the system. */
+		if (!frborn) itsolve (zwork, zwork, 0, slv, 1);
+		else vaxpby (zwork, 1. / fmaconf.cellvol, zwork, 0., nelt);
+	}
 
-	/* Conjugate for back-propagtion. Scale to compensate for
-	 * scaling of incoming far-field signature. */
-	for (j = 0; j < obs->count; ++j)
-		smag[j] = conj(mag[j]) / scale;
+	/* Augment the solution for this transmitter. With an inversion
+	 * mask, only the groups that hold unknowns are touched. */
+	if (roiflag) {
+		roiapply (zwork);
+		for (j = 0; j < roicount; ++j) {
+			k = (long)roigrp[j] * (long)fmaconf.bspboxvol;
+			vcmuladd (sol + k, factor, zwork + k, fld + k, fmaconf.bspboxvol);
+		}
+	} else vcmuladd (sol, factor, zwork, fld, nelt);
 
-	/* Compute the RHS for the provided magnitude distribution. */
-	ScaleME_setRootFarFld (obs->imat[1], zwork, &smag);
+	free (zwork);
 
-	/* Compute the adjoint Frechet derivative field. */
-	bicgstab (zwork, zwork, 0, slv->maxit, slv->epscg, 1);
+	return fmaconf.numbases;
+}
 
-	/* Augment the solution for this transmitter. */
-	for (j = 0; j < nelt; ++j)
-		sol[j] += factor * conj (zwork[j] * fld[j]);
+/* Compare Re<F x, y> with Re<x, F^H y> for random currents x, measurements
+ * y and background field. Returns the relative difference, which is small
+ * when the derivative and its adjoint agree. */
+real frechcheck (measdesc *obs, solveparm *slv) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol,
+	     randmax = (2L << 31) - 1;
+	cplx *x, *fld, *adj, *y, *fx;
+	real lhs, rhs;
+	int rank;
 
-	free (zwork);
+	MPI_Comm_rank (fmaconf.comm, &rank);
 
-	return fmaconf.numbases;
+	x = malloc ((3L * nelt + 2L * obs->count) * sizeof(cplx));
+	fld = x + nelt;
+	adj = fld + nelt;
+	y = adj + nelt;
+	fx = y + obs->count;
+
+	for (j = 0; j < nelt; ++j) {
+		x[j] = ((real)random() + I * (real)random()) / (real)randmax;
+		fld[j] = ((real)random() + I * (real)random()) / (real)randmax;
+	}
+
+	/* The measurements are replicated, so they must agree. */
+	if (!rank) for (j = 0; j < obs->count; ++j)
+		y[j] = ((real)random() + I * (real)random()) / (real)randmax;
+	MPI_Bcast (y, 2 * obs->count, MPIREAL, 0, fmaconf.comm);
+
+	frechet (x, fld, fx, obs, slv);
+	memset (adj, 0, nelt * sizeof(cplx));
+	frechadj (y, fld, adj, obs, slv);
+
+	/* The mask limits both products to the same unknowns. */
+	roiapply (x);
+
+	for (j = 0, lhs = 0; j < obs->count; ++j) lhs += creal(fx[j] * conj(y[j]));
+	rhs = creal(pardot (adj, x, nelt));
+
+	free (x);
+
+	return fabs(lhs - rhs) / MAX(fabs(lhs), fabs(rhs));
+}
+
+/* Find the largest eigenvalue of the leading n-by-n block of the real
+ * symmetric tridiagonal matrix with diagonal a and off-diagonal b. If vec is
+ * not NULL, the corresponding eigenvector is stored there. */
+static real tridiagmax (real *a, real *b, int n, cplx *vec) {
+	cplx *t, *vt, *work, wt;
+	real *s, *rwork, mu;
+	int i, lwork, info, one = 1;
+
+	t = calloc (2L * n * n, sizeof(cplx));
+	vt = t + n * n;
+	s = malloc (6L * n * sizeof(real));
+	rwork = s + n;
+
+	for (i = 0; i < n; ++i) {
+		t[i * (n + 1)] = a[i];
+		if (i < n - 1) t[i * (n + 1) + 1] = t[(i + 1) * n + i] = b[i];
+	}
+
+	/* The Lanczos matrix of a positive semidefinite operator is positive
+	 * semidefinite, so its singular value decomposition is an
+	 * eigendecomposition. */
+	lwork = -1;
+	GESVD ("N", "S", &n, &n, t, &n, s, &wt, &one, vt, &n, &wt, &lwork, rwork, &info);
+	lwork = (int)creal(wt);
+	work = malloc (lwork * sizeof(cplx));
+	GESVD ("N", "S", &n, &n, t, &n, s, &wt, &one, vt, &n, work, &lwork, rwork, &info);
+	free (work);
+
+	mu = s[0];
+	if (vec) for (i = 0; i < n; ++i) vec[i] = conj(vt[i * n]);
+
+	free (t);
+	free (s);
+
+	return mu;
 }
 
-/* Estimate the square of the spectral radius of the Frechet derivative
- * using power iteration on the product of the derivative and its adjoint. */
-real specrad (int maxit, solveparm *slv, measdesc *src, measdesc *obs) {
-	cplx *ifld, *adjcrt, *scat, *pn, mu = 1.0, newmu;
+/* Estimate the square of the spectral radius of the Frechet derivative with
+ * a Lanczos process, fully reorthogonalized, on the product of the adjoint
+ * and the derivative. This is equivalent to Golub-Kahan bidiagonalization of
+ * the derivative and converges much faster than power iteration. If vec is
+ * not NULL and nonzero, it starts the process; on return, it holds the
+ * leading right singular vector of the derivative. The iterations are
+ * limited so the basis fits in memory. */
+real specrad (int maxit, solveparm *slv, measdesc *src, measdesc *obs, cplx *vec) {
+	cplx *ifld, *adjcrt, *scat, *v, *c, *y, cone = 1., czero = 0.;
 	long k, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol,
 	     randmax = (2L << 31) - 1;
-	real nrm, tmp;
-	int i, j;
+	real nrm, *alpha, *beta, mu = 0, newmu;
+	long avail;
+	int i, j, n, rank;
+
+	/* The basis holds maxit + 1 vectors, which must fit in the free
+	 * memory of every process. */
+	avail = (long)(SPFRAC * memavail ()) / (MAX(nelt, 1) * (long)sizeof(cplx));
+	MPI_Allreduce (MPI_IN_PLACE, &avail, 1, MPI_LONG, MPI_MIN, MPI_COMM_WORLD);
+	if (maxit >= avail) {
+		maxit = MAX(avail - 1, 1);
+		MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+		if (!rank) fprintf (stderr, "WARNING: Memory limits the Lanczos basis to %d vectors.\n", maxit + 1);
+	}
 
-	ifld = malloc (3L * nelt * sizeof(cplx));
-	adjcrt = ifld + nelt;
-	pn = adjcrt + nelt;
+	ifld = malloc (nelt * sizeof(cplx));
+	v = malloc ((maxit + 1L) * nelt * sizeof(cplx));
 
 	scat = malloc (obs->count * sizeof(cplx));
+	c = malloc (2L * (maxit + 1) * sizeof(cplx));
+	y = c + maxit + 1;
+	alpha = malloc (2L * (maxit + 1) * sizeof(real));
+	beta = alpha + maxit + 1;
+
+	/* Start from the provided vector or a random one. Unknowns outside
+	 * the inversion mask are in the null space. */
+	nrm = 0;
+	if (vec) {
+		memcpy (v, vec, nelt * sizeof(cplx));
+		roiapply (v);
+		nrm = vnrm2 (v, nelt);
+		MPI_Allreduce (MPI_IN_PLACE, &nrm, 1, MPIREAL, MPI_SUM, fmaconf.comm);
+	}
 
-	/* Build a random initial vector. */
-	for (k = 0, nrm = 0.0; k < nelt; ++k) {
-		pn[k] = ((real)random() + I * (real)random()) / (real)randmax;
-		tmp = cabs(pn[k]);
-		nrm += tmp * tmp;
+	if (nrm <= 0) {
+		for (k = 0; k < nelt; ++k)
+			v[k] = ((real)random() + I * (real)random()) / (real)randmax;
+		roiapply (v);
+		nrm = vnrm2 (v, nelt);
+		MPI_Allreduce (MPI_IN_PLACE, &nrm, 1, MPIREAL, MPI_SUM, fmaconf.comm);
 	}
-	MPI_Allreduce (MPI_IN_PLACE, &nrm, 1, MPIREAL, MPI_SUM, MPI_COMM_WORLD);
-	nrm = sqrt(nrm);
 
 	/* Normalize the initial vector. */
-	for (k = 0; k < nelt; ++k) pn[k] /= nrm;
+	vaxpby (v, 1. / sqrt(nrm), v, 0., nelt);
 
-	/* Loop through power iterations. */
-	for (j = 0; j < maxit; ++j) {
+	/* Loop through Lanczos iterations. */
+	for (j = 0, n = 0; j < maxit; ++j) {
+		adjcrt = v + (j + 1) * nelt;
 		memset (adjcrt, 0, nelt * sizeof(cplx));
 
-		/* Compute the product (F*)(F)p. */
+		/* Compute the product (F*)(F)v. */
 		for (i = 0; i < src->count; ++i) {
-			/* Build the incident field. */
-			buildrhs (ifld, src->locations + 3 * i, src->plane, NULL);
-			/* Solve for the internal field. */
-			bicgstab (ifld, ifld, 0, slv->maxit, slv->epscg, 1);
+			/* Another group handles this transmitter. */
+			if (!grpmine (i)) continue;
+			/* Find the internal field. */
+			fcfield (ifld, src, i, slv);
 			/* Compute the Frechet derivative. */
-			frechet (pn, ifld, scat, obs, slv);
+			frechet (v + j * nelt, ifld, scat, obs, slv);
 			/* Compute the adjoint Frechet derivative. */
 			frechadj (scat, ifld, adjcrt, obs, slv);
 		}
 
-		/* Update the norm of the solution and find the approximate
-		 * singular value. Note that the norm of the test vector is 1. */
-		for (k = 0, nrm = newmu = 0.0; k < nelt; ++k) {
-			newmu += conj(pn[k]) * adjcrt[k];
-			tmp = cabs(adjcrt[k]);
-			nrm += tmp * tmp;
-		}
-		MPI_Allreduce (MPI_IN_PLACE, &nrm, 1, MPIREAL, MPI_SUM, MPI_COMM_WORLD);
-		MPI_Allreduce (MPI_IN_PLACE, &newmu, 2, MPIREAL, MPI_SUM, MPI_COMM_WORLD);
-		nrm = sqrt(nrm);
+		/* Combine the contributions of all groups. */
+		grpsum (adjcrt, 2 * nelt, MPIREAL);
 
-		/* Break if the updated singular value hasn't changed much. */
-		if (cabs((newmu - mu) / mu) < slv->epscg) break;
+		/* Orthogonalize against, and extend, the Lanczos basis. */
+		cmgs (adjcrt, c, v, nelt, j + 1);
+		alpha[j] = creal(c[j]);
+		beta[j] = creal(c[j + 1]);
+		n = j + 1;
 
-		/* Normalize the solution for the next iteration. */
-		for (k = 0; k < nelt; ++k)
-			pn[k] = adjcrt[k] / nrm;
+		/* Find the largest Ritz value. */
+		newmu = tridiagmax (alpha, beta, n, NULL);
+
+		/* Stop when the Ritz value has converged or the Krylov
+		 * space is invariant. */
+		if (fabs(newmu - mu) < slv->epscg * newmu ||
+				beta[j] < REAL_EPSILON * newmu) {
+			mu = newmu;
+			break;
+		}
 
-		/* Copy the new singular value. */
 		mu = newmu;
 	}
 
+	/* Assemble the leading Ritz vector, if desired. */
+	if (vec && n > 0) {
+		tridiagmax (alpha, beta, n, y);
+		GEMV (CblasColMajor, CblasNoTrans, nelt, n, &cone,
+				v, nelt, y, 1, &czero, vec, 1);
+	}
+
 	free (ifld);
+	free (v);
 	free (scat);
+	free (c);
+	free (alpha);
 
-	return creal(mu);
+	return mu;
 }
@@ -8,6 +8,17 @@
 
 int frechet (cplx *, cplx *, cplx *, measdesc *, solveparm *);
 int frechadj (cplx *, cplx *, cplx *, measdesc *, solveparm *);
-real specrad (int, solveparm *, measdesc *, measdesc *);
+real specrad (int, solveparm *, measdesc *, measdesc *, cplx *);
+real frechcheck (measdesc *, solveparm *);
+void setborn (int);
+
+int rcvinit (measdesc *);
+void rcvclear (void);
+void rcvfree (void);
+long rcvmemory (void);
+
+int roiinit (cplx *);
+void roifree (void);
+void roiapply (cplx *);
 
 #endif /* __FRECHET_H_ */
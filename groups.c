@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "groups.h"
+
+/* The world is split into groups of equal size, each of which runs its own
+ * FMM over fmaconf.comm. Processes with the same rank in each group share a
+ * cross communicator, over which the groups combine their contributions, and
+ * a counter on the first process hands out work to the groups. */
+static int ngrp = 1, grpidx = 0, grpctr = 0;
+static MPI_Comm grpcross = MPI_COMM_NULL;
+static MPI_Win grpwin = MPI_WIN_NULL;
+static int *grpqueue = NULL;
+
+/* Split the world into the specified number of groups, reduced as necessary
+ * to evenly divide the processes, and point fmaconf.comm at the group of this
+ * process. Returns the number of groups. */
+int grpsplit (int n) {
+	int rank, size, grank;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_size (MPI_COMM_WORLD, &size);
+
+	n = MAX(1, MIN(n, size));
+	while (size % n) --n;
+
+	ngrp = n;
+	grpctr = 0;
+
+	if (ngrp < 2) {
+		grpidx = 0;
+		fmaconf.comm = MPI_COMM_WORLD;
+		return ngrp;
+	}
+
+	/* Groups are contiguous, so they tend to share nodes. */
+	grpidx = rank / (size / ngrp);
+	MPI_Comm_split (MPI_COMM_WORLD, grpidx, rank, &(fmaconf.comm));
+	MPI_Comm_rank (fmaconf.comm, &grank);
+	MPI_Comm_split (MPI_COMM_WORLD, grank, grpidx, &grpcross);
+
+	/* The shared work counter lives on the first process. */
+	MPI_Win_allocate (rank ? 0 : sizeof(int), sizeof(int),
+			MPI_INFO_NULL, MPI_COMM_WORLD, &grpqueue, &grpwin);
+	grpreset ();
+
+	return ngrp;
+}
+
+int grpindex (void) {
+	return grpidx;
+}
+
+int grpcount (void) {
+	return ngrp;
+}
+
+/* Work items statically assigned to groups are distributed cyclically. Use
+ * this when groups keep state, such as cached fields, for their items. */
+int grpmine (int i) {
+	return (i % ngrp) == grpidx;
+}
+
+/* Claim the next step work items from the dynamic queue, returning the index
+ * of the first. All processes in a group must call this together. */
+int grpnext (int step) {
+	int grank, first = 0;
+
+	/* A single group takes every item in order. */
+	if (ngrp < 2) {
+		first = grpctr;
+		grpctr += step;
+		return first;
+	}
+
+	/* The group root claims items and shares the result. */
+	MPI_Comm_rank (fmaconf.comm, &grank);
+	if (!grank) {
+		MPI_Win_lock (MPI_LOCK_SHARED, 0, 0, grpwin);
+		MPI_Fetch_and_op (&step, &first, MPI_INT, 0, 0, MPI_SUM, grpwin);
+		MPI_Win_unlock (0, grpwin);
+	}
+
+	MPI_Bcast (&first, 1, MPI_INT, 0, fmaconf.comm);
+	return first;
+}
+
+/* Empty the work queue. This must be called by all processes. */
+void grpreset (void) {
+	int rank;
+
+	grpctr = 0;
+	if (ngrp < 2) return;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+	MPI_Barrier (MPI_COMM_WORLD);
+	if (!rank) {
+		MPI_Win_lock (MPI_LOCK_EXCLUSIVE, 0, 0, grpwin);
+		*grpqueue = 0;
+		MPI_Win_unlock (0, grpwin);
+	}
+	MPI_Barrier (MPI_COMM_WORLD);
+}
+
+/* Sum the contributions of all groups to buf, which has the same layout in
+ * every group. This must be called by all processes. */
+int grpsum (void *buf, int count, MPI_Datatype type) {
+	if (ngrp < 2) return 0;
+	return MPI_Allreduce (MPI_IN_PLACE, buf, count, type, MPI_SUM, grpcross);
+}
+
+void grpfree (void) {
+	if (ngrp < 2) return;
+
+	MPI_Win_free (&grpwin);
+	MPI_Comm_free (&grpcross);
+	MPI_Comm_free (&(fmaconf.comm));
+
+	fmaconf.comm = MPI_COMM_WORLD;
+	ngrp = 1;
+	grpidx = 0;
+}
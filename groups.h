@@ -0,0 +1,15 @@
+#ifndef __GROUPS_H_
+#define __GROUPS_H_
+
+#include <mpi.h>
+
+int grpsplit (int);
+int grpindex (void);
+int grpcount (void);
+int grpmine (int);
+int grpnext (int);
+void grpreset (void);
+int grpsum (void *, int, MPI_Datatype);
+void grpfree (void);
+
+#endif /* __GROUPS_H_ */
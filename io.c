@@ -8,6 +8,7 @@
 
 #include "precision.h"
 
+#include "mlfma.h"
 #include "io.h"
 #include "util.h"
 
@@ -53,7 +54,7 @@ int getctgrp (cplx *crt, char *fname, int *size, int *bsl, int nbs, int bpb) {
 
 	nelt = (long)nbs * (long)bpbvol;
 
-	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+	MPI_Comm_rank (fmaconf.comm, &mpirank);
 
 	/* Zero out the contrast in case nothing can be read. */
 	memset (crt, 0, nelt * sizeof(cplx));
@@ -61,7 +62,7 @@ int getctgrp (cplx *crt, char *fname, int *size, int *bsl, int nbs, int bpb) {
 	wtime = MPI_Wtime();
 
 	/* Open the MPI file with the specified name. */
-	if (MPI_File_open (MPI_COMM_WORLD, fname, MPI_MODE_RDONLY,
+	if (MPI_File_open (fmaconf.comm, fname, MPI_MODE_RDONLY,
 				MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
 		fprintf (stderr, "ERROR: unable to open %s.\n", fname);
 		return 0;
@@ -123,12 +124,12 @@ int prtctgrp (char *fname, cplx *crt, int *size, int *bsl, int nbs, int bpb) {
 
 	nelt = (long)nbs * (long)bpbvol;
 
-	MPI_Comm_rank (MPI_COMM_WORLD, &mpirank);
+	MPI_Comm_rank (fmaconf.comm, &mpirank);
 
 	wtime = MPI_Wtime();
 
 	/* Open the MPI file with the specified name. */
-	if (MPI_File_open (MPI_COMM_WORLD, fname, MPI_MODE_WRONLY |
+	if (MPI_File_open (fmaconf.comm, fname, MPI_MODE_WRONLY |
 				MPI_MODE_CREATE, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
 		fprintf (stderr, "ERROR: could not open %s.\n", fname);
 		return 0;
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 #include <mpi.h>
 
@@ -23,14 +24,18 @@
 #include "mlfma.h"
 #include "direct.h"
 #include "itsolver.h"
+#include "compress.h"
+#include "precond.h"
 #include "util.h"
 
+/* The minimum cosine between the residual and its image in IDR(s) steps. */
+#define IDR_KAPPA 0.7
+
 int matvec (cplx *out, cplx *in, cplx *cur, int id) {
-	long i, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
 
 	/* Compute the contrast pressure. */
-#pragma omp parallel for default(shared) private(i)
-	for (i = 0; i < nelt; ++i) cur[i] = in[i] * fmaconf.contrast[i];
+	vmuladd (cur, in, fmaconf.contrast, NULL, nelt);
 
 	/* Reset the direct-interaction buffer and compute
 	 * the matrix-vector product for the Green's matrix. */
@@ -39,53 +44,127 @@ int matvec (cplx *out, cplx *in, cplx *cur, int id) {
 
 	if (!id) return 0;
 
+	/* Add in the identity portion. */
+	vaxpby (out, fmaconf.cellvol, in, -1., nelt);
+
+	return 0;
+}
+
+/* Compute the matrix-vector products for the fmaconf.nrhs vectors stored
+ * consecutively in in, storing the products consecutively in out. All vectors
+ * share a single ScaleME application. The workspace cur must be large enough
+ * to hold two full blocks of vectors. */
+int bmatvec (cplx *out, cplx *in, cplx *cur, int id) {
+	long i, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	long lblk = nelt * (long)fmaconf.nrhs;
+
+	/* Compute the contrast pressure in the packed ScaleME layout. */
+	blkpack (cur, in, fmaconf.contrast);
+
+	/* Reset the direct-interaction buffer and compute
+	 * the matrix-vector product for the Green's matrix. */
+	clrdircache();
+	ScaleME_applyParFMA (cur, cur + lblk);
+
+	/* Restore the consecutive layout of the products. */
+	blkunpack (out, cur + lblk);
+
+	if (!id) return 0;
+
 	/* Add in the identity portion. */
 #pragma omp parallel for default(shared) private(i)
-	for (i = 0; i < nelt; ++i) out[i] = fmaconf.cellvol * in[i] - out[i];
+	for (i = 0; i < lblk; ++i) out[i] = fmaconf.cellvol * in[i] - out[i];
 
 	return 0;
 }
 
+/* Compute the product of the right-preconditioned system matrix A M^{-1} with
+ * in. Without a preconditioner, this is the ordinary product. The workspace
+ * cur must be large enough to hold two vectors. */
+static int pmatvec (cplx *out, cplx *in, cplx *cur) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+
+	if (!pcready()) return matvec (out, in, cur, 1);
+
+	pcapply (cur + nelt, in);
+	return matvec (out, cur + nelt, cur, 1);
+}
+
+/* Select whether GMRES stores its Krylov and augmentation vectors in
+ * compressed form. Compression is disabled by default. */
+static int gmcomp = 0;
+
+/* A safety factor for the relative error permitted in compressed vectors. */
+#define GMCSAFE 0.1
+
+void setcompress (int cmp) {
+	gmcomp = cmp;
+}
+
+/* Select whether GMRES and BiCG-STAB relax the accuracy of the far-field
+ * interactions as the residual decreases. Relaxation is disabled by default. */
+static int slrelax = 0;
+
+/* A safety factor for the relative operator error in relaxed products. */
+#define RELAXSAFE 0.1
+
+void setrelax (int rlx) {
+	slrelax = rlx;
+}
+
+/* For inexact Krylov methods, the error in a product may grow inversely with
+ * the relative residual err while preserving the final tolerance tol. Reduce
+ * the far-field rank accordingly, but never above the ceiling rmax. */
+static void relaxop (int rmax, real tol, real err) {
+	if (!slrelax) return;
+	fmaconf.acatrunc = MIN(rmax, farrank (MIN(1., RELAXSAFE * tol / err)));
+}
+
 int gmres (cplx *rhs, cplx *sol, int guess,
 		int mit, real tol, int quiet, augspace *aug) {
 	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol, lwork;
-	int i, rank, one = 1, mred = mit;
-	cplx *h, *v, *mvp, *beta, *vp, *hp, *s, cr,
-		cone = 1., czero = 0., *azp, *zp;
+	int i, l, rank, one = 1, mred = mit, rmax = fmaconf.acatrunc;
+	cplx *h, *w, *mvp, *beta, *hp, *s, *ys, *zp, cr;
 	real rhn, err, *c;
+	cvec *v;
 
-	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_rank (fmaconf.comm, &rank);
 
 	/* Allocate space for all required complex vectors. */
-	lwork = (mit + 1) * (mit + nelt + 1) + nelt + mit;
-	v = calloc (lwork, sizeof(cplx));	/* The Krylov subspace. */
-	beta = v + nelt * (mit + 1);		/* The least-squares RHS. */
-	mvp = beta + mit + 1;			/* Buffer for matrix-vector product. */
-	h = mvp + nelt;				/* The upper Hessenberg matrix. */
+	lwork = (mit + 1) * (mit + 1) + 4 * nelt + 2 * mit;
+	w = calloc (lwork, sizeof(cplx));	/* The working Arnoldi vector. */
+	mvp = w + nelt;				/* Buffer for matrix-vector product. */
+	zp = mvp + 2 * nelt;			/* The decompressed basis vector. */
+	beta = zp + nelt;			/* The least-squares RHS. */
+	h = beta + mit + 1;			/* The upper Hessenberg matrix. */
 	s = h + (mit + 1) * mit;		/* Givens rotation sines. */
+	ys = s + mit;				/* The least-squares solution. */
 
 	/* Allocate space for the Givens rotation cosines. */
 	c = malloc (mit * sizeof(real));
 
+	/* The Krylov subspace, possibly compressed. */
+	v = calloc (mit + 1, sizeof(cvec));
+
 	/* Compute the norm of the RHS for residual scaling. */
 	rhn = parnorm(rhs, nelt);
 
 	/* Compute the initial matrix-vector product for the input guess. */
-	if (guess) matvec (v, sol, mvp, 1);
+	if (guess) matvec (w, sol, mvp, 1);
 
 	/* Subtract from the RHS to form the residual. */
 #pragma omp parallel for default(shared) private(j)
-	for (j = 0; j < nelt; ++j) v[j] = rhs[j] - v[j];
+	for (j = 0; j < nelt; ++j) w[j] = rhs[j] - w[j];
 
 	/* Zero the initial guess if one wasn't provided. */
 	if (!guess) memset (sol, 0, nelt * sizeof(cplx));
 
 	/* Find the norm of the initial residual. */
-	err = parnorm(v, nelt);
+	err = parnorm(w, nelt);
 
 	/* Construct the initial Arnoldi vector by normalizing the residual. */
 #pragma omp parallel for default(shared) private(j)
-	for (j = 0; j < nelt; ++j) v[j] /= err;
+	for (j = 0; j < nelt; ++j) w[j] /= err;
 
 	/* Construct the vector beta for the minimization problem. */
 	beta[0] = err;
@@ -94,28 +173,31 @@ int gmres (cplx *rhs, cplx *sol, int guess,
 	err /= rhn;
 	if (!rank && !quiet) printf ("True residual: %g\n", err);
 
+	/* Store the first Arnoldi vector. */
+	cvstore (v, w, nelt, gmcomp ? GMCSAFE * tol / err : 0);
+
 	/* The reduced number of iterations, if the space is augmented. */
 	if (aug) mred = mit - aug->ntot;
 
 	for (i = 0; i < mit && err > tol; ++i) {
 		/* Point to the working space for this iteration. */
-		vp = v + i * nelt;
 		hp = h + i * (mit + 1);
 
 		/* Compute the next expansion of the Krylov space. */
-		if (!aug || i < mred) matvec (vp + nelt, vp, mvp, 1);
-		else {
-			/* Update with the next augmented vector. */
-			azp = aug->az + nelt * 
-				((aug->nmax + aug->start + mred - i) % aug->nmax);
-			/* Use the augmented space. */
-			memcpy (vp + nelt, azp, nelt * sizeof(cplx));
+		if (!aug || i < mred) {
+			cvload (zp, v + i, nelt);
+			relaxop (rmax, tol, err);
+			pmatvec (w, zp, mvp);
+		} else {
+			/* Use the next vector in the augmented space. */
+			cvload (w, aug->az +
+				((aug->nmax + aug->start + mred - i) % aug->nmax), nelt);
 		}
 
 		/* Perform modified Gram-Schmidt to orthogonalize the basis. */
 		/* This also builds the Hessenberg matrix column, including
 		 * the 2-norm of the next basis vector. */
-		cmgs (vp + nelt, hp, v, nelt, i + 1);
+		cvmgs (w, hp, v, nelt, i + 1);
 
 		/* Watch for breakdown. */
 		if (cabs(hp[i + 1]) < REAL_EPSILON) {
@@ -139,57 +221,189 @@ int gmres (cplx *rhs, cplx *sol, int guess,
 		err = cabs(beta[i + 1]) / rhn;
 		if (!rank && !quiet) printf ("GMRES(%d): %g\n", i, err);
 
+		/* Store the new basis vector. As the residual shrinks, later
+		 * vectors contribute less to the solution and tolerate a
+		 * proportionally coarser representation. */
+		cvstore (v + i + 1, w, nelt, gmcomp ? GMCSAFE * tol / err : 0);
+
 		/* Flush the output buffers. */
 		fflush (stdout);
 		fflush (stderr);
 	}
 
 	/* If there were any GMRES iterations, update the solution. */
-	if (i > 0 && aug) {
+	if (i > 0) {
 		/* Compute the optimum solution in the Krylov basis. */
-		cplx *ys;
-		ys = malloc(i * sizeof(cplx));
 		memcpy (ys, beta, i * sizeof(cplx));
 		TRSV (CblasColMajor, CblasUpper, CblasNoTrans,
 				CblasNonUnit, i, h, mit + 1, ys, 1);
 
-		/* Compute the next Krylov vector in the augmented space. */
-		aug->start = (aug->start + 1) % aug->nmax;
-		if (aug->ntot < aug->nmax) ++(aug->ntot);
-		azp = aug->az + nelt * aug->start;
-
-		beta[i] = 0;
-		for (j = i - 1; j >= 0; --j) {
-			/* Invert the Givens rotations. */
-			s[j] = -s[j];
-			ROT (&one, beta + j, &one, beta + j + 1, &one, c + j, s + j);
-		}
-		GEMV (CblasColMajor, CblasNoTrans, nelt, i + 1,
-				&cone, v, nelt, beta, 1, &czero, azp, 1);
-
-		/* Overwrite the Krylov subspace with the augmented subspace.
-		 * The start pointer has already been incremented! */
-		for (j = mred; j < i; ++j) {
-			zp = aug->z + nelt * 
-				((aug->nmax + aug->start + mred - j - 1) % aug->nmax);
-			memcpy(v + j * nelt, zp, nelt * sizeof(cplx));
+		/* Only the Arnoldi portion passes through the preconditioner. */
+		l = aug ? MIN(i, mred) : i;
+		memset (zp, 0, nelt * sizeof(cplx));
+		for (j = 0; j < l; ++j) cvaxpy (zp, ys[j], v + j, nelt);
+		pcapply (zp, zp);
+
+		if (aug) {
+			/* Add the contributions of the augmented directions. The
+			 * update is finished before any vector is overwritten. */
+			for (j = l; j < i; ++j)
+				cvaxpy (zp, ys[j], aug->z + ((aug->nmax
+					+ aug->start + mred - j) % aug->nmax), nelt);
+
+			/* Store the update as the next augmented vector. */
+			aug->start = (aug->start + 1) % aug->nmax;
+			if (aug->ntot < aug->nmax) ++(aug->ntot);
+			cvstore (aug->z + aug->start, zp, nelt, gmcomp ? GMCSAFE * tol : 0);
+
+			/* Invert the Givens rotations to recover the image. */
+			beta[i] = 0;
+			for (j = i - 1; j >= 0; --j) {
+				s[j] = -s[j];
+				ROT (&one, beta + j, &one, beta + j + 1, &one, c + j, s + j);
+			}
+
+			/* Compute and store the image of the augmented vector. */
+			memset (w, 0, nelt * sizeof(cplx));
+			for (j = 0; j <= i; ++j) cvaxpy (w, beta[j], v + j, nelt);
+			cvstore (aug->az + aug->start, w, nelt, gmcomp ? GMCSAFE * tol : 0);
 		}
 
-		/* Compute the solution update. */
-		zp = aug->z + nelt * aug->start;
-		GEMV (CblasColMajor, CblasNoTrans, nelt, i,
-				&cone, v, nelt, ys, 1, &czero, zp, 1);
+#pragma omp parallel for default(shared) private(j)
 		for (j = 0; j < nelt; ++j) sol[j] += zp[j];
+	}
+
+	/* Restore the operator accuracy. */
+	fmaconf.acatrunc = rmax;
+
+	for (j = 0; j <= mit; ++j) cvfree (v + j);
+
+	free (v);
+	free (w);
+	free (c);
+
+	return i;
+}
+
+/* Release the storage of an augmented space. */
+void augfree (augspace *aug) {
+	int i;
+
+	for (i = 0; i < aug->nmax; ++i) {
+		cvfree (aug->z + i);
+		cvfree (aug->az + i);
+	}
+
+	free (aug->z);
+}
+
+/* Solve the system with flexible GMRES. The variable right preconditioner is
+ * an inner GMRES solve, without restarts, that uses the cheaper operator
+ * configuration in inp. Each outer iteration therefore costs one accurate
+ * product and several cheap ones. */
+int fgmres (cplx *rhs, cplx *sol, int guess,
+		int mit, real tol, int quiet, innerparm *inp) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol, lwork;
+	int i, rank, one = 1, rsave, brk;
+	cplx *h, *v, *z, *mvp, *beta, *vp, *zp, *hp, *s, cr, cone = 1.;
+	real rhn, err, *c;
+
+	MPI_Comm_rank (fmaconf.comm, &rank);
+
+	/* Allocate space for all required complex vectors. */
+	lwork = (mit + 1) * (mit + 2) + (2 * mit + 2) * nelt + mit;
+	v = calloc (lwork, sizeof(cplx));	/* The Krylov subspace. */
+	z = v + nelt * (mit + 1);		/* The preconditioned subspace. */
+	beta = z + nelt * mit;			/* The least-squares RHS. */
+	mvp = beta + mit + 1;			/* Buffer for matrix-vector product. */
+	h = mvp + nelt;				/* The upper Hessenberg matrix. */
+	s = h + (mit + 1) * mit;		/* Givens rotation sines. */
+
+	/* Allocate space for the Givens rotation cosines. */
+	c = malloc (mit * sizeof(real));
+
+	/* Compute the norm of the RHS for residual scaling. */
+	rhn = parnorm(rhs, nelt);
+
+	/* Compute the initial matrix-vector product for the input guess. */
+	if (guess) matvec (v, sol, mvp, 1);
+
+	/* Subtract from the RHS to form the residual. */
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < nelt; ++j) v[j] = rhs[j] - v[j];
+
+	/* Zero the initial guess if one wasn't provided. */
+	if (!guess) memset (sol, 0, nelt * sizeof(cplx));
+
+	/* Find the norm of the initial residual. */
+	err = parnorm(v, nelt);
+
+	/* Construct the initial Arnoldi vector by normalizing the residual. */
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < nelt; ++j) v[j] /= err;
+
+	/* Construct the vector beta for the minimization problem. */
+	beta[0] = err;
 
-		free(ys);
-	} else if (i > 0) {
+	/* Report the RRE. */
+	err /= rhn;
+	if (!rank && !quiet) printf ("True residual: %g\n", err);
+
+	for (i = 0; i < mit && err > tol; ++i) {
+		/* Point to the working space for this iteration. */
+		vp = v + i * nelt;
+		zp = z + i * nelt;
+		hp = h + i * (mit + 1);
+
+		/* Approximately invert the operator with the cheap configuration. */
+		rsave = fmaconf.acatrunc;
+		fmaconf.acatrunc = inp->rank;
+		fmaconf.lowprec = inp->lowprec;
+		gmres (vp, zp, 0, inp->maxit, inp->epscg, 1, NULL);
+		fmaconf.lowprec = 0;
+		fmaconf.acatrunc = rsave;
+
+		/* Compute the next expansion with the accurate operator. */
+		matvec (vp + nelt, zp, mvp, 1);
+
+		/* Perform modified Gram-Schmidt to orthogonalize the basis. */
+		cmgs (vp + nelt, hp, v, nelt, i + 1);
+
+		/* Watch for breakdown, which signals an exact solution. */
+		brk = cabs(hp[i + 1]) < REAL_EPSILON;
+
+		/* Apply previous Givens rotations to the Hessenberg column. */
+		for (j = 0; j < i; ++j)
+			ROT (&one, hp + j, &one, hp + j + 1, &one, c + j, s + j);
+
+		/* Compute and apply the Givens rotation for this iteration. */
+		LARTG (hp + i, hp + i + 1, c + i, s + i, &cr);
+		hp[i] = cr;
+		hp[i + 1] = 0;
+		ROT (&one, beta + i, &one, beta + i + 1, &one, c + i, s + i);
+
+		/* Estimate the RRE for this iteration. */
+		err = cabs(beta[i + 1]) / rhn;
+		if (!rank && !quiet) printf ("FGMRES(%d): %g\n", i, err);
+
+		/* Flush the output buffers. */
+		fflush (stdout);
+		fflush (stderr);
+
+		if (brk) {
+			++i;
+			break;
+		}
+	}
+
+	if (i > 0) {
 		/* Compute the minimizer of the least-squares problem. */
 		TRSV (CblasColMajor, CblasUpper, CblasNoTrans,
 				CblasNonUnit, i, h, mit + 1, beta, 1);
 
-		/* Compute the solution update in place. */
+		/* The update lies in the preconditioned subspace. */
 		GEMV (CblasColMajor, CblasNoTrans, nelt, i,
-				&cone, v, nelt, beta, 1, &cone, sol, 1);
+				&cone, z, nelt, beta, 1, &cone, sol, 1);
 	}
 
 	free (v);
@@ -201,23 +415,32 @@ int gmres (cplx *rhs, cplx *sol, int guess,
 int bicgstab (cplx *rhs, cplx *sol,
 		int guess, int mit, real tol, int quiet) {
 	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
-	int i, rank;
-	cplx *r, *rhat, *v, *p, *mvp, *t;
+	int i, rank, rmax = fmaconf.acatrunc;
+	cplx *r, *rhat, *v, *p, *mvp, *t, *ph, *sh;
 	cplx rho, alpha, omega, beta;
-	real err, rhn;
+	real err, rhn, tn;
 
-	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_rank (fmaconf.comm, &rank);
 
 	rho = alpha = omega = 1.;
 
 	/* Allocate and zero the work arrays. */
-	r = calloc (6L * nelt, sizeof(cplx));
+	r = calloc ((pcready() ? 8L : 6L) * nelt, sizeof(cplx));
 	rhat = r + nelt;
 	v = rhat + nelt;
 	p = v + nelt;
 	t = p + nelt;
 	mvp = t + nelt;
 
+	/* Right-preconditioned search directions need separate storage. */
+	if (pcready()) {
+		ph = mvp + nelt;
+		sh = ph + nelt;
+	} else {
+		ph = p;
+		sh = r;
+	}
+
 	/* Compute the norm of the right-hand side for residual scaling. */
 	rhn = parnorm(rhs, nelt);
 
@@ -251,23 +474,21 @@ int bicgstab (cplx *rhs, cplx *sol,
 		for (j = 0; j < nelt; ++j)
 			p[j] = r[j] + beta * (p[j] - omega * v[j]);
 
-		/* Compute the first search step, v = A * p. */
-		matvec (v, p, mvp, 1);
+		/* Compute the first search step, v = A * M^{-1} * p. */
+		relaxop (rmax, tol, err);
+		pcapply (ph, p);
+		matvec (v, ph, mvp, 1);
 
 		/* Compute the next alpha. */
 		alpha = rho / pardot (rhat, v, nelt);
 
-#pragma omp parallel for default(shared) private(j)
-		for (j = 0; j < nelt; ++j) {
-			/* Update the solution vector. */
-			sol[j] += alpha * p[j];
-			/* Update the residual vector. */
-			r[j] -= alpha * v[j];
-		}
+		/* Update the solution and residual vectors. */
+		err = vsolupd (sol, r, alpha, ph, v, nelt);
+		MPI_Allreduce (MPI_IN_PLACE, &err, 1, MPIREAL, MPI_SUM, fmaconf.comm);
 
 		/* Compute the scaled residual norm and stop if convergence
 		 * has been achieved. */
-		err = parnorm(r, nelt) / rhn;
+		err = sqrt(err) / rhn;
 		if (!rank && !quiet) printf ("BiCG-STAB(%0.1f): %g\n", 0.5 + i, err);
 
 		/* Flush the output buffers. */
@@ -276,29 +497,1052 @@ int bicgstab (cplx *rhs, cplx *sol,
 
 		if (err < tol) break;
 
-		/* Compute the next search step, t = A * r. */
-		matvec (t, r, mvp, 1);
+		/* Compute the next search step, t = A * M^{-1} * r. */
+		relaxop (rmax, tol, err);
+		pcapply (sh, r);
+		matvec (t, sh, mvp, 1);
 
-		/* Compute the update direction. */
-		omega = pardot (t, r, nelt) / pardot (t, t, nelt);
+		/* Compute the update direction with a single reduction. */
+		omega = pardotnrm (&tn, t, r, nelt);
+		omega /= tn;
 
 		/* Update both the residual and the solution guess. */
-#pragma omp parallel for default(shared) private(j)
-		for (j = 0; j < nelt; ++j) {
-			/* Update the solution vector. */
-			sol[j] += omega * r[j];
-			/* Update the residual vector. */
-			r[j] -= omega * t[j];
-		}
+		err = vsolupd (sol, r, omega, sh, t, nelt);
+		MPI_Allreduce (MPI_IN_PLACE, &err, 1, MPIREAL, MPI_SUM, fmaconf.comm);
 
 		/* Compute the scaled residual norm. */
-		err = parnorm(r, nelt) / rhn;
+		err = sqrt(err) / rhn;
 		if (!rank && !quiet) printf ("BiCG-STAB(%d): %g\n", i + 1, err);
 
 		fflush (stdout);
 		fflush (stderr);
 	}
 
+	/* Restore the operator accuracy. */
+	fmaconf.acatrunc = rmax;
+
+	free (r);
+	return i;
+}
+
+/* Solve the system with the biorthogonal variant of IDR(s), after van Gijzen
+ * and Sonneveld, "Algorithm 913: An elegant IDR(s) variant that efficiently
+ * exploits biorthogonality properties," ACM TOMS 38(1), 2011. The memory is
+ * fixed at 3s + 5 vectors and each matrix-vector product requires only one
+ * batched reduction for the s shadow-space projections. Each product counts
+ * as one iteration. */
+int idrs (cplx *rhs, cplx *sol, int guess,
+		int mit, real tol, int quiet, int s) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol,
+	     randmax = (2L << 31) - 1;
+	int i, k, l, rank, brk = 0;
+	cplx *p, *r, *t, *g, *u, *v, *mvp, *m, *f, *c, *ip, *gk, *uk,
+	     om = 1., cone = 1., cmone = -1.;
+	real err, rhn, ns, rho;
+
+	MPI_Comm_rank (fmaconf.comm, &rank);
+
+	/* Allocate and zero the work vectors. The residual must follow the
+	 * shadow space, and the residual must precede its image, so shadow
+	 * projections and residual norms share reductions. */
+	p = calloc ((3L * s + 5L) * nelt, sizeof(cplx));
+	r = p + s * nelt;	/* The residual. */
+	t = r + nelt;		/* The image of the preconditioned residual. */
+	g = t + nelt;		/* The images of the search directions. */
+	u = g + s * nelt;	/* The search directions. */
+	v = u + s * nelt;	/* The next search direction. */
+	mvp = v + nelt;		/* Buffer for matrix-vector products. */
+
+	/* The small projected system, its right-hand side and solution. */
+	m = calloc (s * s + 3 * s + 3, sizeof(cplx));
+	f = m + s * s;
+	c = f + s + 1;
+	ip = c + s;
+
+	/* The projected system is initially the identity. */
+	for (k = 0; k < s; ++k) m[k * (s + 1)] = 1.;
+
+	/* Build a random, orthonormal shadow space. */
+	for (k = 0; k < s; ++k) {
+		for (j = 0; j < nelt; ++j)
+			p[k * nelt + j] = ((real)random() + I * (real)random()) / (real)randmax;
+		cmgs (p + k * nelt, ip, p, nelt, k);
+	}
+
+	/* Compute the norm of the right-hand side for residual scaling. */
+	rhn = parnorm(rhs, nelt);
+
+	/* Compute the inital matrix-vector product for the input guess. */
+	if (guess) matvec (r, sol, mvp, 1);
+
+	/* Subtract from the RHS to form the residual. */
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < nelt; ++j) r[j] = rhs[j] - r[j];
+
+	if (!guess) memset (sol, 0, nelt * sizeof(cplx));
+
+	/* Project the residual and find its norm in one reduction. */
+	parinner (f, p, s + 1, r, 1, nelt);
+	err = sqrt(creal(f[s])) / rhn;
+	if (!rank && !quiet) printf ("True residual: %g\n", err);
+
+	for (i = 0; i < mit && err > tol && !brk; ) {
+		/* Build s new directions in the current Sonneveld space. */
+		for (k = 0; k < s && i < mit && err > tol; ++k, ++i) {
+			gk = g + k * nelt;
+			uk = u + k * nelt;
+
+			/* Solve the lower-triangular projected system. */
+			memcpy (c, f + k, (s - k) * sizeof(cplx));
+			TRSV (CblasColMajor, CblasLower, CblasNoTrans, CblasNonUnit,
+					s - k, m + k * (s + 1), s, c, 1);
+
+			/* Form the next direction, v = M^{-1} (r - G c). */
+			memcpy (v, r, nelt * sizeof(cplx));
+			GEMV (CblasColMajor, CblasNoTrans, nelt, s - k,
+					&cmone, gk, nelt, c, 1, &cone, v, 1);
+			pcapply (v, v);
+
+			/* Combine with the previous directions, u_k = U c + om v. */
+			GEMV (CblasColMajor, CblasNoTrans, nelt, s - k,
+					&cone, uk, nelt, c, 1, &om, v, 1);
+			memcpy (uk, v, nelt * sizeof(cplx));
+
+			/* Compute the image of the new direction. */
+			matvec (gk, uk, mvp, 1);
+
+			/* Project the image onto the shadow space. */
+			parinner (ip, p, s, gk, 1, nelt);
+
+			/* Bi-orthogonalize against the previous directions. The
+			 * projections of the remaining directions are updated in
+			 * the small space, so no further reductions are needed. */
+			for (l = 0; l < k; ++l) {
+				c[l] = ip[l] / m[l * (s + 1)];
+				for (j = l + 1; j < s; ++j) ip[j] -= c[l] * m[l * s + j];
+			}
+
+			if (k > 0) {
+				GEMV (CblasColMajor, CblasNoTrans, nelt, k,
+						&cmone, g, nelt, c, 1, &cone, gk, 1);
+				GEMV (CblasColMajor, CblasNoTrans, nelt, k,
+						&cmone, u, nelt, c, 1, &cone, uk, 1);
+			}
+
+			/* Record the new column of the projected system. */
+			for (j = k; j < s; ++j) m[k * s + j] = ip[j];
+
+			/* Watch for breakdown. */
+			if (cabs(m[k * (s + 1)]) < REAL_EPSILON) {
+				brk = 1;
+				++i;
+				break;
+			}
+
+			/* Make the residual orthogonal to the k-th shadow vector. */
+			c[0] = f[k] / m[k * (s + 1)];
+
+			err = vsolupd (sol, r, c[0], uk, gk, nelt);
+			MPI_Allreduce (MPI_IN_PLACE, &err, 1, MPIREAL, MPI_SUM, fmaconf.comm);
+
+			/* Update the projection of the residual. */
+			for (j = k + 1; j < s; ++j) f[j] -= c[0] * m[k * s + j];
+
+			err = sqrt(err) / rhn;
+			if (!rank && !quiet) printf ("IDR(%d): %g\n", i, err);
+
+			/* Flush the output buffers. */
+			fflush (stdout);
+			fflush (stderr);
+		}
+
+		if (brk || i >= mit || err <= tol) break;
+
+		/* Enter the next Sonneveld space with a minimal-residual step. */
+		pcapply (v, r);
+		matvec (t, v, mvp, 1);
+
+		/* Compute the products with the residual and image together. */
+		parinner (ip, r, 2, t, 1, nelt);
+		ns = sqrt(creal(ip[1]));
+
+		/* Limit the step to maintain accuracy, with the angle
+		 * criterion from Sleijpen and van der Vorst. */
+		om = conj(ip[0]) / creal(ip[1]);
+		rho = cabs(ip[0]) / (ns * err * rhn);
+		if (rho < IDR_KAPPA) om *= IDR_KAPPA / rho;
+
+		vsolupd (sol, r, om, v, t, nelt);
+
+		/* Project the new residual and find its norm. */
+		parinner (f, p, s + 1, r, 1, nelt);
+		err = sqrt(creal(f[s])) / rhn;
+		++i;
+
+		if (!rank && !quiet) printf ("IDR(%d): %g\n", i, err);
+
+		fflush (stdout);
+		fflush (stderr);
+	}
+
+	free (m);
+	free (p);
+	return i;
+}
+
+/* Replace the recycled space with the harmonic Ritz vectors that end a GCRO-DR
+ * cycle. The combined basis w holds the k + n + 1 vectors [C V], the matrix g,
+ * with leading dimension ldg, satisfies A [U D, V(0:n-1)] = w g, and d holds
+ * the inverse norms of the columns of U that form the diagonal scaling D. The
+ * workspace ut must hold rcy->kmax vectors. */
+static int recharmonic (recspace *rcy, cplx *w, cplx *g,
+		int ldg, real *d, int n, cplx *ut) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i, l, k = rcy->k, s = rcy->k + n, sp, knew, lwork, info, one = 1, *idx;
+	cplx *ae, *be, *m, *vr, *p, *gp, *al, *bt, *tau, *work,
+	     cone = 1., czero = 0.;
+	real *rwork, *hr, tmp;
+
+	sp = s + 1;
+	knew = MIN(rcy->kmax, s);
+	lwork = 64 * sp;
+
+	/* Allocate the eigenproblem and factorization workspaces. */
+	ae = calloc (4 * s * s + 2 * sp * s + 3 * s + lwork, sizeof(cplx));
+	be = ae + s * s;
+	vr = be + s * s;
+	p = vr + s * s;
+	m = p + s * s;
+	gp = m + sp * s;
+	al = gp + sp * s;
+	bt = al + s;
+	tau = bt + s;
+	work = tau + s;
+
+	rwork = malloc (9 * s * sizeof(real));
+	hr = rwork + 8 * s;
+	idx = malloc (s * sizeof(int));
+
+	/* Build the projection of the basis [U D, V(0:n-1)] onto w. The recycled
+	 * portion requires inner products; the Arnoldi portion is the identity. */
+	parinner (m, w, sp, rcy->u, k, nelt);
+	for (i = 0; i < k; ++i)
+		for (l = 0; l < sp; ++l) m[l + i * sp] *= d[i];
+	for (i = k; i < s; ++i) m[i + i * sp] = 1.;
+
+	/* The harmonic Ritz problem: g^H g p = theta g^H m p. */
+	GEMM (CblasColMajor, CblasConjTrans, CblasNoTrans, s, s, sp,
+			&cone, g, ldg, g, ldg, &czero, ae, s);
+	GEMM (CblasColMajor, CblasConjTrans, CblasNoTrans, s, s, sp,
+			&cone, g, ldg, m, sp, &czero, be, s);
+	GGEV ("N", "V", &s, ae, &s, be, &s, al, bt, vr, &one,
+			vr, &s, work, &lwork, rwork, &info);
+
+	if (info) {
+		free (ae);
+		free (rwork);
+		free (idx);
+		return rcy->k;
+	}
+
+	/* Sort the eigenvectors by increasing magnitude of the Ritz values,
+	 * placing infinite values at the end. */
+	for (i = 0; i < s; ++i) {
+		idx[i] = i;
+		if (cabs(bt[i]) > REAL_EPSILON * cabs(al[i]))
+			hr[i] = cabs(al[i] / bt[i]);
+		else hr[i] = HUGE_VAL;
+	}
+	for (i = 0; i < knew; ++i)
+		for (l = i + 1; l < s; ++l)
+			if (hr[idx[l]] < hr[idx[i]]) {
+				info = idx[i];
+				idx[i] = idx[l];
+				idx[l] = info;
+			}
+
+	/* Gather the selected eigenvectors. */
+	for (i = 0; i < knew; ++i)
+		memcpy (p + i * s, vr + idx[i] * s, s * sizeof(cplx));
+
+	/* Factor g p = Q R. */
+	GEMM (CblasColMajor, CblasNoTrans, CblasNoTrans, sp, knew, s,
+			&cone, g, ldg, p, s, &czero, gp, sp);
+	GEQRF (&sp, &knew, gp, &sp, tau, work, &lwork, &info);
+
+	/* Drop trailing vectors that are numerically dependent. */
+	tmp = cabs(gp[0]);
+	for (i = 1; i < knew; ++i)
+		if (cabs(gp[i + i * sp]) < REAL_EPSILON * tmp) break;
+	knew = i;
+
+	/* The new recycled space is U = [U D, V] p R^{-1} with C = w Q. */
+	TRSM (CblasColMajor, CblasRight, CblasUpper, CblasNoTrans, CblasNonUnit,
+			s, knew, &cone, gp, sp, p, s);
+	UNGQR (&sp, &knew, &knew, gp, &sp, tau, work, &lwork, &info);
+
+	GEMM (CblasColMajor, CblasNoTrans, CblasNoTrans, nelt, knew, sp,
+			&cone, w, nelt, gp, sp, &czero, rcy->c, nelt);
+
+	for (i = 0; i < knew; ++i)
+		for (l = 0; l < k; ++l) p[l + i * s] *= d[l];
+	GEMM (CblasColMajor, CblasNoTrans, CblasNoTrans, nelt, knew, n,
+			&cone, w + k * nelt, nelt, p + k, s, &czero, ut, nelt);
+	if (k > 0) GEMM (CblasColMajor, CblasNoTrans, CblasNoTrans, nelt, knew, k,
+			&cone, rcy->u, nelt, p, s, &cone, ut, nelt);
+	memcpy (rcy->u, ut, knew * nelt * sizeof(cplx));
+
+	rcy->k = knew;
+
+	free (ae);
+	free (rwork);
+	free (idx);
+
+	return knew;
+}
+
+/* Solve the system with GCRO-DR, the deflated restarted GMRES of Parks et al.
+ * Each cycle of at most rcy->m iterations first removes the component of the
+ * residual in the recycled space C = A U, then extends [C V] with Arnoldi
+ * iterations kept orthogonal to C. The harmonic Ritz vectors of the cycle
+ * with the smallest Ritz values replace U, carrying the slowest modes from one
+ * cycle, and one right-hand side, to the next. Cycles continue until
+ * convergence or until mit total iterations have been used. */
+int gcrodr (cplx *rhs, cplx *sol, int guess,
+		int mit, real tol, int quiet, recspace *rcy) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i, it, rank, one = 1, k, nv, nw, ldg;
+	cplx *w, *v, *r, *mvp, *ut, *dx, *g, *h, *beta, *s, *z, *vp, *gp, *hp, cr,
+	     cone = 1., cmone = -1., czero = 0.;
+	real rhn, err, bnrm, *c, *d;
+
+	MPI_Comm_rank (fmaconf.comm, &rank);
+
+	/* The combined basis holds the recycled space and the Arnoldi vectors. */
+	nw = MAX(rcy->m, rcy->kmax + 1) + 1;
+
+	/* Allocate the basis, residual, product and recycling workspaces. */
+	w = malloc ((nw + rcy->kmax + 4) * nelt * sizeof(cplx));
+	r = w + nw * nelt;
+	mvp = r + nelt;
+	ut = mvp + 2 * nelt;
+
+	/* Allocate the projected matrix, its rotated Arnoldi portion,
+	 * the least-squares RHS, the Givens sines and a small work vector. */
+	g = malloc ((2 * nw * nw + 3 * nw) * sizeof(cplx));
+	h = g + nw * nw;
+	beta = h + nw * nw;
+	s = beta + nw;
+	z = s + nw;
+
+	/* Allocate the Givens cosines and the recycled-space scale factors. */
+	c = malloc ((nw + rcy->kmax + 1) * sizeof(real));
+	d = c + nw;
+
+	/* Compute the norm of the RHS for residual scaling. */
+	rhn = parnorm(rhs, nelt);
+
+	/* Compute the initial matrix-vector product for the input guess. */
+	if (guess) matvec (r, sol, mvp, 1);
+	else memset (r, 0, nelt * sizeof(cplx));
+
+	/* Subtract from the RHS to form the residual. */
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < nelt; ++j) r[j] = rhs[j] - r[j];
+
+	/* Zero the initial guess if one wasn't provided. */
+	if (!guess) memset (sol, 0, nelt * sizeof(cplx));
+
+	/* Report the RRE. */
+	err = parnorm(r, nelt) / rhn;
+	if (!rank && !quiet) printf ("True residual: %g\n", err);
+
+	/* With a right preconditioner, accumulate the update separately. */
+	if (pcready()) {
+		dx = ut + rcy->kmax * nelt;
+		memset (dx, 0, nelt * sizeof(cplx));
+	} else dx = sol;
+
+	for (it = 0; it < mit && err > tol; it += i) {
+		k = rcy->k;
+
+		/* Remove the component of the residual in the recycled space. */
+		if (k > 0) {
+			parinner (z, rcy->c, k, r, 1, nelt);
+			GEMV (CblasColMajor, CblasNoTrans, nelt, k,
+					&cone, rcy->u, nelt, z, 1, &cone, dx, 1);
+			GEMV (CblasColMajor, CblasNoTrans, nelt, k,
+					&cmone, rcy->c, nelt, z, 1, &cone, r, 1);
+
+			/* Copy C to the front of the combined basis. */
+			memcpy (w, rcy->c, k * nelt * sizeof(cplx));
+
+			/* Find the scale factors that normalize U. */
+			parnorms (d, rcy->u, nelt, k);
+			for (i = 0; i < k; ++i) d[i] = 1. / d[i];
+		}
+
+		/* Find the norm of the deflated residual. */
+		bnrm = parnorm(r, nelt);
+		err = bnrm / rhn;
+		if (k > 0 && !rank && !quiet)
+			printf ("GCRO-DR deflated residual: %g\n", err);
+		if (err <= tol) break;
+
+		/* Construct the initial Arnoldi vector. */
+		v = w + k * nelt;
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < nelt; ++j) v[j] = r[j] / bnrm;
+
+		/* Limit the cycle to the basis size and the remaining iterations. */
+		nv = MIN(MAX(rcy->m - k, 1), mit - it);
+		ldg = k + nv + 1;
+
+		/* The recycled columns of the projected matrix are diagonal. */
+		memset (g, 0, ldg * (k + nv) * sizeof(cplx));
+		for (i = 0; i < k; ++i) g[i + i * ldg] = d[i];
+
+		memset (beta, 0, (nv + 1) * sizeof(cplx));
+		beta[0] = bnrm;
+
+		for (i = 0; i < nv; ++i) {
+			/* Point to the working space for this iteration. */
+			vp = v + i * nelt;
+			gp = g + (k + i) * ldg;
+			hp = h + i * (nv + 1);
+
+			/* Compute the next expansion of the Krylov space. */
+			pmatvec (vp + nelt, vp, mvp);
+
+			/* Orthogonalize against C and the Arnoldi basis together,
+			 * building the full column of the projected matrix. */
+			cmgs (vp + nelt, gp, w, nelt, k + i + 1);
+
+			/* Copy the Arnoldi portion of the column for rotation. */
+			memcpy (hp, gp + k, (i + 2) * sizeof(cplx));
+
+			/* Apply previous Givens rotations to the Hessenberg column. */
+			for (j = 0; j < i; ++j)
+				ROT (&one, hp + j, &one, hp + j + 1, &one, c + j, s + j);
+
+			/* Compute and apply the Givens rotation for this iteration. */
+			LARTG (hp + i, hp + i + 1, c + i, s + i, &cr);
+			hp[i] = cr;
+			hp[i + 1] = 0;
+			ROT (&one, beta + i, &one, beta + i + 1, &one, c + i, s + i);
+
+			/* Estimate the RRE for this iteration. */
+			err = cabs(beta[i + 1]) / rhn;
+			if (!rank && !quiet) printf ("GCRO-DR(%d): %g\n", it + i, err);
+
+			/* Flush the output buffers. */
+			fflush (stdout);
+			fflush (stderr);
+
+			/* Stop on convergence or breakdown. */
+			if (err <= tol || cabs(gp[k + i + 1]) < REAL_EPSILON) {
+				++i;
+				break;
+			}
+		}
+
+		/* Compute the minimizer of the least-squares problem. */
+		TRSV (CblasColMajor, CblasUpper, CblasNoTrans,
+				CblasNonUnit, i, h, nv + 1, beta, 1);
+
+		/* Update the solution with the Arnoldi portion. */
+		GEMV (CblasColMajor, CblasNoTrans, nelt, i,
+				&cone, v, nelt, beta, 1, &cone, dx, 1);
+
+		/* The recycled portion of the update is -U B y. */
+		if (k > 0) {
+			GEMV (CblasColMajor, CblasNoTrans, k, i, &cone,
+					g + k * ldg, ldg, beta, 1, &czero, z, 1);
+			GEMV (CblasColMajor, CblasNoTrans, nelt, k,
+					&cmone, rcy->u, nelt, z, 1, &cone, dx, 1);
+		}
+
+		/* The new residual lies in the Arnoldi space. */
+		GEMV (CblasColMajor, CblasNoTrans, i + 1, i, &cmone,
+				g + k * ldg + k, ldg, beta, 1, &czero, z, 1);
+		z[0] += bnrm;
+		GEMV (CblasColMajor, CblasNoTrans, nelt, i + 1,
+				&cone, v, nelt, z, 1, &czero, r, 1);
+
+		/* Replace the recycled space for the next cycle or solve. */
+		recharmonic (rcy, w, g, ldg, d, i, ut);
+	}
+
+	/* Map the accumulated update through the preconditioner. */
+	if (dx != sol) {
+		pcapply (dx, dx);
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < nelt; ++j) sol[j] += dx[j];
+	}
+
+	free (w);
+	free (g);
+	free (c);
+
+	return it;
+}
+
+/* Restore the relationship C = A U, with orthonormal C, after the operator
+ * or the right preconditioner, which is part of A here, has changed. Vectors that have become numerically dependent are dropped. */
+int recupdate (recspace *rcy) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i, l, k;
+	cplx *mvp, *rc, *up, *cp, *ul;
+	real nrm;
+
+	mvp = malloc (2 * nelt * sizeof(cplx));
+	rc = malloc ((rcy->kmax + 1) * sizeof(cplx));
+
+	for (i = 0, k = 0; i < rcy->k; ++i) {
+		up = rcy->u + k * nelt;
+		cp = rcy->c + k * nelt;
+
+		/* Compact the surviving vectors. */
+		if (i != k) memcpy (up, rcy->u + i * nelt, nelt * sizeof(cplx));
+
+		/* Apply the new operator and orthogonalize against previous columns. */
+		pmatvec (cp, up, mvp);
+		nrm = parnorm (cp, nelt);
+		cmgs (cp, rc, rcy->c, nelt, k);
+
+		if (creal(rc[k]) < REAL_EPSILON * nrm) continue;
+
+		/* Apply the same transformation to U to preserve C = A U. */
+		for (l = 0, ul = rcy->u; l < k; ++l, ul += nelt) {
+#pragma omp parallel for default(shared) private(j)
+			for (j = 0; j < nelt; ++j) up[j] -= rc[l] * ul[j];
+		}
+
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < nelt; ++j) up[j] /= rc[k];
+
+		++k;
+	}
+
+	rcy->k = k;
+
+	free (mvp);
+	free (rc);
+
+	return k;
+}
+
+/* Build in sol the initial guess from the span of previous solutions that
+ * minimizes the norm of the residual for rhs, which may not alias sol. This
+ * requires no matrix-vector products. Returns the dimension of the span, or
+ * zero if no guess was formed. */
+int projguess (cplx *rhs, cplx *sol, guesspace *gsp) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	cplx *c, cone = 1., czero = 0.;
+
+	if (gsp->ntot < 1) return 0;
+
+	c = malloc (gsp->ntot * sizeof(cplx));
+
+	/* The residual is minimized by the projection onto orthonormal w. */
+	parinner (c, gsp->w, gsp->ntot, rhs, 1, nelt);
+	GEMV (CblasColMajor, CblasNoTrans, nelt, gsp->ntot,
+			&cone, gsp->x, nelt, c, 1, &czero, sol, 1);
+
+	free (c);
+
+	return gsp->ntot;
+}
+
+/* Add the pair of a right-hand side and its solution to the guess space,
+ * discarding the oldest pair if the space is full. The new right-hand side is
+ * orthogonalized against the span and the same transformation is applied to
+ * the solution. Returns the new dimension of the span. */
+int addguess (cplx *rhs, cplx *sol, guesspace *gsp) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	cplx *c, *wp, *xp, cone = 1., cmone = -1.;
+	real nrm;
+
+	if (gsp->nmax < 1) return 0;
+
+	/* Drop the oldest pair to make room. */
+	if (gsp->ntot >= gsp->nmax) {
+		--(gsp->ntot);
+		memmove (gsp->w, gsp->w + nelt, gsp->ntot * nelt * sizeof(cplx));
+		memmove (gsp->x, gsp->x + nelt, gsp->ntot * nelt * sizeof(cplx));
+	}
+
+	c = malloc ((gsp->ntot + 1) * sizeof(cplx));
+
+	wp = gsp->w + gsp->ntot * nelt;
+	xp = gsp->x + gsp->ntot * nelt;
+
+	memcpy (wp, rhs, nelt * sizeof(cplx));
+	memcpy (xp, sol, nelt * sizeof(cplx));
+
+	/* Orthogonalize the right-hand side against the span. */
+	nrm = parnorm (wp, nelt);
+	cmgs (wp, c, gsp->w, nelt, gsp->ntot);
+
+	/* Skip a right-hand side that is already in the span. */
+	if (creal(c[gsp->ntot]) > sqrt(REAL_EPSILON) * nrm) {
+		/* Transform the solution to preserve A x = w. */
+		GEMV (CblasColMajor, CblasNoTrans, nelt, gsp->ntot,
+				&cmone, gsp->x, nelt, c, 1, &cone, xp, 1);
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < nelt; ++j) xp[j] /= c[gsp->ntot];
+
+		++(gsp->ntot);
+	}
+
+	free (c);
+
+	return gsp->ntot;
+}
+
+/* Return the local workspace, in bytes, of gmres with restart length mit and
+ * naug augmented vectors, including the augmented space. The Krylov basis is
+ * assumed to be uncompressed. */
+long gmresmem (int mit, int naug) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+
+	return ((long)(mit + 1) * (mit + 1) + 4 * nelt + 2 * mit) * sizeof(cplx)
+		+ mit * sizeof(real) + (mit + 1 + 2L * naug) * (sizeof(cvec)
+		+ nelt * sizeof(cplx));
+}
+
+/* Return the local workspace, in bytes, of fgmres with restart length mit,
+ * including the inner GMRES solves described by inp. */
+long fgmresmem (int mit, innerparm *inp) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+
+	return ((long)(mit + 1) * (mit + 2) + (2L * mit + 2) * nelt + mit)
+		* sizeof(cplx) + mit * sizeof(real) + gmresmem (inp->maxit, 0);
+}
+
+/* Return the local workspace, in bytes, of gcrodr with cycle length m and a
+ * recycled space of dimension kmax, including the recycled space. */
+long gcrodrmem (int m, int kmax) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	long nw = MAX(m, kmax + 1) + 1;
+
+	return ((nw + 3L * kmax + 4) * nelt + 6 * nw * nw + 2 * nw * kmax
+			+ 64 * nw) * sizeof(cplx) + (nw + kmax + 1) * sizeof(real);
+}
+
+/* Run a single solve with the solver described by slv: restarted flexible
+ * GMRES with inner solves when configured, GCRO-DR when a recycled space is
+ * attached, IDR(s) when requested, BiCG-STAB otherwise. */
+int itsolve (cplx *rhs, cplx *sol, int guess, solveparm *slv, int quiet) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i, nit;
+	cplx *b = rhs;
+
+	/* Restarts and the guess space need the RHS, which may be overwritten. */
+	if (rhs == sol && (slv->inner || slv->gsp)) {
+		b = malloc (nelt * sizeof(cplx));
+		memcpy (b, rhs, nelt * sizeof(cplx));
+	}
+
+	/* Project an initial guess if none was provided. */
+	if (!guess && slv->gsp) guess = projguess (b, sol, slv->gsp);
+
+	if (slv->inner) {
+		for (i = 0, nit = 1; i < slv->maxit && nit > 0; i += nit)
+			nit = fgmres (b, sol, guess || i,
+					MIN(slv->inner->restart, slv->maxit - i),
+					slv->epscg, quiet, slv->inner);
+	} else if (slv->rcy) i = gcrodr (b, sol, guess,
+			slv->maxit, slv->epscg, quiet, slv->rcy);
+	else if (slv->idrdim > 0) i = idrs (b, sol, guess,
+			slv->maxit, slv->epscg, quiet, slv->idrdim);
+	else i = bicgstab (b, sol, guess, slv->maxit, slv->epscg, quiet);
+
+	/* Record the solution for future guesses. */
+	if (slv->gsp) addguess (b, sol, slv->gsp);
+
+	if (b != rhs) free (b);
+
+	return i;
+}
+
+/* Solve the systems for the fmaconf.nrhs right-hand sides stored consecutively
+ * in rhs with lock-stepped GMRES. Each right-hand side builds its own Krylov
+ * subspace, but every iteration uses a single block matrix-vector product and
+ * the Gram-Schmidt reductions for all systems are combined. Systems that have
+ * converged are zeroed out of subsequent products. Returns the largest number
+ * of iterations used by any system. */
+int bgmres (cplx *rhs, cplx *sol, int guess, int mit, real tol, int quiet) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol, lblk;
+	int i, k, l, rank, one = 1, nrhs = fmaconf.nrhs, nact, ldh = mit + 1,
+	    *nit, *act, *reo, rit = 0;
+	cplx *h, *v, *mvp, *beta, *vp, *hp, *s, *dp, *wp, *sv, *bp, *sp,
+	     cr, cone = 1.;
+	real *c, *cp, *rhn, *err, *crit, *nrm, emax;
+
+	MPI_Comm_rank (fmaconf.comm, &rank);
+
+	lblk = nelt * (long)nrhs;
+
+	/* Allocate the Krylov subspaces and product workspace. */
+	v = calloc ((mit + 3) * lblk, sizeof(cplx));
+	mvp = v + (mit + 1) * lblk;
+
+	/* Allocate the Hessenberg matrices, least-squares RHS and sines. */
+	h = calloc (nrhs * (mit + 1) * (mit + 2), sizeof(cplx));
+	beta = h + nrhs * (mit + 1) * mit;
+	s = beta + nrhs * (mit + 1);
+	dp = s + nrhs * mit;
+
+	/* Allocate the cosines, norms and convergence criteria. */
+	c = malloc (nrhs * (mit + 4) * sizeof(real));
+	rhn = c + nrhs * mit;
+	err = rhn + nrhs;
+	crit = err + nrhs;
+	nrm = crit + nrhs;
+
+	/* Per-system iteration counts and activity flags. */
+	nit = malloc (3 * nrhs * sizeof(int));
+	act = nit + nrhs;
+	reo = act + nrhs;
+
+	/* Compute the norms of the RHS for residual scaling. */
+	parnorms (rhn, rhs, nelt, nrhs);
+
+	/* Compute the initial matrix-vector product for the input guess. */
+	if (guess) bmatvec (v, sol, mvp, 1);
+
+	/* Subtract from the RHS to form the residual. */
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < lblk; ++j) v[j] = rhs[j] - v[j];
+
+	/* Zero the initial guess if one wasn't provided. */
+	if (!guess) memset (sol, 0, lblk * sizeof(cplx));
+
+	/* Find the norms of the initial residuals. */
+	parnorms (err, v, nelt, nrhs);
+
+	for (l = 0, nact = 0, emax = 0; l < nrhs; ++l) {
+		nit[l] = 0;
+
+		/* Construct the initial Arnoldi vector and the vector beta. */
+		beta[l * ldh] = err[l];
+		if (err[l] > 0) {
+			vp = v + l * nelt;
+#pragma omp parallel for default(shared) private(j)
+			for (j = 0; j < nelt; ++j) vp[j] /= err[l];
+		}
+
+		/* Systems with vanishing right-hand sides are already solved. */
+		err[l] = (rhn[l] > 0) ? (err[l] / rhn[l]) : 0;
+		act[l] = (err[l] > tol);
+		nact += act[l];
+		emax = MAX(emax, err[l]);
+	}
+
+	/* Report the largest RRE. */
+	if (!rank && !quiet) printf ("True residual: %g\n", emax);
+
+	for (i = 0; i < mit && nact > 0; ++i) {
+		/* Point to the working space for this iteration. */
+		vp = v + i * lblk;
+		wp = vp + lblk;
+
+		/* Converged systems don't participate in the product. */
+		for (l = 0; l < nrhs; ++l)
+			if (!act[l]) memset (vp + l * nelt, 0, nelt * sizeof(cplx));
+
+		/* Compute the next expansion of all Krylov spaces. */
+		bmatvec (wp, vp, mvp, 1);
+
+		/* Perform modified Gram-Schmidt to orthogonalize each basis. */
+		for (l = 0; l < nrhs; ++l) crit[l] = 0;
+
+		for (k = 0; k <= i; ++k) {
+			/* Project each new vector on its own basis at once. */
+			pardots (dp, v + k * lblk, wp, nelt, nrhs);
+
+			for (l = 0; l < nrhs; ++l) {
+				if (!act[l]) {
+					dp[l] = 0;
+					continue;
+				}
+
+				h[l * ldh * mit + i * ldh + k] = dp[l];
+				crit[l] += cabs(dp[l]);
+			}
+
+			/* Remove the projections, column by column. */
+			sv = v + k * lblk;
+			for (l = 0; l < nrhs; ++l)
+				if (dp[l] != 0) vaxpby (wp + l * nelt, -dp[l], sv + l * nelt, 1., nelt);
+		}
+
+		/* Compute the norms of the orthogonal components. */
+		parnorms (nrm, wp, nelt, nrhs);
+
+		/* Determine which systems need reorthogonalization. */
+		for (l = 0, k = 0; l < nrhs; ++l) {
+			reo[l] = act[l] && (crit[l] / nrm[l] > IMGS_L);
+			k += reo[l];
+		}
+
+		if (k > 0) {
+			for (k = 0; k <= i; ++k) {
+				pardots (dp, v + k * lblk, wp, nelt, nrhs);
+
+				for (l = 0; l < nrhs; ++l) {
+					if (!reo[l]) dp[l] = 0;
+					else h[l * ldh * mit + i * ldh + k] += dp[l];
+				}
+
+				sv = v + k * lblk;
+				for (l = 0; l < nrhs; ++l)
+					if (dp[l] != 0) vaxpby (wp + l * nelt, -dp[l], sv + l * nelt, 1., nelt);
+			}
+
+			parnorms (nrm, wp, nelt, nrhs);
+		}
+
+		for (l = 0, emax = 0; l < nrhs; ++l) {
+			if (!act[l]) {
+				emax = MAX(emax, err[l]);
+				continue;
+			}
+
+			hp = h + l * ldh * mit + i * ldh;
+			bp = beta + l * ldh;
+			sp = s + l * mit;
+			cp = c + l * mit;
+
+			/* Record the norm of the next basis vector. */
+			hp[i + 1] = nrm[l];
+
+			/* Normalize the next basis vector, if it doesn't vanish. */
+			if (nrm[l] >= REAL_EPSILON) {
+				sv = wp + l * nelt;
+#pragma omp parallel for default(shared) private(j)
+				for (j = 0; j < nelt; ++j) sv[j] /= nrm[l];
+			}
+
+			/* Apply previous Givens rotations to the Hessenberg column. */
+			for (k = 0; k < i; ++k)
+				ROT (&one, hp + k, &one, hp + k + 1, &one, cp + k, sp + k);
+
+			/* Compute and apply the Givens rotation for this iteration. */
+			LARTG (hp + i, hp + i + 1, cp + i, sp + i, &cr);
+			hp[i] = cr;
+			hp[i + 1] = 0;
+			ROT (&one, bp + i, &one, bp + i + 1, &one, cp + i, sp + i);
+
+			/* Estimate the RRE for this system. */
+			err[l] = cabs(bp[i + 1]) / rhn[l];
+			nit[l] = i + 1;
+
+			/* Stop the system on convergence or breakdown. */
+			if (err[l] <= tol || nrm[l] < REAL_EPSILON) {
+				act[l] = 0;
+				--nact;
+			}
+
+			emax = MAX(emax, err[l]);
+		}
+
+		if (!rank && !quiet) printf ("Block GMRES(%d): %g\n", i, emax);
+
+		/* Flush the output buffers. */
+		fflush (stdout);
+		fflush (stderr);
+	}
+
+	for (l = 0; l < nrhs; ++l) {
+		rit = MAX(rit, nit[l]);
+		if (nit[l] < 1) continue;
+
+		/* Compute the minimizer of the least-squares problem. */
+		TRSV (CblasColMajor, CblasUpper, CblasNoTrans, CblasNonUnit,
+				nit[l], h + l * ldh * mit, ldh, beta + l * ldh, 1);
+
+		/* Compute the solution update in place. The leading dimension
+		 * skips over the other systems in each block of the basis. */
+		GEMV (CblasColMajor, CblasNoTrans, nelt, nit[l], &cone,
+				v + l * nelt, lblk, beta + l * ldh, 1,
+				&cone, sol + l * nelt, 1);
+	}
+
+	free (v);
+	free (h);
+	free (c);
+	free (nit);
+
+	return rit;
+}
+
+/* Solve the systems for the fmaconf.nrhs right-hand sides stored consecutively
+ * in rhs with lock-stepped BiCG-STAB, sharing each block matrix-vector product
+ * and combining the reductions for all systems. Returns the number of
+ * iterations used by the slowest system. */
+int bbicgstab (cplx *rhs, cplx *sol,
+		int guess, int mit, real tol, int quiet) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol, lblk;
+	int i, l, rank, nrhs = fmaconf.nrhs, nact, *act;
+	cplx *r, *rhat, *v, *p, *mvp, *t, *rho, *alpha, *omega, *beta, *dp, *tt;
+	real *err, *rhn, emax;
+
+	MPI_Comm_rank (fmaconf.comm, &rank);
+
+	lblk = nelt * (long)nrhs;
+
+	/* Allocate and zero the work arrays. */
+	r = calloc (7L * lblk, sizeof(cplx));
+	rhat = r + lblk;
+	v = rhat + lblk;
+	p = v + lblk;
+	t = p + lblk;
+	mvp = t + lblk;
+
+	/* Per-system scalars. */
+	rho = malloc (6 * nrhs * sizeof(cplx));
+	alpha = rho + nrhs;
+	omega = alpha + nrhs;
+	beta = omega + nrhs;
+	dp = beta + nrhs;
+	tt = dp + nrhs;
+
+	err = malloc (2 * nrhs * sizeof(real));
+	rhn = err + nrhs;
+
+	act = malloc (nrhs * sizeof(int));
+
+	for (l = 0; l < nrhs; ++l) rho[l] = alpha[l] = omega[l] = 1.;
+
+	/* Compute the norms of the right-hand sides for residual scaling. */
+	parnorms (rhn, rhs, nelt, nrhs);
+
+	/* Compute the inital matrix-vector product for the input guess. */
+	if (guess) bmatvec (r, sol, mvp, 1);
+
+	/* Subtract from the RHS to form the residual. */
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < lblk; ++j) r[j] = rhs[j] - r[j];
+
+	if (!guess) memset (sol, 0, lblk * sizeof(cplx));
+
+	/* Copy the initial residual as the test vector. */
+	memcpy (rhat, r, lblk * sizeof(cplx));
+
+	/* Find the norms of the initial residuals. */
+	parnorms (err, r, nelt, nrhs);
+	for (l = 0, nact = 0, emax = 0; l < nrhs; ++l) {
+		err[l] = (rhn[l] > 0) ? (err[l] / rhn[l]) : 0;
+		act[l] = (err[l] > tol);
+		nact += act[l];
+		emax = MAX(emax, err[l]);
+	}
+	if (!rank && !quiet) printf ("True residual: %g\n", emax);
+
+	/* Run iterations until convergence or the maximum is reached. */
+	for (i = 0; i < mit && nact > 0; ++i) {
+		pardots (dp, rhat, r, nelt, nrhs);
+
+		for (l = 0; l < nrhs; ++l) {
+			/* Converged systems are excluded from further updates. */
+			if (!act[l]) {
+				beta[l] = omega[l] = 0;
+				continue;
+			}
+
+			/* Compute beta and rho for this iteration. */
+			beta[l] = dp[l] * alpha[l] / (rho[l] * omega[l]);
+			rho[l] = dp[l];
+		}
+
+		/* Update the search vectors; converged systems are zeroed. */
+		for (l = 0; l < nrhs; ++l) {
+			cplx *pl = p + l * nelt, *rl = r + l * nelt, *vl = v + l * nelt;
+
+			if (!act[l]) {
+				memset (pl, 0, nelt * sizeof(cplx));
+				continue;
+			}
+
+#pragma omp parallel for default(shared) private(j)
+			for (j = 0; j < nelt; ++j)
+				pl[j] = rl[j] + beta[l] * (pl[j] - omega[l] * vl[j]);
+		}
+
+		/* Compute the first search steps, v = A * p. */
+		bmatvec (v, p, mvp, 1);
+
+		/* Compute the next alpha. */
+		pardots (dp, rhat, v, nelt, nrhs);
+		for (l = 0; l < nrhs; ++l)
+			alpha[l] = act[l] ? (rho[l] / dp[l]) : 0;
+
+		/* Update the solution and residual vectors. */
+		for (l = 0; l < nrhs; ++l) {
+			if (alpha[l] == 0) continue;
+			vaxpby (sol + l * nelt, alpha[l], p + l * nelt, 1., nelt);
+			vaxpby (r + l * nelt, -alpha[l], v + l * nelt, 1., nelt);
+		}
+
+		/* Compute the scaled residual norms and stop systems for
+		 * which convergence has been achieved. */
+		parnorms (err, r, nelt, nrhs);
+		for (l = 0, emax = 0; l < nrhs; ++l) {
+			err[l] = (rhn[l] > 0) ? (err[l] / rhn[l]) : 0;
+			if (act[l] && err[l] < tol) {
+				act[l] = 0;
+				--nact;
+			}
+			emax = MAX(emax, err[l]);
+		}
+
+		if (!rank && !quiet) printf ("Block BiCG-STAB(%0.1f): %g\n", 0.5 + i, emax);
+
+		/* Flush the output buffers. */
+		fflush (stdout);
+		fflush (stderr);
+
+		if (nact < 1) break;
+
+		/* Compute the next search steps, t = A * r. */
+		bmatvec (t, r, mvp, 1);
+
+		/* Compute the update directions. */
+		pardots (dp, t, r, nelt, nrhs);
+		pardots (tt, t, t, nelt, nrhs);
+		for (l = 0; l < nrhs; ++l)
+			omega[l] = act[l] ? (dp[l] / tt[l]) : 0;
+
+		/* Update both the residuals and the solution guesses. */
+		for (l = 0; l < nrhs; ++l) {
+			if (omega[l] == 0) continue;
+			vaxpby (sol + l * nelt, omega[l], r + l * nelt, 1., nelt);
+			vaxpby (r + l * nelt, -omega[l], t + l * nelt, 1., nelt);
+		}
+
+		/* Compute the scaled residual norms. */
+		parnorms (err, r, nelt, nrhs);
+		for (l = 0, emax = 0; l < nrhs; ++l) {
+			err[l] = (rhn[l] > 0) ? (err[l] / rhn[l]) : 0;
+			if (act[l] && err[l] < tol) {
+				act[l] = 0;
+				--nact;
+			}
+			emax = MAX(emax, err[l]);
+		}
+
+		if (!rank && !quiet) printf ("Block BiCG-STAB(%d): %g\n", i + 1, emax);
+
+		fflush (stdout);
+		fflush (stderr);
+	}
+
 	free (r);
+	free (rho);
+	free (err);
+	free (act);
+
 	return i;
 }
@@ -2,19 +2,66 @@
 #define __ITSOLVER_H_
 
 #include "precision.h"
+#include "compress.h"
 
 typedef struct {
-  int restart, maxit;
-  real epscg;
-} solveparm;
-
-typedef struct {
-	cplx *z, *az;
+	cvec *z, *az;
 	int nmax, ntot, start;
 } augspace;
 
+/* A recycled subspace U with C = A U orthonormal, carried between solves. */
+typedef struct {
+	cplx *u, *c;
+	int kmax, k, m;
+} recspace;
+
+/* Orthonormal vectors w and vectors x with A x = w, formed from the right-hand
+ * sides and solutions of previous solves, that span initial guesses. */
+typedef struct {
+	cplx *x, *w;
+	int nmax, ntot;
+} guesspace;
+
+/* A cheaper configuration of the operator used by inner solves. The far-field
+ * rank is assigned to fmaconf.acatrunc, and lowprec to fmaconf.lowprec, for
+ * the duration of each inner solve; the outer flexible solver restarts every
+ * restart iterations. */
+typedef struct {
+	int maxit, rank, restart, lowprec;
+	real epscg;
+} innerparm;
+
+typedef struct {
+  int restart, maxit, idrdim;
+  real epscg;
+  recspace *rcy;
+  innerparm *inner;
+  guesspace *gsp;
+} solveparm;
+
 int matvec (cplx *, cplx *, cplx *, int);
 int gmres (cplx *, cplx *, int, int, real, int, augspace *);
+void setcompress (int);
+void setrelax (int);
+void augfree (augspace *);
 int bicgstab (cplx *, cplx *, int, int, real, int);
+int idrs (cplx *, cplx *, int, int, real, int, int);
+int fgmres (cplx *, cplx *, int, int, real, int, innerparm *);
+int gcrodr (cplx *, cplx *, int, int, real, int, recspace *);
+int recupdate (recspace *);
+
+int projguess (cplx *, cplx *, guesspace *);
+int addguess (cplx *, cplx *, guesspace *);
+
+long gmresmem (int, int);
+long fgmresmem (int, innerparm *);
+long gcrodrmem (int, int);
+
+int itsolve (cplx *, cplx *, int, solveparm *, int);
+
+/* Solvers for several right-hand sides packed in one operator application. */
+int bmatvec (cplx *, cplx *, cplx *, int);
+int bgmres (cplx *, cplx *, int, int, real, int);
+int bbicgstab (cplx *, cplx *, int, int, real, int);
 
 #endif /* __ITSOLVER_H_ */
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "lbfgs.h"
+#include "util.h"
+
+/* The complex unknowns are treated as pairs of real unknowns, so the inner
+ * product of the method is the real part of the complex inner product. */
+static real qndot (cplx *x, cplx *y, long n) {
+	return creal(pardot (x, y, n));
+}
+
+/* Allocate storage for m pairs of distributed vectors of length n. */
+int qninit (qnspace *qn, int m, long n) {
+	qn->s = malloc (2L * m * n * sizeof(cplx));
+	qn->y = qn->s + m * n;
+	qn->rho = malloc (m * sizeof(real));
+	qn->n = n;
+	qn->m = m;
+	qn->k = qn->next = 0;
+
+	return m;
+}
+
+/* Discard the stored pairs. */
+void qnreset (qnspace *qn) {
+	qn->k = qn->next = 0;
+}
+
+void qnfree (qnspace *qn) {
+	if (qn->s) free (qn->s);
+	if (qn->rho) free (qn->rho);
+	qn->s = qn->y = NULL;
+	qn->rho = NULL;
+	qn->m = qn->k = qn->next = 0;
+}
+
+/* Store the step s and the gradient change y, replacing the oldest pair if
+ * the storage is full. Pairs without positive curvature are rejected, which
+ * keeps the inverse Hessian approximation positive definite. Returns 1 if the
+ * pair was stored, 0 otherwise. */
+int qnpush (qnspace *qn, cplx *s, cplx *y) {
+	real sy;
+	long off;
+
+	sy = qndot (s, y, qn->n);
+	if (sy <= REAL_EPSILON * sqrt(qndot (s, s, qn->n) * qndot (y, y, qn->n)))
+		return 0;
+
+	off = qn->next * qn->n;
+	memcpy (qn->s + off, s, qn->n * sizeof(cplx));
+	memcpy (qn->y + off, y, qn->n * sizeof(cplx));
+	qn->rho[qn->next] = 1. / sy;
+
+	qn->next = (qn->next + 1) % qn->m;
+	qn->k = MIN(qn->k + 1, qn->m);
+
+	return 1;
+}
+
+/* Compute the search direction p = -H g with the two-loop recursion. The
+ * initial inverse Hessian is the scaled identity given by the newest pair,
+ * or h0 when no pairs are stored. Returns the directional derivative of the
+ * objective along p. */
+real qndir (cplx *p, cplx *g, qnspace *qn, real h0) {
+	long n = qn->n, off;
+	int i, j;
+	real *alpha, beta;
+
+	alpha = malloc (MAX(qn->k, 1) * sizeof(real));
+
+	memcpy (p, g, n * sizeof(cplx));
+
+	/* Run from the newest pair to the oldest. */
+	for (i = 0; i < qn->k; ++i) {
+		j = (qn->next - 1 - i + qn->m) % qn->m;
+		off = j * n;
+		alpha[i] = qn->rho[j] * qndot (qn->s + off, p, n);
+		vaxpby (p, -alpha[i], qn->y + off, 1., n);
+	}
+
+	/* Scale by the initial inverse Hessian. */
+	if (qn->k > 0) {
+		j = (qn->next - 1 + qn->m) % qn->m;
+		off = j * n;
+		h0 = 1. / (qn->rho[j] * qndot (qn->y + off, qn->y + off, n));
+	}
+	vaxpby (p, h0, p, 0., n);
+
+	/* Run from the oldest pair to the newest. */
+	for (i = qn->k - 1; i >= 0; --i) {
+		j = (qn->next - 1 - i + qn->m) % qn->m;
+		off = j * n;
+		beta = qn->rho[j] * qndot (qn->y + off, p, n);
+		vaxpby (p, alpha[i] - beta, qn->s + off, 1., n);
+	}
+
+	free (alpha);
+
+	/* The search direction descends. */
+	vaxpby (p, -1., p, 0., n);
+
+	return qndot (g, p, n);
+}
@@ -0,0 +1,21 @@
+#ifndef __LBFGS_H_
+#define __LBFGS_H_
+
+#include "precision.h"
+
+/* The most recent steps s and gradient changes y of a limited-memory BFGS
+ * method, stored cyclically with the reciprocal curvatures rho. */
+typedef struct {
+	cplx *s, *y;
+	real *rho;
+	long n;
+	int m, k, next;
+} qnspace;
+
+int qninit (qnspace *, int, long);
+void qnreset (qnspace *);
+void qnfree (qnspace *);
+int qnpush (qnspace *, cplx *, cplx *);
+real qndir (cplx *, cplx *, qnspace *, real);
+
+#endif /* __LBFGS_H_ */
@@ -17,6 +17,9 @@ int omp_get_max_threads () { return 1; }
 #include "itsolver.h"
 #include "measure.h"
 #include "direct.h"
+#include "precond.h"
+#include "memplan.h"
+#include "groups.h"
 #include "config.h"
 #include "mlfma.h"
 #include "util.h"
@@ -25,14 +28,31 @@ int omp_get_max_threads () { return 1; }
 void usage (char *);
 
 void usage (char *name) {
-	fprintf (stderr, "Usage: %s [-d] [-l #] [-a #] [-n #] [-b] [-f x,y,z,a]\n"
+	fprintf (stderr, "Usage: %s [-d] [-z] [-R] [-l #] [-k #] [-I #] [-g #] [-F #[,t]] [-L] [-a #] [-n #] [-b] [-p] [-c] [-m #] [-M #] [-S t[,l]] [-G #] [-f x,y,z,a]\n"
 			 "       [-o <prefix>] -s <src> -r <obs> -i <prefix>\n", name);
 	fprintf (stderr, "  -i: Specify input file prefix\n");
 	fprintf (stderr, "  -o: Specify output file prefix (defaults to input prefix)\n");
 	fprintf (stderr, "  -d: Debug mode (prints induced field); specify twice to write after every restart\n");
 	fprintf (stderr, "  -b: Use BiCG-STAB instead of GMRES\n");
+	fprintf (stderr, "  -p: Use a block-Jacobi preconditioner built from the self-group interactions\n");
+	fprintf (stderr, "  -c: Add a coarse-grid correction to the preconditioner (implies -p)\n");
 	fprintf (stderr, "  -a: Use ACA far-field transformations, or SVD when tolerance is negative\n");
+	fprintf (stderr, "  -z: Store the GMRES Krylov basis and augmented vectors in compressed form\n");
+	fprintf (stderr, "  -R: Relax the far-field accuracy as the residual decreases (requires -a)\n");
 	fprintf (stderr, "  -l: Use loose GMRES with the specified number of augmented vectors\n");
+	fprintf (stderr, "  -k: Use GCRO-DR, recycling the specified number of vectors between solves\n");
+	fprintf (stderr, "  -I: Use IDR(s) with the specified shadow-space dimension s\n");
+	fprintf (stderr, "  -g: Project initial guesses from the specified number of previous solutions\n");
+	fprintf (stderr, "  -F: Use FGMRES with the specified number of inner iterations, which use\n"
+			 "      far-field ranks truncated at relative tolerance t (default: 1e-2)\n");
+	fprintf (stderr, "  -L: Use single-precision operators for FGMRES inner solves (mixed-precision builds)\n");
+	fprintf (stderr, "  -M: Size the GMRES restart to the specified memory per process in MiB,\n"
+			 "      or to the share of node memory when 0\n");
+	fprintf (stderr, "  -m: Solve the specified number of transmitters together in block mode\n");
+	fprintf (stderr, "  -S: Solve only for principal sources whose singular values exceed t relative\n"
+			 "      to the largest, sketched with l random source combinations (default: all)\n");
+	fprintf (stderr, "  -G: Split the processes into the specified number of groups, each of which\n"
+			 "      solves for its own transmitters\n");
 	fprintf (stderr, "  -n: Specify number of points for near-field integration\n");
 	fprintf (stderr, "  -s: Specify the source location or range\n");
 	fprintf (stderr, "  -r: Specify the observation range\n");
@@ -42,17 +62,21 @@ void usage (char *name) {
 int main (int argc, char **argv) {
 	char ch, *inproj = NULL, *outproj = NULL, **arglist, fname[1024],
 	     fldfmt[1024], guessfmt[1024], *srcspec = NULL, *obspec = NULL;
-	int mpirank, mpisize, i, j, k, nit, gsize[3];
-	int debug = 0, maxobs, useaca = 0, usebicg = 0, useloose = 0, usedir = 0;
-	int numsrcpts = 5;
-	cplx *rhs, *sol, *inc, *field;
+	int mpirank, mpisize, grank, ngroups = 1, i, j, k, l, nb, nit, gsize[3];
+	int debug = 0, maxobs, useaca = 0, usebicg = 0, useloose = 0, usedir = 0, userec = 0, usepc = 0;
+	int useinner = 0, useguess = 0, usecomp = 0, useidr = 0, userelax = 0, uselow = 0;
+	int numsrcpts = 5, blksize = 1, bldinc, nsketch = 0;
+	cplx *rhs, *sol, *inc, *field, *blkbuf = NULL, *pfld = NULL;
 	double cputime, wtime;
-	long nelt;
-	real acatol = -1;
+	long nelt, lblk, memused;
+	real acatol = -1, trunctol = 1e-2, memmib = -1, prtol = -1;
 	real dir[4];
 	augspace aug;
+	recspace rcy;
+	innerparm inner;
+	guesspace gsp;
 
-	measdesc obsmeas, srcmeas;
+	measdesc obsmeas, srcmeas, psrc, *tsrc = &srcmeas;
 	solveparm solver;
 
 	MPI_Init (&argc, &argv);
@@ -66,7 +90,7 @@ int main (int argc, char **argv) {
 
 	arglist = argv;
 
-	while ((ch = getopt (argc, argv, "i:o:dba:hl:n:s:r:f:")) != -1) {
+	while ((ch = getopt (argc, argv, "i:o:dbpczRLa:hl:k:I:g:F:m:M:S:G:n:s:r:f:")) != -1) {
 		switch (ch) {
 		case 'i':
 			inproj = optarg;
@@ -80,6 +104,21 @@ int main (int argc, char **argv) {
 		case 'b':
 			usebicg = 1;
 			break;
+		case 'p':
+			usepc = MAX(usepc, 1);
+			break;
+		case 'c':
+			usepc = 2;
+			break;
+		case 'z':
+			usecomp = 1;
+			break;
+		case 'R':
+			userelax = 1;
+			break;
+		case 'L':
+			uselow = 1;
+			break;
 		case 'a':
 			acatol = strtod(optarg, NULL);
 			useaca = 1;
@@ -87,6 +126,32 @@ int main (int argc, char **argv) {
 		case 'l':
 			useloose = strtol(optarg, NULL, 0);
 			break;
+		case 'k':
+			userec = strtol(optarg, NULL, 0);
+			break;
+		case 'I':
+			useidr = strtol(optarg, NULL, 0);
+			break;
+		case 'g':
+			useguess = strtol(optarg, NULL, 0);
+			break;
+		case 'F':
+			useinner = strtol(strtok(optarg, ","), NULL, 0);
+			if ((optarg = strtok(NULL, ","))) trunctol = strtod(optarg, NULL);
+			break;
+		case 'm':
+			blksize = strtol(optarg, NULL, 0);
+			break;
+		case 'M':
+			memmib = strtod(optarg, NULL);
+			break;
+		case 'G':
+			ngroups = strtol(optarg, NULL, 0);
+			break;
+		case 'S':
+			prtol = strtod(strtok(optarg, ","), NULL);
+			if ((optarg = strtok(NULL, ","))) nsketch = strtol(optarg, NULL, 0);
+			break;
 		case 'n':
 			numsrcpts = strtol(optarg, NULL, 0);
 			break;
@@ -117,12 +182,72 @@ int main (int argc, char **argv) {
 
 	if (!outproj) outproj = inproj;
 
+	/* Each group of processes runs its own FMM. */
+	ngroups = grpsplit (ngroups);
+	MPI_Comm_rank (fmaconf.comm, &grank);
+	if (ngroups > 1 && !mpirank)
+		fprintf (stderr, "Using %d groups of %d processes.\n", ngroups, mpisize / ngroups);
+
 	if (!mpirank) fprintf (stderr, "Reading configuration file.\n");
 
 	/* Read the basic configuration. */
 	sprintf (fname, "%s.input", inproj);
 	getconfig (fname, &solver, NULL);
 
+	/* Pack multiple transmitters into each basis in block mode. */
+	fmaconf.nrhs = MAX(1, blksize);
+	if (fmaconf.nrhs > 1 && useloose > 0) {
+		if (!mpirank) fprintf (stderr, "WARNING: Loose GMRES is not available in block mode.\n");
+		useloose = 0;
+	}
+	if (fmaconf.nrhs > 1 && usecomp) {
+		if (!mpirank) fprintf (stderr, "WARNING: Compressed bases are not available in block mode.\n");
+		usecomp = 0;
+	}
+	if (fmaconf.nrhs > 1 && userelax) {
+		if (!mpirank) fprintf (stderr, "WARNING: Relaxed products are not available in block mode.\n");
+		userelax = 0;
+	}
+	if (!useaca && userelax) {
+		if (!mpirank) fprintf (stderr, "WARNING: Relaxed products require ACA far-field transformations.\n");
+		userelax = 0;
+	}
+	if (fmaconf.nrhs > 1 && userec > 0) {
+		if (!mpirank) fprintf (stderr, "WARNING: Subspace recycling is not available in block mode.\n");
+		userec = 0;
+	}
+	if (fmaconf.nrhs > 1 && useidr > 0) {
+		if (!mpirank) fprintf (stderr, "WARNING: IDR(s) is not available in block mode.\n");
+		useidr = 0;
+	}
+	if (fmaconf.nrhs > 1 && useguess > 0) {
+		if (!mpirank) fprintf (stderr, "WARNING: Projected guesses are not available in block mode.\n");
+		useguess = 0;
+	}
+	if (fmaconf.nrhs > 1 && useinner > 0) {
+		if (!mpirank) fprintf (stderr, "WARNING: FGMRES is not available in block mode.\n");
+		useinner = 0;
+	}
+	if (fmaconf.nrhs > 1 && usepc) {
+		if (!mpirank) fprintf (stderr, "WARNING: Preconditioning is not available in block mode.\n");
+		usepc = 0;
+	}
+#ifndef MIXEDPREC
+	if (uselow) {
+		if (!mpirank) fprintf (stderr, "WARNING: Single-precision operators require a mixed-precision build.\n");
+		uselow = 0;
+	}
+#endif /* MIXEDPREC */
+	if (uselow && useinner < 1) {
+		if (!mpirank) fprintf (stderr, "WARNING: Single-precision operators are only used for inner solves.\n");
+		uselow = 0;
+	}
+
+	/* Select the storage of the GMRES Krylov basis. */
+	setcompress (usecomp);
+	/* Select whether the operator accuracy is relaxed. */
+	setrelax (userelax);
+
 	/* Build the source and observer location specifiers. */
 	buildsrc (&srcmeas, srcspec);
 	buildobs (&obsmeas, obspec);
@@ -132,14 +257,18 @@ int main (int argc, char **argv) {
 	ScaleME_getListOfLocalBasis (&(fmaconf.numbases), &(fmaconf.bslist));
 
 	nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	/* The size of a block of vectors, one for each packed transmitter. */
+	lblk = nelt * (long)fmaconf.nrhs;
 	/* Allocate the RHS vector, solution and incident field. */
-	rhs = malloc (3 * nelt * sizeof(cplx));
-	sol = rhs + nelt;
-	inc = sol + nelt;
+	rhs = malloc (3 * lblk * sizeof(cplx));
+	sol = rhs + lblk;
+	inc = sol + lblk;
 	/* Allocate the local portion of the contrast storage. */
 	fmaconf.contrast = malloc (nelt * sizeof(cplx));
 	/* Allocate the observation array. */
-	field = malloc (obsmeas.count * sizeof(cplx));
+	field = malloc (obsmeas.count * fmaconf.nrhs * sizeof(cplx));
+	/* Block mode needs a workspace for the packed ScaleME layout. */
+	if (fmaconf.nrhs > 1) blkbuf = malloc (2 * lblk * sizeof(cplx));
 
 	/* Store the grid size for printing of field values. */
 	gsize[0] = fmaconf.nx; gsize[1] = fmaconf.ny; gsize[2] = fmaconf.nz;
@@ -158,6 +287,31 @@ int main (int argc, char **argv) {
 	i = dirprecalc (numsrcpts);
 	if (!mpirank) fprintf (stderr, "Finished precomputing %d near interactions.\n", i);
 
+	/* Configure the cheap inner operator for FGMRES. Only the low-rank
+	 * far-field factors can be truncated. */
+	if (useinner > 0) {
+		inner.maxit = useinner;
+		inner.restart = solver.maxit;
+		inner.epscg = MAX(trunctol, solver.epscg);
+		inner.rank = farrank (trunctol);
+		inner.lowprec = uselow;
+		if (uselow && !mpirank)
+			fprintf (stderr, "Inner solves use single-precision operators.\n");
+		if (useaca && !mpirank) fprintf (stderr, "Inner far-field rank: %d of %d\n",
+				inner.rank, fmaconf.acarank);
+		else if (!uselow && !mpirank)
+			fprintf (stderr, "WARNING: Inner solves use the full operator without ACA.\n");
+	}
+
+	/* Factor the diagonal blocks for the preconditioner. */
+	if (usepc) {
+		/* The coarse grid has one cell for each finest-level group. */
+		if (usepc > 1 && !pccoarse() && !mpirank)
+			fprintf (stderr, "WARNING: Coarse grid is too large, skipping correction.\n");
+		pcbuild ();
+		if (!mpirank) fprintf (stderr, "Built block-Jacobi preconditioner.\n");
+	}
+
 	/* Finish the ScaleME initialization. */
 	ScaleME_postconf ();
 
@@ -165,11 +319,67 @@ int main (int argc, char **argv) {
 	ScaleME_buildRootInterpMat (obsmeas.imat, fmaconf.interpord,
 			obsmeas.ntheta, obsmeas.nphi, obsmeas.trange, obsmeas.prange);
 
+	/* Replace the transmitters with principal sources, if desired. Fields
+	 * in the volume are not reconstructed for individual transmitters. */
+	if (prtol > 0 && usedir) {
+		if (!mpirank) fprintf (stderr, "WARNING: Principal sources do not support a focal axis.\n");
+	} else if (prtol > 0) {
+		i = prinsrc (&psrc, &srcmeas, prtol, nsketch);
+		if (!mpirank) fprintf (stderr, "Reduced %d sources to %d principal sources.\n",
+				srcmeas.count, i);
+		if (debug && !mpirank) fprintf (stderr, "WARNING: Volume fields are not written for principal sources.\n");
+		debug = 0;
+		pfld = calloc (MAX(i, 1) * obsmeas.count, sizeof(cplx));
+		tsrc = &psrc;
+	}
+
 	/* Find the width of the integer label in the field name. */
 	i = (int)ceil(log10(srcmeas.count));
 	sprintf (fldfmt, "%%s.tx%%0%dd.farfld", i);
 	sprintf (guessfmt, "%%s.tx%%0%dd.%%s", i);
 
+	/* Account for the memory in use, including the guess space. */
+	memused = memreport ((5 * lblk + nelt + obsmeas.count * fmaconf.nrhs) * sizeof(cplx));
+	memused += 2L * MAX(useguess, 0) * nelt * sizeof(cplx);
+
+	/* Size the restart length and auxiliary spaces to the memory budget.
+	 * The total number of iterations is preserved. */
+	if (memmib >= 0) {
+		int kind = -1, aux = 0, mit = solver.maxit;
+		long budget = memmib > 0 ? (long)(memmib * 1024 * 1024) : memnode ();
+
+		if (fmaconf.nrhs < 2) {
+			if (useinner > 0) {
+				kind = PLAN_FGMRES;
+				aux = inner.maxit;
+			} else if (userec > 0) {
+				kind = PLAN_GCRODR;
+				aux = userec;
+			} else if (!useidr && !usebicg) {
+				kind = PLAN_GMRES;
+				aux = MAX(useloose, 0);
+			}
+		}
+
+		if (kind < 0) {
+			if (!mpirank) fprintf (stderr, "WARNING: The selected solver has no restart to plan.\n");
+		} else if (!memplan (kind, budget, memused, &mit, &aux)) {
+			if (!mpirank) fprintf (stderr, "WARNING: Memory budget is too small, keeping restart %d.\n", solver.maxit);
+		} else {
+			solver.restart = GEDIV(solver.maxit * solver.restart, mit);
+			solver.maxit = inner.restart = mit;
+			if (kind == PLAN_GMRES && useloose > 0) useloose = aux;
+
+			if (!mpirank) {
+				fprintf (stderr, "Memory plan for %0.1f MiB: restart %d, up to %d restarts",
+						budget / (1024. * 1024.), solver.maxit, solver.restart);
+				if (kind == PLAN_GMRES && useloose > 0)
+					fprintf (stderr, ", %d augmented vectors", useloose);
+				fprintf (stderr, "\n");
+			}
+		}
+	}
+
 	if (!mpirank) fprintf (stderr, "Initialization complete.\n");
 
 	/* Ensure each process is waiting at the start of the loop. */
@@ -180,39 +390,89 @@ int main (int argc, char **argv) {
 		aug.start = -1;
 		aug.nmax = useloose;
 		aug.ntot = 0;
-		aug.z = malloc(2 * aug.nmax * nelt * sizeof(cplx));
-		aug.az = aug.z + aug.nmax * nelt;
+		aug.z = calloc(2 * aug.nmax, sizeof(cvec));
+		aug.az = aug.z + aug.nmax;
 	}
 
-	for (i = 0; i < srcmeas.count; ++i) {
+	/* Initialize the recycled subspace, which persists across sources.
+	 * Each GCRO-DR cycle spans the restart length of GMRES. */
+	if (userec > 0) {
+		rcy.kmax = userec;
+		rcy.k = 0;
+		rcy.m = solver.maxit;
+		rcy.u = malloc(2 * rcy.kmax * nelt * sizeof(cplx));
+		rcy.c = rcy.u + rcy.kmax * nelt;
+	}
 
-		if (!mpirank)
-			fprintf (stderr, "Running simulation for source %d.\n", i + 1);
+	/* Initialize the span of previous solutions for initial guesses. */
+	if (useguess > 0) {
+		gsp.nmax = useguess;
+		gsp.ntot = 0;
+		gsp.x = malloc(2 * gsp.nmax * nelt * sizeof(cplx));
+		gsp.w = gsp.x + gsp.nmax * nelt;
+	}
+
+	/* Groups claim blocks of transmitters from the shared queue. */
+	for (i = grpnext (fmaconf.nrhs); i < tsrc->count; i = grpnext (fmaconf.nrhs)) {
+		/* The number of transmitters solved together in this block. */
+		nb = MIN(fmaconf.nrhs, tsrc->count - i);
+
+		if (!grank) {
+			if (fmaconf.nrhs > 1)
+				fprintf (stderr, "Running simulation for %ssources %d-%d.\n",
+						pfld ? "principal " : "", i + 1, i + nb);
+			else fprintf (stderr, "Running simulation for %ssource %d.\n",
+					pfld ? "principal " : "", i + 1);
+		}
 
-		/* Attempt to read the pre-computed RHS from a file.
-		 * If this fails, build the RHS directly. */
-		sprintf (fname, guessfmt, inproj, i, "rhs");
-		if (!getctgrp (rhs, fname, gsize, fmaconf.bslist,
-					fmaconf.numbases, fmaconf.bspbox)) {
-			if (!mpirank) fprintf (stderr, "Building RHS.\n");
-			/* Integrate the incident field over each cell. */
-			buildrhs (inc, srcmeas.locations + 3 * i, srcmeas.plane, usedir ? dir : NULL);
-			/* Convert the integrated field to the average. */
+		/* Unused columns of a partial block must remain zero. */
+		if (nb < fmaconf.nrhs) memset (rhs, 0, 3 * lblk * sizeof(cplx));
+
+		for (l = 0, bldinc = 0; l < nb; ++l) {
+			/* Attempt to read the pre-computed RHS from a file.
+			 * If this fails, build the RHS directly. */
+			sprintf (fname, guessfmt, inproj, i + l, "rhs");
+			if (pfld || !getctgrp (rhs + l * nelt, fname, gsize, fmaconf.bslist,
+						fmaconf.numbases, fmaconf.bspbox)) {
+				if (!grank) fprintf (stderr, "Building RHS.\n");
+				/* Integrate the incident field over each cell. */
+				if (pfld) srcrhs (inc + l * nelt, tsrc, i + l);
+				else buildrhs (inc + l * nelt, srcmeas.locations + 3 * (i + l),
+						srcmeas.plane, usedir ? dir : NULL);
+				/* Convert the integrated field to the average. */
 #pragma omp parallel for default(shared) private(j)
-			for (j = 0; j < nelt; ++j) inc[j] /= fmaconf.cellvol;
-			/* Apply the scattering integral to the incident field. */
-			matvec(rhs, inc, sol, 0);
-		} else {
-			/* If the RHS was read, it is the incident field.
-			 * Set the incident field in inc to zero. */
+				for (j = 0; j < nelt; ++j) inc[l * nelt + j] /= fmaconf.cellvol;
+				/* Apply the scattering integral to the incident field.
+				 * In block mode, all columns are handled at once. */
+				if (fmaconf.nrhs < 2) matvec(rhs, inc, sol, 0);
+				else bldinc = 1;
+			} else {
+				/* If the RHS was read, it is the incident field.
+				 * Set the incident field in inc to zero. */
+#pragma omp parallel for default(shared) private(j)
+				for (j = 0; j < nelt; ++j) inc[l * nelt + j] = 0.0;
+			}
+		}
+
+		/* Apply the scattering integral to every incident field in the
+		 * block. Columns read from files have no incident field, and
+		 * getctgrp zeroes the columns it fails to read. */
+		if (bldinc) {
+			bmatvec (sol, inc, blkbuf, 0);
 #pragma omp parallel for default(shared) private(j)
-			for (j = 0; j < nelt; ++j) inc[j] = 0.0;
+			for (j = 0; j < lblk; ++j) rhs[j] += sol[j];
 		}
 
-		/* Attempt to read an initial first guess from a file. */
-		sprintf (fname, guessfmt, inproj, i, "guess");
-		k = getctgrp (sol, fname, gsize, fmaconf.bslist,
-				fmaconf.numbases, fmaconf.bspbox);
+		/* Attempt to read initial first guesses from files. */
+		for (l = 0, k = 0; l < nb && !pfld; ++l) {
+			sprintf (fname, guessfmt, inproj, i + l, "guess");
+			if (getctgrp (sol + l * nelt, fname, gsize, fmaconf.bslist,
+					fmaconf.numbases, fmaconf.bspbox)) k = 1;
+		}
+
+		/* Otherwise, project a guess from previous solutions. */
+		if (!k && useguess > 0 && (k = projguess (rhs, sol, &gsp)) && !grank)
+			fprintf (stderr, "Projected initial guess from %d solutions.\n", k);
 
 		/* Restart if the true residual is not sufficiently low. */
 		for (j = 0, nit = 1; j < solver.restart && nit > 0; ++j) {
@@ -223,7 +483,18 @@ int main (int argc, char **argv) {
 			cputime = (double)clock() / CLOCKS_PER_SEC;
 			wtime = MPI_Wtime();
 
-			if (usebicg) nit = bicgstab (rhs, sol, k || j,
+			if (fmaconf.nrhs > 1) {
+				if (usebicg) nit = bbicgstab (rhs, sol, k || j,
+						solver.maxit, solver.epscg, 0);
+				else nit = bgmres (rhs, sol, k || j,
+						solver.maxit, solver.epscg, 0);
+			} else if (useinner > 0) nit = fgmres (rhs, sol, k || j,
+					solver.maxit, solver.epscg, 0, &inner);
+			else if (userec > 0) nit = gcrodr (rhs, sol, k || j,
+					solver.maxit, solver.epscg, 0, &rcy);
+			else if (useidr > 0) nit = idrs (rhs, sol, k || j,
+					solver.maxit, solver.epscg, 0, useidr);
+			else if (usebicg) nit = bicgstab (rhs, sol, k || j,
 					solver.maxit, solver.epscg, 0);
 			else nit = gmres (rhs, sol, k || j, solver.maxit,
 					solver.epscg, 0, useloose > 0 ? &aug : NULL);
@@ -231,20 +502,21 @@ int main (int argc, char **argv) {
 			cputime = (double)clock() / CLOCKS_PER_SEC - cputime;
 			wtime = MPI_Wtime() - wtime;
 
-			if (!mpirank) {
+			if (!grank) {
 				fprintf (stderr, "CPU time for solution: %0.6g\n", cputime);
 				fprintf (stderr, "Wall time for solution: %0.6g\n", wtime);
 			}
 
 			/* Update the total field before every restart, but
 			 * only if the tripwire file exists. */
-			sprintf (fname, guessfmt, inproj, i, "volwrite");
-			if (!access (fname, F_OK)) {
+			for (l = 0; l < nb && !pfld; ++l) {
+				sprintf (fname, guessfmt, inproj, i + l, "volwrite");
+				if (access (fname, F_OK)) continue;
 				/* The master process should unlink the tripwire. */
-				MPI_Barrier (MPI_COMM_WORLD);
-				if (!mpirank) unlink (fname);
-				sprintf (fname, guessfmt, outproj, i, "scatfld");
-				prtctgrp (fname, sol, gsize, fmaconf.bslist,
+				MPI_Barrier (fmaconf.comm);
+				if (!grank) unlink (fname);
+				sprintf (fname, guessfmt, outproj, i + l, "scatfld");
+				prtctgrp (fname, sol + l * nelt, gsize, fmaconf.bslist,
 						fmaconf.numbases, fmaconf.bspbox);
 				/* If restarts have finished, avoid an
 				 * immediate rewrite of this field. */
@@ -252,46 +524,91 @@ int main (int argc, char **argv) {
 			}
 		}
 
-		/* Write the scattered field if desired and not just written. */
-		if (debug == 1) {
-			sprintf (fname, guessfmt, outproj, i, "scatfld");
-			prtctgrp (fname, sol, gsize, fmaconf.bslist,
-					fmaconf.numbases, fmaconf.bspbox);
+		/* Record this solution for future guesses. */
+		if (useguess > 0) addguess (rhs, sol, &gsp);
+
+		/* Write the scattered field if desired and not just written.
+		 * Tripwires are per transmitter, so blocks always write. */
+		if (debug == 1 || (debug && fmaconf.nrhs > 1)) {
+			for (l = 0; l < nb; ++l) {
+				sprintf (fname, guessfmt, outproj, i + l, "scatfld");
+				prtctgrp (fname, sol + l * nelt, gsize, fmaconf.bslist,
+						fmaconf.numbases, fmaconf.bspbox);
+			}
 		}
 
 		/* Convert the scattered field to the total field. */
 #pragma omp parallel for default(shared) private(j)
-		for (j = 0; j < nelt; ++j) sol[j] += inc[j];
+		for (j = 0; j < lblk; ++j) sol[j] += inc[j];
 
 		/* Write the total field if desired and not just written. */
 		if (debug > 0) {
-			sprintf (fname, guessfmt, outproj, i, "totfld");
-			prtctgrp (fname, sol, gsize, fmaconf.bslist,
-					fmaconf.numbases, fmaconf.bspbox);
+			for (l = 0; l < nb; ++l) {
+				sprintf (fname, guessfmt, outproj, i + l, "totfld");
+				prtctgrp (fname, sol + l * nelt, gsize, fmaconf.bslist,
+						fmaconf.numbases, fmaconf.bspbox);
+			}
 		}
 
-		/* Convert total field into contrast current. */
+		if (fmaconf.nrhs > 1) {
+			/* Pack the contrast currents for all transmitters. */
+			blkpack (blkbuf, sol, fmaconf.contrast);
+			/* Compute all observation fields at once. */
+			farfield (blkbuf, &obsmeas, field);
+		} else {
+			/* Convert total field into contrast current. */
 #pragma omp parallel for default(shared) private(j)
-		for (j = 0; j < nelt; ++j) sol[j] *= fmaconf.contrast[j];
+			for (j = 0; j < nelt; ++j) sol[j] *= fmaconf.contrast[j];
 
-		/* Compute and write out all observation fields. */
-		farfield (sol, &obsmeas, field);
+			/* Compute and write out all observation fields. */
+			farfield (sol, &obsmeas, field);
+		}
+
+		/* Keep the fields of principal sources for reconstruction, or
+		 * write the field for each transmitter in the block. */
+		if (pfld) memcpy (pfld + i * obsmeas.count, field,
+				nb * obsmeas.count * sizeof(cplx));
+		else if (!grank) {
+			for (l = 0; l < nb; ++l) {
+				sprintf (fname, fldfmt,  outproj, i + l);
+				writefld (fname, obsmeas.nphi, obsmeas.ntheta,
+						field + l * obsmeas.count);
+			}
+		}
+	}
+
+	/* Reconstruct and write the field for every transmitter. */
+	if (pfld) {
+		/* Each group holds the fields of its own principal sources. */
+		grpsum (pfld, 2 * psrc.count * obsmeas.count, MPIREAL);
 
-		/* Append the field for the current transmitter. */
 		if (!mpirank) {
-			sprintf (fname, fldfmt,  outproj, i);
-			writefld (fname, obsmeas.nphi, obsmeas.ntheta, field);
+			field = realloc (field, srcmeas.count * obsmeas.count * sizeof(cplx));
+			decfield (field, pfld, &psrc, obsmeas.count);
+			for (i = 0; i < srcmeas.count; ++i) {
+				sprintf (fname, fldfmt, outproj, i);
+				writefld (fname, obsmeas.nphi, obsmeas.ntheta,
+						field + i * obsmeas.count);
+			}
 		}
+
+		free (pfld);
+		delmeas (&psrc);
 	}
 
 	ScaleME_finalizeParHostFMA ();
+	grpfree ();
 
 	freedircache ();
+	pcfree ();
 	delmeas (&srcmeas);
 	delmeas (&obsmeas);
 	delintrules ();
 
-	if (useloose > 0) free (aug.z);
+	if (useloose > 0) augfree (&aug);
+	if (userec > 0) free (rcy.u);
+	if (useguess > 0) free (gsp.x);
+	if (blkbuf) free (blkbuf);
 
 	free (rhs);
 	free (field);
@@ -1,7 +1,19 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include <mpi.h>
 
+/* Pull in the CBLAS header. */
+#ifdef _MACOSX
+#include <Accelerate/Accelerate.h>
+#else
+#ifdef _ATLAS
+#include <cblas.h>
+#else
+#include <gsl_cblas.h>
+#endif /* _ATLAS */
+#endif /* _MACOSX */
+
 #include "ScaleME.h"
 
 #include "precision.h"
@@ -84,9 +96,224 @@ int buildrhs (cplx *rhs, real *srcloc, int plane, real *dir) {
 	return 0;
 }
 
-/* Fast FMM computation of the far-field pattern using interpolation. */
+/* Build the incident field for source i of src, which may be encoded. */
+int srcrhs (cplx *rhs, measdesc *src, int i) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	cplx *wt, *tmp;
+	int t;
+
+	if (!src->code)
+		return buildrhs (rhs, src->locations + 3 * i, src->plane, NULL);
+
+	wt = src->code + (long)i * src->ncode;
+	tmp = malloc (nelt * sizeof(cplx));
+	memset (rhs, 0, nelt * sizeof(cplx));
+
+	/* Superimpose the weighted fields of the individual sources. */
+	for (t = 0; t < src->ncode; ++t) {
+		if (wt[t] == 0) continue;
+		buildrhs (tmp, src->srcloc + 3 * t, src->plane, NULL);
+#pragma omp parallel for default(shared) private(j)
+		for (j = 0; j < nelt; ++j) rhs[j] += wt[t] * tmp[j];
+	}
+
+	free (tmp);
+	return 0;
+}
+
+/* Draw q encoded sources that each superimpose all sources in src, with
+ * random signs or phases of the specified type. Every draw has unique keys
+ * in the location array, so cached fields are never confused with those of
+ * other draws or of individual sources. The encoding must be freed with
+ * delmeas, but the source locations are shared with src. */
+int encsrc (measdesc *enc, measdesc *src, int q, int type) {
+	static int ndraw = 0;
+	int rank, k;
+	long t, n = (long)q * src->count;
+	real th;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+	enc->count = q;
+	enc->plane = src->plane;
+	enc->ncode = src->count;
+	enc->srcloc = src->locations;
+	enc->ntheta = enc->nphi = 0;
+	enc->imat[0] = enc->imat[1] = NULL;
+
+	enc->locations = realloc (enc->locations, 3 * q * sizeof(real));
+	enc->code = realloc (enc->code, n * sizeof(cplx));
+
+	/* The keys are not positions: the last coordinate is infinite. */
+	for (k = 0; k < q; ++k) {
+		enc->locations[3 * k] = ndraw;
+		enc->locations[3 * k + 1] = k;
+		enc->locations[3 * k + 2] = INFINITY;
+	}
+	++ndraw;
+
+	/* Draw the weights on the root so all processes agree. */
+	if (!rank) {
+		for (t = 0; t < n; ++t) {
+			if (type == ENC_PHASE) {
+				th = 2 * M_PI * (real)random() / (real)RAND_MAX;
+				enc->code[t] = cexp (I * th);
+			} else enc->code[t] = (random() & 1) ? 1. : -1.;
+		}
+	}
+
+	MPI_Bcast (enc->code, 2 * n, MPIREAL, 0, MPI_COMM_WORLD);
+
+	return q;
+}
+
+/* Combine the measured fields, stored consecutively for each source of the
+ * encoding, into the fields for the encoded sources. */
+int encfield (cplx *efld, cplx *field, measdesc *enc, int nobs) {
+	cplx *wt;
+	int k, t, j;
+
+	for (k = 0; k < enc->count; ++k) {
+		wt = enc->code + (long)k * enc->ncode;
+		memset (efld + (long)k * nobs, 0, nobs * sizeof(cplx));
+		for (t = 0; t < enc->ncode; ++t)
+			for (j = 0; j < nobs; ++j)
+				efld[(long)k * nobs + j] += wt[t] * field[(long)t * nobs + j];
+	}
+
+	return enc->count * nobs;
+}
+
+/* Reconstruct the fields for each source of the encoding from the fields of
+ * the encoded sources. This inverts encfield when the weights of the encoded
+ * sources are orthonormal, as they are for principal sources. */
+int decfield (cplx *field, cplx *efld, measdesc *enc, int nobs) {
+	cplx wt;
+	int k, t, j;
+
+	for (t = 0; t < enc->ncode; ++t) {
+		memset (field + (long)t * nobs, 0, nobs * sizeof(cplx));
+		for (k = 0; k < enc->count; ++k) {
+			wt = conj(enc->code[(long)k * enc->ncode + t]);
+			for (j = 0; j < nobs; ++j)
+				field[(long)t * nobs + j] += wt * efld[(long)k * nobs + j];
+		}
+	}
+
+	return enc->ncode * nobs;
+}
+
+/* Build principal sources for src. These are the dominant left singular
+ * vectors of the matrix of incident fields, scaled by the singular values
+ * and expressed as encoded sources with orthonormal weights. The range of
+ * the fields is sketched with nsk random combinations of the sources, or
+ * with the sources themselves if nsk is not positive. Singular values below
+ * tol relative to the largest are discarded. Returns the number of sources. */
+int prinsrc (measdesc *psrc, measdesc *src, real tol, int nsk) {
+	long j, nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int rank, ns = src->count, t, k, m, lwork, info, one = 1;
+	cplx *y, *b, *om, *c, *vt, *work, wt, cone = 1., czero = 0.;
+	real *s, *rwork, onrm;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+	if (nsk <= 0 || nsk > ns) nsk = ns;
+
+	y = malloc ((nsk + 1L) * nelt * sizeof(cplx));
+	b = y + nsk * nelt;
+
+	/* The sketch is the identity or random signs, drawn on the root. */
+	om = calloc ((long)ns * nsk, sizeof(cplx));
+	if (nsk == ns) for (t = 0; t < ns; ++t) om[t * nsk + t] = 1.;
+	else if (!rank) for (j = 0; j < (long)ns * nsk; ++j)
+		om[j] = (random() & 1) ? 1. : -1.;
+	MPI_Bcast (om, 2 * ns * nsk, MPIREAL, 0, MPI_COMM_WORLD);
+
+	/* Accumulate the sketch one source at a time. */
+	memset (y, 0, nsk * nelt * sizeof(cplx));
+	for (t = 0; t < ns; ++t) {
+		buildrhs (b, src->locations + 3 * t, src->plane, NULL);
+		for (k = 0; k < nsk; ++k) {
+			if ((wt = om[t * nsk + k]) == 0) continue;
+#pragma omp parallel for default(shared) private(j)
+			for (j = 0; j < nelt; ++j) y[k * nelt + j] += wt * b[j];
+		}
+	}
+
+	free (om);
+
+	/* Orthonormalize the sketch, dropping columns that are dependent to
+	 * well below the truncation tolerance. */
+	c = malloc ((nsk + 1L) * sizeof(cplx));
+	for (k = 0, m = 0; k < nsk; ++k) {
+		if (m != k) memcpy (y + m * nelt, y + k * nelt, nelt * sizeof(cplx));
+		cmgs (y + m * nelt, c, y, nelt, m);
+
+		for (t = 0, onrm = 0; t <= m; ++t) onrm += creal(c[t] * conj(c[t]));
+		if (creal(c[m]) > 0.1 * tol * sqrt(onrm)) ++m;
+	}
+
+	free (c);
+
+	/* Project every source onto the basis. */
+	c = malloc ((long)m * ns * sizeof(cplx));
+	for (t = 0; t < ns; ++t) {
+		buildrhs (b, src->locations + 3 * t, src->plane, NULL);
+		GEMV (CblasColMajor, CblasConjTrans, nelt, m, &cone,
+				y, nelt, b, 1, &czero, c + (long)t * m, 1);
+	}
+	MPI_Allreduce (MPI_IN_PLACE, c, 2 * m * ns, MPIREAL, MPI_SUM, fmaconf.comm);
+
+	free (y);
+
+	/* Every process computes the same SVD of the projected sources. */
+	s = malloc (6L * m * sizeof(real));
+	rwork = s + m;
+	vt = malloc ((long)m * ns * sizeof(cplx));
+
+	lwork = -1;
+	GESVD ("N", "S", &m, &ns, c, &m, s, &wt, &one, vt, &m, &wt, &lwork, rwork, &info);
+	lwork = (int)creal(wt);
+	work = malloc (lwork * sizeof(cplx));
+	GESVD ("N", "S", &m, &ns, c, &m, s, &wt, &one, vt, &m, work, &lwork, rwork, &info);
+	free (work);
+	free (c);
+
+	/* Find the truncated rank. */
+	for (k = 0; k < m; ++k) if (s[k] < tol * s[0]) break;
+
+	psrc->count = k;
+	psrc->plane = src->plane;
+	psrc->ncode = ns;
+	psrc->srcloc = src->locations;
+	psrc->ntheta = psrc->nphi = 0;
+	psrc->imat[0] = psrc->imat[1] = NULL;
+
+	/* The keys are not positions, and differ from those of random draws. */
+	psrc->locations = malloc (3 * MAX(k, 1) * sizeof(real));
+	for (t = 0; t < k; ++t) {
+		psrc->locations[3 * t] = -1;
+		psrc->locations[3 * t + 1] = t;
+		psrc->locations[3 * t + 2] = INFINITY;
+	}
+
+	/* The weights are the right singular vectors. */
+	psrc->code = malloc ((long)MAX(k, 1) * ns * sizeof(cplx));
+	for (t = 0; t < k; ++t)
+		for (j = 0; j < ns; ++j)
+			psrc->code[t * ns + j] = conj(vt[t + j * m]);
+
+	free (vt);
+	free (s);
+
+	return k;
+}
+
+/* Fast FMM computation of the far-field pattern using interpolation. When
+ * multiple right-hand sides are packed into each basis, the currents must be
+ * in the packed layout and the result holds obs->count samples for each. */
 int farfield (cplx *currents, measdesc *obs, cplx *result) {
-	int i;
+	int i, nres = obs->count * fmaconf.nrhs;
 	cplx fact;
 
 	/* The result must be a pointer to the pointer. */
@@ -96,7 +323,7 @@ int farfield (cplx *currents, measdesc *obs, cplx *result) {
 	 * However, the actual integral needs (k^2 / 4 pi), so we need the
 	 * extra factors in the field. */
 	fact = fmaconf.k0 / (4 * M_PI);
-	for (i = 0; i < obs->count; ++i) result[i] *= fact;
+	for (i = 0; i < nres; ++i) result[i] *= fact;
 
 	return 0;
 }
@@ -144,6 +371,11 @@ static int buildlocs (measdesc *desc, int plane, int ntheta,
 	/* Clear the interpolation matrix pointer. */
 	desc->imat[0] = desc->imat[1] = NULL;
 
+	/* These are not encoded sources. */
+	desc->ncode = 0;
+	desc->srcloc = NULL;
+	desc->code = NULL;
+
 	/* Configure the locations to be plane-wave directions or point sources. */
 	desc->plane = plane;
 
@@ -235,6 +467,7 @@ int buildobs (measdesc *desc, char *spec) {
 
 void delmeas (measdesc *desc) {
 	free (desc->locations);
+	if (desc->code) free (desc->code);
 
 	/* Clear the root interpolation matrix, if applicable. */
 	if (desc->imat[0]) ScaleME_delRootInterpMat (desc->imat);
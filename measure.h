@@ -3,13 +3,26 @@
 
 #include "precision.h"
 
+/* Encoded sources superimpose all ncode sources at srcloc, with weights in
+ * the rows of code. Their locations are unique keys rather than positions. */
 typedef struct {
-	int count, ntheta, nphi, plane;
-	real prange[2], trange[2], *locations;
+	int count, ntheta, nphi, plane, ncode;
+	real prange[2], trange[2], *locations, *srcloc;
+	cplx *code;
 	void *imat[2];
 } measdesc;
 
+/* Types of source encoding. */
+#define ENC_SIGN 0
+#define ENC_PHASE 1
+
 int buildrhs (cplx *, real *, int, real *);
+int srcrhs (cplx *, measdesc *, int);
+
+int encsrc (measdesc *, measdesc *, int, int);
+int encfield (cplx *, cplx *, measdesc *, int);
+int decfield (cplx *, cplx *, measdesc *, int);
+int prinsrc (measdesc *, measdesc *, real, int);
 
 int farfield (cplx *, measdesc *, cplx *);
 
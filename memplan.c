@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "direct.h"
+#include "precond.h"
+#include "itsolver.h"
+#include "memplan.h"
+#include "util.h"
+
+/* The fraction of the memory budget that the planner will commit. */
+#define MEMFRAC 0.9
+
+/* Bytes per mebibyte, for reporting. */
+#define MIB (1024. * 1024.)
+
+/* The budget assumed when the resident size cannot be measured. */
+#define MEMUNKNOWN (256L * 1024L * 1024L)
+
+/* Return the resident size of this process in bytes, or -1 if unavailable. */
+long memresident (void) {
+	FILE *fp;
+	long pages, res;
+
+	if (!(fp = fopen ("/proc/self/statm", "r"))) return -1;
+	if (fscanf (fp, "%ld %ld", &pages, &res) < 2) res = -1;
+	fclose (fp);
+
+	if (res < 0) return -1;
+	return res * sysconf (_SC_PAGESIZE);
+}
+
+/* Return the share of the physical memory of the local node available to
+ * this process, assuming all processes on the node share it equally. */
+long memnode (void) {
+	MPI_Comm node;
+	int nloc;
+	long total;
+
+	/* Count the processes that share this node. */
+	MPI_Comm_split_type (MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED,
+			0, MPI_INFO_NULL, &node);
+	MPI_Comm_size (node, &nloc);
+	MPI_Comm_free (&node);
+
+	total = sysconf (_SC_PHYS_PAGES) * sysconf (_SC_PAGESIZE);
+
+	return total / MAX(nloc, 1);
+}
+
+/* Return the bytes of the node share of this process that are not yet
+ * resident, which may be negative if the share is exceeded. Without a
+ * resident size, as on systems without /proc, the result is a small fixed
+ * budget rather than the whole share. */
+long memavail (void) {
+	long res, node;
+
+	node = memnode ();
+	if ((res = memresident ()) < 0) return MIN(MEMUNKNOWN, node);
+
+	return node - res;
+}
+
+/* Report the largest per-process storage of the major allocations. The
+ * caller provides the bytes in its own vectors. The remainder of the resident
+ * size is attributed to ScaleME. Returns the local bytes in use, which is the
+ * resident size if available or the sum of the known allocations otherwise. */
+long memreport (long vecs) {
+	long acct[6], gacct[6];
+	int rank, i;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+	acct[0] = dirmemory ();
+	acct[1] = farmemory ();
+	acct[2] = pcmemory ();
+	acct[3] = vecs;
+	acct[5] = memresident ();
+
+	/* Attribute unknown resident memory to ScaleME and other libraries. */
+	for (i = 0, acct[4] = acct[5]; i < 4; ++i) acct[4] -= acct[i];
+	acct[4] = MAX(acct[4], 0);
+
+	/* Fall back to the known allocations if the resident size is unknown. */
+	if (acct[5] < 0) acct[5] = acct[0] + acct[1] + acct[2] + acct[3];
+
+	MPI_Reduce (acct, gacct, 6, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+
+	if (!rank) {
+		fprintf (stderr, "Maximum memory per process (MiB):\n");
+		fprintf (stderr, "  Near-field: %0.1f\n", gacct[0] / MIB);
+		fprintf (stderr, "  Far-field: %0.1f\n", gacct[1] / MIB);
+		fprintf (stderr, "  Preconditioner: %0.1f\n", gacct[2] / MIB);
+		fprintf (stderr, "  Vectors: %0.1f\n", gacct[3] / MIB);
+		fprintf (stderr, "  ScaleME and other: %0.1f\n", gacct[4] / MIB);
+		fprintf (stderr, "  Total: %0.1f\n", gacct[5] / MIB);
+	}
+
+	return acct[5];
+}
+
+/* Return the local workspace of the solver of the given kind with restart
+ * length m. For GMRES, the number of augmented vectors grows in proportion to
+ * the restart length, with at least one and no more than m - 1. */
+static long plancost (int kind, int m, int mit, int aux, int *naux) {
+	innerparm inp;
+
+	switch (kind) {
+	case PLAN_FGMRES:
+		*naux = aux;
+		inp.maxit = aux;
+		return fgmresmem (m, &inp);
+	case PLAN_GCRODR:
+		*naux = aux;
+		return gcrodrmem (m, aux);
+	default:
+		*naux = aux > 0 ? MIN(MAX((long)aux * m / mit, 1), m - 1) : 0;
+		return gmresmem (m, *naux);
+	}
+}
+
+/* Choose the largest restart length, no larger than the number of unknowns,
+ * for which the workspace of the solver of the given kind fits within a
+ * fraction of the per-process budget beyond the bytes already used. On input,
+ * mit and aux hold the requested restart length and auxiliary dimension: the
+ * augmented vectors for GMRES, the inner iterations for FGMRES or the recycled
+ * vectors for GCRO-DR. On output, they hold the plan that fits on every
+ * process. Returns the planned restart length, or 0 if nothing fits. */
+int memplan (int kind, long budget, long used, int *mit, int *aux) {
+	long avail, mmax, lo, hi, md;
+	int naux, m;
+
+	avail = (long)(MEMFRAC * budget) - used;
+
+	/* The Krylov dimension need not exceed the number of unknowns. */
+	mmax = (long)fmaconf.gnumbases * (long)fmaconf.bspboxvol;
+	mmax = MIN(mmax, 1L << 20);
+
+	/* GCRO-DR cycles must exceed the recycled dimension; loose GMRES
+	 * needs at least one Arnoldi iteration per cycle. */
+	lo = (kind == PLAN_GCRODR) ? *aux + 1 : ((kind == PLAN_GMRES && *aux > 0) ? 2 : 1);
+
+	/* Find the largest restart length that fits with bisection. */
+	if (lo > mmax || plancost (kind, lo, *mit, *aux, &naux) > avail) m = 0;
+	else {
+		for (hi = mmax; lo < hi; ) {
+			md = (lo + hi + 1) / 2;
+			if (plancost (kind, md, *mit, *aux, &naux) <= avail) lo = md;
+			else hi = md - 1;
+		}
+		m = lo;
+	}
+
+	/* All processes must agree on the plan. */
+	MPI_Allreduce (MPI_IN_PLACE, &m, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+
+	if (m > 0) {
+		plancost (kind, m, *mit, *aux, &naux);
+		*mit = m;
+		*aux = naux;
+	}
+
+	return m;
+}
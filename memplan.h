@@ -0,0 +1,15 @@
+#ifndef __MEMPLAN_H_
+#define __MEMPLAN_H_
+
+/* Solvers with a restart length that can be sized to the memory budget. */
+#define PLAN_GMRES 0
+#define PLAN_FGMRES 1
+#define PLAN_GCRODR 2
+
+long memresident (void);
+long memnode (void);
+long memavail (void);
+long memreport (long);
+int memplan (int, long, long, int *, int *);
+
+#endif /* __MEMPLAN_H_ */
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "mgrid.h"
+#include "util.h"
+
+/* Coarse grids keep the finest-level groups of the fine grid, but fill each
+ * group with fewer, larger cells. The MLFMA tree and the distribution of
+ * groups are therefore unchanged, and restriction is local to each group.
+ * These are the fine cell parameters read from the configuration. */
+static int mgbpb = 0;
+static real mgcell = 0;
+
+/* Record the fine grid described by fmaconf. Returns the number of coarse
+ * levels, up to nlev, that evenly divide the fine groups. */
+int mginit (int nlev) {
+	int l;
+
+	mgbpb = fmaconf.bspbox;
+	mgcell = fmaconf.cell;
+
+	for (l = 0; l < nlev && !(mgbpb % (2 << l)); ++l);
+
+	return l;
+}
+
+/* Configure fmaconf for the grid coarsened by 2^lev in each dimension.
+ * Returns the number of cells per group dimension. */
+int mgsetlev (int lev) {
+	fmaconf.bspbox = mgbpb >> lev;
+	fmaconf.bspboxvol = fmaconf.bspbox * fmaconf.bspbox * fmaconf.bspbox;
+	fmaconf.cell = mgcell * (1 << lev);
+	fmaconf.cellvol = fmaconf.cell * fmaconf.cell * fmaconf.cell;
+
+	return fmaconf.bspbox;
+}
+
+/* Average the local values fct, with fbpb cells per group dimension, onto
+ * the cells of the current grid in crt. */
+void mgrestrict (cplx *crt, cplx *fct, int fbpb) {
+	int cbpb = fmaconf.bspbox, r = fbpb / cbpb;
+	long cvol = fmaconf.bspboxvol, fvol = (long)fbpb * fbpb * fbpb;
+	long j, nelt = (long)fmaconf.numbases * cvol;
+	real scale = 1. / (real)(r * r * r);
+
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < nelt; ++j) {
+		int c[3], a, b, d;
+		long g = j / cvol;
+		cplx *fp, sum = 0;
+
+		GRID(c, j % cvol, cbpb, cbpb);
+		fp = fct + g * fvol;
+
+		for (d = 0; d < r; ++d)
+			for (b = 0; b < r; ++b)
+				for (a = 0; a < r; ++a)
+					sum += fp[IDX(fbpb, r * c[0] + a,
+							r * c[1] + b, r * c[2] + d)];
+
+		crt[j] = scale * sum;
+	}
+}
+
+/* Collect the local values crt of the current grid into a group-ordered
+ * copy of the whole grid on every process. The caller frees the copy. */
+cplx *mggather (cplx *crt) {
+	long i, bvol = fmaconf.bspboxvol;
+	cplx *gct;
+
+	gct = calloc ((long)fmaconf.gnumbases * bvol, sizeof(cplx));
+
+	for (i = 0; i < fmaconf.numbases; ++i)
+		memcpy (gct + fmaconf.bslist[i] * bvol, crt + i * bvol, bvol * sizeof(cplx));
+
+	MPI_Allreduce (MPI_IN_PLACE, gct, 2 * fmaconf.gnumbases * bvol,
+			MPIREAL, MPI_SUM, fmaconf.comm);
+
+	return gct;
+}
+
+/* Look up the value of a coarse cell, by global cell index, in the
+ * group-ordered grid gct with cbpb cells per group dimension. */
+static cplx mgvalue (cplx *gct, int cbpb, int *x) {
+	long g, l;
+
+	g = x[0] / cbpb + fmaconf.nx * (x[1] / cbpb + fmaconf.ny * (x[2] / cbpb));
+	l = IDX(cbpb, x[0] % cbpb, x[1] % cbpb, x[2] % cbpb);
+
+	return gct[g * cbpb * cbpb * cbpb + l];
+}
+
+/* Trilinearly interpolate the group-ordered grid gct, with cbpb cells per
+ * group dimension, onto the local cells of the current grid in crt. Values
+ * beyond the outermost coarse cell centers are held constant. */
+void mgprolong (cplx *crt, cplx *gct, int cbpb) {
+	int fbpb = fmaconf.bspbox, n[3];
+	long j, bvol = fmaconf.bspboxvol, nelt = (long)fmaconf.numbases * bvol;
+	real r = (real)fbpb / (real)cbpb;
+
+	n[0] = fmaconf.nx * cbpb;
+	n[1] = fmaconf.ny * cbpb;
+	n[2] = fmaconf.nz * cbpb;
+
+#pragma omp parallel for default(shared) private(j)
+	for (j = 0; j < nelt; ++j) {
+		int gi[3], c[3], lo[3], hi[3], x[3], k;
+		real t[3], p, w;
+		cplx sum = 0;
+
+		GRID(gi, fmaconf.bslist[j / bvol], fmaconf.nx, fmaconf.ny);
+		GRID(c, j % bvol, fbpb, fbpb);
+
+		/* Find the bracketing coarse cells and the weights. */
+		for (k = 0; k < 3; ++k) {
+			p = ((real)(gi[k] * fbpb + c[k]) + 0.5) / r - 0.5;
+			p = MIN(MAX(p, 0.), (real)(n[k] - 1));
+			lo[k] = (int)floor(p);
+			hi[k] = MIN(lo[k] + 1, n[k] - 1);
+			t[k] = p - (real)lo[k];
+		}
+
+		/* Accumulate the eight corner contributions. */
+		for (k = 0; k < 8; ++k) {
+			x[0] = (k & 1) ? hi[0] : lo[0];
+			x[1] = (k & 2) ? hi[1] : lo[1];
+			x[2] = (k & 4) ? hi[2] : lo[2];
+
+			w = ((k & 1) ? t[0] : 1. - t[0]) *
+				((k & 2) ? t[1] : 1. - t[1]) *
+				((k & 4) ? t[2] : 1. - t[2]);
+
+			if (w != 0) sum += w * mgvalue (gct, cbpb, x);
+		}
+
+		crt[j] = sum;
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef __MGRID_H_
+#define __MGRID_H_
+
+#include "precision.h"
+
+int mginit (int);
+int mgsetlev (int);
+void mgrestrict (cplx *, cplx *, int);
+cplx *mggather (cplx *);
+void mgprolong (cplx *, cplx *, int);
+
+#endif /* __MGRID_H_ */
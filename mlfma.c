@@ -28,6 +28,16 @@
 
 fmadesc fmaconf;
 
+/* The singular values of the low-rank far-field factors, largest first. */
+static real *farsv = NULL;
+
+#ifdef MIXEDPREC
+/* Single-precision copies of the far-field matrices. */
+static lcplx *lradpats = NULL;
+
+static void lowpattern (cplx *, cplx *, int);
+#endif /* MIXEDPREC */
+
 static int farmatrow (cplx *, real, real *, real, int);
 static int farmatcol (cplx *, real, real *, int, int);
 static int acabuild (cplx **, real, real, int, int, real, int);
@@ -40,11 +50,20 @@ static int recaca (cplx *, cplx *, int, int, int, real);
  * functions" and center are ignored, since the calling program ensures each
  * FMM basis function is actually a single group of gridded elements with the
  * same affine grid. The center of the finest-level FMM group coincides with
- * the single FMM basis function contained therein. */
+ * the single FMM basis function contained therein. When multiple right-hand
+ * sides are packed into each basis, the currents form a bspboxvol-by-nrhs
+ * matrix and the patterns form an nsamp-by-nrhs matrix. */
 void farpattern (int nbs, int *bsl, void *vcrt, void *vpat, real *cen, int sgn) {
 	cplx fact, beta = 1.0, *crt = (cplx *)vcrt,
 		*pat = *((cplx **)vpat);
 
+#ifdef MIXEDPREC
+	if (fmaconf.lowprec) {
+		lowpattern (crt, pat, sgn);
+		return;
+	}
+#endif /* MIXEDPREC */
+
 	if (sgn >= 0) {
 		/* Scalar factors for the matrix multiplication. */
 		fact = fmaconf.k0;
@@ -53,19 +72,21 @@ void farpattern (int nbs, int *bsl, void *vcrt, void *vpat, real *cen, int sgn)
 		 * have been zeroed anyway. */
 		beta = 0.0;
 
-		/* Perform the matrix-vector product. */
-		GEMV (CblasColMajor, CblasNoTrans, fmaconf.nsamp,
-				fmaconf.bspboxvol, &fact, fmaconf.radpats,
-				fmaconf.nsamp, crt, 1, &beta, pat, 1);
+		/* Perform the matrix-matrix product. */
+		GEMM (CblasColMajor, CblasNoTrans, CblasNoTrans,
+				fmaconf.nsamp, fmaconf.nrhs, fmaconf.bspboxvol,
+				&fact, fmaconf.radpats, fmaconf.nsamp, crt,
+				fmaconf.bspboxvol, &beta, pat, fmaconf.nsamp);
 	} else {
 		/* Distribute the far-field patterns to the basis functions. */
 		/* Scalar factors for the matrix multiplication. */
 		fact = I * fmaconf.k0 * fmaconf.k0 / (4 * M_PI);
 
-		/* Perform the matrix-vector product. */
-		GEMV (CblasColMajor, CblasConjTrans, fmaconf.nsamp,
-				fmaconf.bspboxvol, &fact, fmaconf.radpats,
-				fmaconf.nsamp, pat, 1, &beta, crt, 1);
+		/* Perform the matrix-matrix product. */
+		GEMM (CblasColMajor, CblasConjTrans, CblasNoTrans,
+				fmaconf.bspboxvol, fmaconf.nrhs, fmaconf.nsamp,
+				&fact, fmaconf.radpats, fmaconf.nsamp, pat,
+				fmaconf.nsamp, &beta, crt, fmaconf.bspboxvol);
 	}
 }
 
@@ -81,48 +102,166 @@ void acafarpattern (int nbs, int *bsl, void *vcrt, void *vpat, real *cen, int sg
 	cplx fact, beta = 1.0, *crt = (cplx *)vcrt,
 		*pat = *((cplx **)vpat), *work, *u, *v;
 
+#ifdef MIXEDPREC
+	if (fmaconf.lowprec) {
+		lowpattern (crt, pat, sgn);
+		return;
+	}
+#endif /* MIXEDPREC */
+
 	u = fmaconf.radpats;
 	v = fmaconf.radpats + fmaconf.acarank * fmaconf.nsamp;
 
-	work = malloc (fmaconf.acarank * sizeof(cplx));
+	work = malloc (fmaconf.acatrunc * fmaconf.nrhs * sizeof(cplx));
 
 	if (sgn >= 0) {
 		beta = 0.0;
 		fact = 1.0;
 
-		GEMV (CblasColMajor, CblasConjTrans, fmaconf.bspboxvol,
-				fmaconf.acarank, &fact, v, fmaconf.bspboxvol,
-				crt, 1, &beta, work, 1);
+		GEMM (CblasColMajor, CblasConjTrans, CblasNoTrans,
+				fmaconf.acatrunc, fmaconf.nrhs, fmaconf.bspboxvol,
+				&fact, v, fmaconf.bspboxvol, crt, fmaconf.bspboxvol,
+				&beta, work, fmaconf.acatrunc);
 
 		/* Scalar factors for the matrix multiplication. */
 		fact = fmaconf.k0;
 
-		/* Perform the matrix-vector product. */
-		GEMV (CblasColMajor, CblasNoTrans, fmaconf.nsamp,
-				fmaconf.acarank, &fact, u, fmaconf.nsamp,
-				work, 1, &beta, pat, 1);
+		/* Perform the matrix-matrix product. */
+		GEMM (CblasColMajor, CblasNoTrans, CblasNoTrans,
+				fmaconf.nsamp, fmaconf.nrhs, fmaconf.acatrunc,
+				&fact, u, fmaconf.nsamp, work, fmaconf.acatrunc,
+				&beta, pat, fmaconf.nsamp);
 	} else {
 		beta = 0.0;
 		fact = 1.0;
 
-		GEMV (CblasColMajor, CblasConjTrans, fmaconf.nsamp,
-				fmaconf.acarank, &fact, u, fmaconf.nsamp,
-				pat, 1, &beta, work, 1);
+		GEMM (CblasColMajor, CblasConjTrans, CblasNoTrans,
+				fmaconf.acatrunc, fmaconf.nrhs, fmaconf.nsamp,
+				&fact, u, fmaconf.nsamp, pat, fmaconf.nsamp,
+				&beta, work, fmaconf.acatrunc);
 
 		/* Distribute the far-field patterns to the basis functions. */
 		/* Scalar factors for the matrix multiplication. */
 		fact = I * fmaconf.k0 * fmaconf.k0 / (4 * M_PI);
 		beta = 1.0;
 
-		/* Perform the matrix-vector product. */
-		GEMV (CblasColMajor, CblasNoTrans, fmaconf.bspboxvol,
-				fmaconf.acarank, &fact, v, fmaconf.bspboxvol,
-				work, 1, &beta, crt, 1);
+		/* Perform the matrix-matrix product. */
+		GEMM (CblasColMajor, CblasNoTrans, CblasNoTrans,
+				fmaconf.bspboxvol, fmaconf.nrhs, fmaconf.acatrunc,
+				&fact, v, fmaconf.bspboxvol, work, fmaconf.acatrunc,
+				&beta, crt, fmaconf.bspboxvol);
 	}
 
 	free (work);
 }
 
+#ifdef MIXEDPREC
+/* Compute the far-field patterns, or distribute them to the basis functions,
+ * with the single-precision copies of the full or low-rank far-field matrices.
+ * The arguments are converted at entry and the results at exit. */
+static void lowpattern (cplx *crt, cplx *pat, int sgn) {
+	long i, nc = (long)fmaconf.bspboxvol * (long)fmaconf.nrhs,
+	     np = (long)fmaconf.nsamp * (long)fmaconf.nrhs;
+	int r = fmaconf.acatrunc;
+	lcplx *lcrt, *lpat, *work, *u, *v, fact, one = 1.0, zero = 0.0;
+
+	lcrt = malloc ((nc + np + (long)r * fmaconf.nrhs) * sizeof(lcplx));
+	lpat = lcrt + nc;
+	work = lpat + np;
+
+	u = lradpats;
+	v = lradpats + fmaconf.acarank * fmaconf.nsamp;
+
+	if (sgn >= 0) {
+		for (i = 0; i < nc; ++i) lcrt[i] = (lcplx)crt[i];
+
+		fact = fmaconf.k0;
+
+		if (fmaconf.acarank < 1)
+			LGEMM (CblasColMajor, CblasNoTrans, CblasNoTrans,
+					fmaconf.nsamp, fmaconf.nrhs, fmaconf.bspboxvol,
+					&fact, u, fmaconf.nsamp, lcrt,
+					fmaconf.bspboxvol, &zero, lpat, fmaconf.nsamp);
+		else {
+			LGEMM (CblasColMajor, CblasConjTrans, CblasNoTrans,
+					r, fmaconf.nrhs, fmaconf.bspboxvol,
+					&one, v, fmaconf.bspboxvol, lcrt,
+					fmaconf.bspboxvol, &zero, work, r);
+			LGEMM (CblasColMajor, CblasNoTrans, CblasNoTrans,
+					fmaconf.nsamp, fmaconf.nrhs, r, &fact, u,
+					fmaconf.nsamp, work, r, &zero, lpat, fmaconf.nsamp);
+		}
+
+		for (i = 0; i < np; ++i) pat[i] = (cplx)lpat[i];
+	} else {
+		for (i = 0; i < np; ++i) lpat[i] = (lcplx)pat[i];
+
+		fact = I * fmaconf.k0 * fmaconf.k0 / (4 * M_PI);
+
+		if (fmaconf.acarank < 1)
+			LGEMM (CblasColMajor, CblasConjTrans, CblasNoTrans,
+					fmaconf.bspboxvol, fmaconf.nrhs, fmaconf.nsamp,
+					&fact, u, fmaconf.nsamp, lpat,
+					fmaconf.nsamp, &zero, lcrt, fmaconf.bspboxvol);
+		else {
+			LGEMM (CblasColMajor, CblasConjTrans, CblasNoTrans,
+					r, fmaconf.nrhs, fmaconf.nsamp, &one, u,
+					fmaconf.nsamp, lpat, fmaconf.nsamp, &zero, work, r);
+			LGEMM (CblasColMajor, CblasNoTrans, CblasNoTrans,
+					fmaconf.bspboxvol, fmaconf.nrhs, r, &fact, v,
+					fmaconf.bspboxvol, work, r, &zero, lcrt,
+					fmaconf.bspboxvol);
+		}
+
+		/* The distributed patterns augment the existing currents. */
+		for (i = 0; i < nc; ++i) crt[i] += (cplx)lcrt[i];
+	}
+
+	free (lcrt);
+}
+#endif /* MIXEDPREC */
+
+/* Interleave the fmaconf.nrhs consecutive local vectors in col into blk,
+ * which stores all right-hand sides for each basis contiguously, as ScaleME
+ * expects. If scale is not NULL, each local vector is scaled elementwise. */
+void blkpack (cplx *blk, cplx *col, cplx *scale) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i;
+
+#pragma omp parallel for default(shared) private(i)
+	for (i = 0; i < fmaconf.numbases; ++i) {
+		long off = (long)i * (long)fmaconf.bspboxvol;
+		cplx *bp = blk + off * fmaconf.nrhs, *cp;
+		int j, l;
+
+		for (l = 0; l < fmaconf.nrhs; ++l) {
+			cp = col + l * nelt + off;
+			if (scale) for (j = 0; j < fmaconf.bspboxvol; ++j)
+				*(bp++) = cp[j] * scale[off + j];
+			else for (j = 0; j < fmaconf.bspboxvol; ++j)
+				*(bp++) = cp[j];
+		}
+	}
+}
+
+/* Reverse the interleaving performed by blkpack. */
+void blkunpack (cplx *col, cplx *blk) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	int i;
+
+#pragma omp parallel for default(shared) private(i)
+	for (i = 0; i < fmaconf.numbases; ++i) {
+		long off = (long)i * (long)fmaconf.bspboxvol;
+		cplx *bp = blk + off * fmaconf.nrhs, *cp;
+		int j, l;
+
+		for (l = 0; l < fmaconf.nrhs; ++l) {
+			cp = col + l * nelt + off;
+			for (j = 0; j < fmaconf.bspboxvol; ++j) cp[j] = *(bp++);
+		}
+	}
+}
+
 /* Build a column of the far-field signature for a point a distance rmc
  * from the center of the parent box. */
 static int farmatcol (cplx *col, real k, real *rmc, int ntheta, int nphi) {
@@ -448,9 +587,11 @@ static int fullbuild (cplx **mats, real k0, int ntheta, int nphi, real dx, int b
 /* Precomputes the near interactions for redundant calculations and sets up
  * the wave vector directions to be used for fast calculation of far-field patterns. */
 int fmmprecalc (real acatol, int useaca) {
-	int ntheta, nphi, rank, i;
+	int ntheta, nphi, rank, i, l;
+	real nu, nv;
+	cplx *u, *v;
 
-	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_rank (fmaconf.comm, &rank);
 
 	/* Get the finest level parameters. */
 	ScaleME_getFinestLevelParams (&(fmaconf.nsamp), &ntheta, &nphi, NULL);
@@ -473,11 +614,78 @@ int fmmprecalc (real acatol, int useaca) {
 					nphi, fmaconf.cell, fmaconf.bspbox);
 
 		fprintf (stderr, "Rank %d: Far-field matrix rank: %d\n", rank, fmaconf.acarank);
+
+		/* Record the singular values of the factored matrix. Either
+		 * factor may carry the scaling, so use the norm product. */
+		farsv = malloc (fmaconf.acarank * sizeof(real));
+		for (i = 0; i < fmaconf.acarank; ++i) {
+			nu = nv = 0;
+			u = fmaconf.radpats + i * fmaconf.nsamp;
+			v = fmaconf.radpats + fmaconf.acarank * fmaconf.nsamp + i * fmaconf.bspboxvol;
+			for (l = 0; l < fmaconf.nsamp; ++l) nu += creal(u[l] * conj(u[l]));
+			for (l = 0; l < fmaconf.bspboxvol; ++l) nv += creal(v[l] * conj(v[l]));
+			farsv[i] = sqrt(nu * nv);
+		}
 	}
 
+	/* All far-field ranks are active by default. */
+	fmaconf.acatrunc = fmaconf.acarank;
+
+#ifdef MIXEDPREC
+	/* Keep single-precision copies of the far-field matrices. */
+	if (fmaconf.acarank > 0)
+		l = fmaconf.acarank * (fmaconf.nsamp + fmaconf.bspboxvol);
+	else l = fmaconf.nsamp * fmaconf.bspboxvol;
+
+	lradpats = malloc (l * sizeof(lcplx));
+	for (i = 0; i < l; ++i) lradpats[i] = (lcplx)fmaconf.radpats[i];
+#endif /* MIXEDPREC */
+
 	return fmaconf.acarank;
 }
 
+/* Release the far-field matrices so they can be rebuilt for a new grid. */
+void fmmfree (void) {
+	if (fmaconf.radpats) free (fmaconf.radpats);
+	if (farsv) free (farsv);
+	fmaconf.radpats = NULL;
+	farsv = NULL;
+#ifdef MIXEDPREC
+	if (lradpats) free (lradpats);
+	lradpats = NULL;
+#endif /* MIXEDPREC */
+}
+
+/* Find the far-field rank at which the singular values of the factored
+ * far-field matrices drop below tol relative to the largest. This is the
+ * rank to assign to fmaconf.acatrunc for a cheaper, less accurate operator.
+ * The stored rank is returned if no truncation is possible. */
+int farrank (real tol) {
+	int i;
+
+	if (!farsv || fmaconf.acarank < 1) return fmaconf.acarank;
+
+	for (i = 1; i < fmaconf.acarank; ++i)
+		if (farsv[i] < tol * farsv[0]) break;
+
+	return i;
+}
+
+/* Return the local storage, in bytes, of the far-field matrices. */
+long farmemory (void) {
+	long n;
+
+	if (fmaconf.acarank > 0)
+		n = (long)fmaconf.acarank * (fmaconf.nsamp + fmaconf.bspboxvol);
+	else n = (long)fmaconf.nsamp * fmaconf.bspboxvol;
+
+#ifdef MIXEDPREC
+	return n * (sizeof(cplx) + sizeof(lcplx)) + fmaconf.acarank * sizeof(real);
+#else
+	return n * sizeof(cplx) + fmaconf.acarank * sizeof(real);
+#endif /* MIXEDPREC */
+}
+
 /* initialisation and finalisation routines for ScaleME */
 int ScaleME_preconf (int useaca) {
 	int error;
@@ -487,8 +695,9 @@ int ScaleME_preconf (int useaca) {
 	ScaleME_setDimen (3);
 	ScaleME_setTreeType (3);
 
-	/* The fields are scalar-valued. */
-	ScaleME_setFields (1);
+	/* The fields are scalar-valued, but several right-hand sides may be
+	 * packed into each basis and treated as separate field components. */
+	ScaleME_setFields (fmaconf.nrhs);
 
 	/* The wave number is real-valued. */
 	ScaleME_setWaveNumber (fmaconf.k0);
@@ -502,7 +711,7 @@ int ScaleME_preconf (int useaca) {
 
 	ScaleME_setTopComputeLevel (fmaconf.toplev);
 
-	ScaleME_setRHSDataWidth (fmaconf.bspboxvol);
+	ScaleME_setRHSDataWidth (fmaconf.nrhs * fmaconf.bspboxvol);
 
 	/* Enable fast O2I if desired. */
 	if (fmaconf.fo2itxlev > 0 && fmaconf.fo2ibclev > 0) {
@@ -520,7 +729,7 @@ int ScaleME_preconf (int useaca) {
 	ScaleME_setRootBox (len, cen);
 
 	/*  let all processes start the initialisation together */
-	MPI_Barrier(MPI_COMM_WORLD);
+	MPI_Barrier(fmaconf.comm);
 
 	/* open the std files */
 	MPFMA_stdout = stdout;
@@ -532,7 +741,7 @@ int ScaleME_preconf (int useaca) {
 	else ScaleME_useExternFarField (farpattern);
 
 	/* Finish the setup with the external interactions. */
-	error = ScaleME_initSetUp (MPI_COMM_WORLD, NULL, NULL, NULL, bscenter);
+	error = ScaleME_initSetUp (fmaconf.comm, NULL, NULL, NULL, bscenter);
 
 	if (error) {
 		fprintf(stdout, "ERROR: ScaleME pre-init failed.\n");
@@ -1,6 +1,8 @@
 #ifndef __MLFMA_H_
 #define __MLFMA_H_
 
+#include <mpi.h>
+
 #include "precision.h"
 #include "util.h"
 
@@ -10,9 +12,10 @@ typedef struct {
 	int nx, ny, nz, gnumbases, numbases;
 	int bspbox, maxlev, numbuffer, interpord, toplev, bspboxvol;
 	int fo2itxlev, fo2ibclev, fo2iord, fo2iosr;
-	int *bslist, nsamp, acarank;
+	int *bslist, nsamp, acarank, acatrunc, nrhs, lowprec;
 	real k0;
 	cplx *contrast, *radpats;
+	MPI_Comm comm;
 } fmadesc;
 
 extern fmadesc fmaconf;
@@ -31,6 +34,13 @@ void acafarpattern (int, int *, void *, void *, real *, int);
 void farpattern (int, int *, void *, void *, real *, int);
 
 int fmmprecalc (real, int);
+void fmmfree (void);
+int farrank (real);
+long farmemory (void);
+
+/* Conversion between column-ordered blocks and the ScaleME layout. */
+void blkpack (cplx *, cplx *, cplx *);
+void blkunpack (cplx *, cplx *);
 
 /* initialisation and finalisation routines for ScaleME */
 int ScaleME_preconf (int);
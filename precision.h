@@ -30,6 +30,7 @@
 #define FFTW_PLAN fftw_plan
 
 #define TRSV cblas_ztrsv
+#define TRSM cblas_ztrsm
 #define GEMV cblas_zgemv
 #define GEMM cblas_zgemm
 #define DOTC_SUB cblas_zdotc_sub
@@ -40,6 +41,9 @@
 #define GEQRF zgeqrf_
 #define UNGQR zungqr_
 #define GESVD zgesvd_
+#define GGEV zggev_
+#define GETRF zgetrf_
+#define GETRS zgetrs_
 
 #else /* Use single precision. */
 #define REAL_EPSILON FLT_EPSILON
@@ -59,6 +63,7 @@
 #define FFTW_PLAN fftwf_plan
 
 #define TRSV cblas_ctrsv
+#define TRSM cblas_ctrsm
 #define GEMV cblas_cgemv
 #define GEMM cblas_cgemm
 #define DOTC_SUB cblas_cdotc_sub
@@ -69,7 +74,29 @@
 #define GEQRF cgeqrf_
 #define UNGQR cungqr_
 #define GESVD cgesvd_
+#define GGEV cggev_
+#define GETRF cgetrf_
+#define GETRS cgetrs_
 
 #endif
 
+/* In a mixed-precision build, the solvers and ScaleME work in double
+ * precision, but the near-field spectra and far-field matrices also have
+ * single-precision copies for a cheaper, less accurate operator. */
+#ifdef MIXEDPREC
+#ifndef DOUBLEPREC
+#error "Mixed precision requires DOUBLEPREC."
+#endif
+
+typedef complex float lcplx;
+
+#define LFFTW_FREE fftwf_free
+#define LFFTW_MALLOC fftwf_malloc
+#define LFFTW_EXECUTE_DFT fftwf_execute_dft
+#define LFFTW_PLAN_DFT_3D fftwf_plan_dft_3d
+#define LFFTW_PLAN fftwf_plan
+
+#define LGEMM cblas_cgemm
+#endif /* MIXEDPREC */
+
 #endif /* __PRECISION_H_ */
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "direct.h"
+#include "precond.h"
+
+/* The largest coarse system that will be factored densely on the root. */
+#define CRSMAX 4096
+
+/* The self-group Green's matrix, shared by every group, and the LU
+ * factorizations of the contrast-weighted diagonal blocks of the system. */
+static cplx *selfmat = NULL, *pcblk = NULL;
+static int *pcpiv = NULL;
+
+/* The coarse-grid Green's matrix and its contrast-weighted LU factorization,
+ * stored only on the root, and a global coarse vector on every process. */
+static cplx *crsgrn = NULL, *crsmat = NULL, *crsvec = NULL;
+static int *crspiv = NULL, usecrs = 0;
+
+/* Return the local storage, in bytes, of the preconditioner. */
+long pcmemory (void) {
+	long bsq = (long)fmaconf.bspboxvol * (long)fmaconf.bspboxvol,
+	     ng = fmaconf.gnumbases, sz = 0;
+
+	if (selfmat) sz += bsq * (fmaconf.numbases + 1) * sizeof(cplx)
+		+ (long)fmaconf.numbases * fmaconf.bspboxvol * sizeof(int);
+	if (crsvec) sz += ng * sizeof(cplx);
+	if (crsgrn) sz += 2 * ng * ng * sizeof(cplx) + ng * sizeof(int);
+
+	return sz;
+}
+
+/* Build the coarse-grid system, which treats each finest-level group as a
+ * single cell with the average contrast of the group. With restriction by
+ * group averages and prolongation by injection, this approximates the
+ * Galerkin product R A P. The system is factored on the root. */
+static int crsbuild (void) {
+	long i, j, ng = fmaconf.gnumbases, bvol = fmaconf.bspboxvol;
+	int rank, n = fmaconf.gnumbases, info = 0;
+	cplx *ct, *cv;
+
+	MPI_Comm_rank (fmaconf.comm, &rank);
+
+	/* The first call allocates storage and builds the Green's matrix. */
+	if (!crsvec) {
+		crsvec = malloc (ng * sizeof(cplx));
+		if (!rank) {
+			crsgrn = malloc (2 * ng * ng * sizeof(cplx));
+			crsmat = crsgrn + ng * ng;
+			crspiv = malloc (ng * sizeof(int));
+
+			fprintf (stderr, "Coarse-grid system size: %ld bytes\n",
+					2 * ng * ng * sizeof(cplx));
+
+			coarsegreen (crsgrn);
+		}
+	}
+
+	/* Average the contrast over each local group. */
+	memset (crsvec, 0, ng * sizeof(cplx));
+	for (i = 0; i < fmaconf.numbases; ++i) {
+		ct = fmaconf.contrast + i * bvol;
+		cv = crsvec + fmaconf.bslist[i];
+		for (j = 0; j < bvol; ++j) *cv += ct[j];
+		*cv /= (real)bvol;
+	}
+
+	/* Gather the averages on the root. */
+	MPI_Reduce (rank ? crsvec : MPI_IN_PLACE, crsvec,
+			2 * ng, MPIREAL, MPI_SUM, 0, fmaconf.comm);
+
+	if (!rank) {
+		/* Build the averaged coarse system. */
+		for (j = 0; j < ng; ++j)
+			for (i = 0; i < ng; ++i)
+				crsmat[i + j * ng] = -crsgrn[i + j * ng] * crsvec[j] / (real)bvol;
+		for (i = 0; i < ng; ++i) crsmat[i + i * ng] += fmaconf.cellvol;
+
+		GETRF (&n, &n, crsmat, &n, crspiv, &info);
+	}
+
+	/* Disable the correction everywhere if the factorization failed. */
+	MPI_Bcast (&info, 1, MPI_INT, 0, fmaconf.comm);
+	if (info) {
+		if (!rank) fprintf (stderr, "WARNING: Singular coarse-grid system, correction disabled.\n");
+		usecrs = 0;
+	}
+
+	return ng;
+}
+
+/* Request a coarse-grid correction in subsequent preconditioner builds.
+ * Returns zero if the coarse grid is too large for a dense solve. */
+int pccoarse (void) {
+	if (fmaconf.gnumbases > CRSMAX) return 0;
+	usecrs = 1;
+	return 1;
+}
+
+/* Build or refresh the block-Jacobi preconditioner for the current contrast.
+ * Each local group is preconditioned by the inverse of its diagonal block
+ * cellvol * I - G00 * diag(contrast) of the system matrix. */
+int pcbuild (void) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	long bvol = fmaconf.bspboxvol, bsq = bvol * bvol;
+	int rank, nfail = 0;
+
+	MPI_Comm_rank (fmaconf.comm, &rank);
+
+	/* The first call allocates storage and builds the self interactions. */
+	if (!selfmat) {
+		selfmat = malloc (bsq * sizeof(cplx));
+		pcblk = malloc (bsq * fmaconf.numbases * sizeof(cplx));
+		pcpiv = malloc (nelt * sizeof(int));
+
+		fprintf (stderr, "Rank %d: Preconditioner size: %ld bytes\n",
+				rank, bsq * fmaconf.numbases * sizeof(cplx));
+
+		selfblock (selfmat);
+	}
+
+#pragma omp parallel default(shared)
+{
+	long j, k;
+	int i, n = bvol, info, *piv;
+	cplx *blk, *ct;
+
+#pragma omp for reduction(+:nfail)
+	for (i = 0; i < fmaconf.numbases; ++i) {
+		blk = pcblk + i * bsq;
+		ct = fmaconf.contrast + i * bvol;
+		piv = pcpiv + i * bvol;
+
+		/* Build the diagonal block for this group. */
+		for (k = 0; k < bvol; ++k)
+			for (j = 0; j < bvol; ++j)
+				blk[j + k * bvol] = -selfmat[j + k * bvol] * ct[k];
+		for (k = 0; k < bvol; ++k) blk[k + k * bvol] += fmaconf.cellvol;
+
+		GETRF (&n, &n, blk, &n, piv, &info);
+
+		if (!info) continue;
+
+		/* Fall back to the identity portion for a singular block. */
+		++nfail;
+		memset (blk, 0, bsq * sizeof(cplx));
+		for (k = 0; k < bvol; ++k) {
+			blk[k + k * bvol] = fmaconf.cellvol;
+			piv[k] = k + 1;
+		}
+	}
+}
+
+	if (nfail) fprintf (stderr, "Rank %d: %d singular preconditioner blocks\n", rank, nfail);
+
+	/* Refresh the coarse-grid system, if desired. */
+	if (usecrs) crsbuild ();
+
+	return fmaconf.numbases - nfail;
+}
+
+/* Report whether a preconditioner has been built. */
+int pcready (void) {
+	return pcblk != NULL;
+}
+
+/* Apply the inverse preconditioner to in, storing the result in out. The
+ * block-Jacobi application is local to each group and requires no
+ * communication. With a coarse-grid correction, the group averages of the
+ * input are instead solved on the coarse grid and the block inverses act on
+ * the remainder. The input and output may alias. */
+int pcapply (cplx *out, cplx *in) {
+	long nelt = (long)fmaconf.numbases * (long)fmaconf.bspboxvol;
+	long bvol = fmaconf.bspboxvol, bsq = bvol * bvol;
+	int rank, nc = fmaconf.gnumbases, one = 1, info;
+
+	if (out != in) memcpy (out, in, nelt * sizeof(cplx));
+
+	if (!pcblk) return 0;
+
+	if (usecrs) {
+		MPI_Comm_rank (fmaconf.comm, &rank);
+
+		/* Restrict the input to the coarse grid and remove the
+		 * group averages from the fine-grid remainder. */
+		memset (crsvec, 0, fmaconf.gnumbases * sizeof(cplx));
+#pragma omp parallel default(shared)
+{
+		long i, j;
+		cplx avg, *op;
+
+#pragma omp for
+		for (i = 0; i < fmaconf.numbases; ++i) {
+			op = out + i * bvol;
+			for (j = 0, avg = 0; j < bvol; ++j) avg += op[j];
+			avg /= (real)bvol;
+			for (j = 0; j < bvol; ++j) op[j] -= avg;
+			crsvec[fmaconf.bslist[i]] = avg;
+		}
+}
+
+		/* Solve the coarse system on the root and distribute. */
+		MPI_Reduce (rank ? crsvec : MPI_IN_PLACE, crsvec,
+				2 * fmaconf.gnumbases, MPIREAL, MPI_SUM, 0, fmaconf.comm);
+		if (!rank) GETRS ("N", &nc, &one, crsmat, &nc, crspiv, crsvec, &nc, &info);
+		MPI_Bcast (crsvec, 2 * fmaconf.gnumbases, MPIREAL, 0, fmaconf.comm);
+	}
+
+#pragma omp parallel default(shared)
+{
+	int i, n = bvol, one = 1, info;
+
+#pragma omp for
+	for (i = 0; i < fmaconf.numbases; ++i)
+		GETRS ("N", &n, &one, pcblk + i * bsq, &n,
+				pcpiv + i * bvol, out + i * bvol, &n, &info);
+}
+
+	/* Prolong the coarse correction by injection. */
+	if (usecrs) {
+#pragma omp parallel default(shared)
+{
+		long i, j;
+		cplx avg, *op;
+
+#pragma omp for
+		for (i = 0; i < fmaconf.numbases; ++i) {
+			op = out + i * bvol;
+			avg = crsvec[fmaconf.bslist[i]];
+			for (j = 0; j < bvol; ++j) op[j] += avg;
+		}
+}
+	}
+
+	return fmaconf.numbases;
+}
+
+/* Release the preconditioner storage. */
+void pcfree (void) {
+	if (selfmat) free (selfmat);
+	if (pcblk) free (pcblk);
+	if (pcpiv) free (pcpiv);
+	if (crsvec) free (crsvec);
+	if (crsgrn) free (crsgrn);
+	if (crspiv) free (crspiv);
+	selfmat = pcblk = crsvec = crsgrn = crsmat = NULL;
+	pcpiv = crspiv = NULL;
+	usecrs = 0;
+}
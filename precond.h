@@ -0,0 +1,13 @@
+#ifndef __PRECOND_H_
+#define __PRECOND_H_
+
+#include "precision.h"
+
+int pcbuild (void);
+int pccoarse (void);
+int pcready (void);
+int pcapply (cplx *, cplx *);
+void pcfree (void);
+long pcmemory (void);
+
+#endif /* __PRECOND_H_ */
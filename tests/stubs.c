@@ -0,0 +1,23 @@
+#include <mpi.h>
+
+#include "ScaleME.h"
+
+#include "precision.h"
+
+#include "mlfma.h"
+
+/* The tests link individual modules without mlfma.o, which would pull in
+ * ScaleME, so the configuration is defined here. Each test describes the
+ * grid it needs and sets the communicator. */
+fmadesc fmaconf;
+
+/* Root interpolation matrices are never built in the tests, so far-field
+ * evaluation always fails. */
+int ScaleME_evlRootFarFld (void *imat, void *cur, void *res) {
+	return 1;
+}
+
+int ScaleME_delRootInterpMat (void **imat) {
+	*imat = NULL;
+	return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "fldcache.h"
+#include "ckpt.h"
+
+/* The checkpoint written by the test, in the working directory. */
+#define CKFILE "tckpt.ckpt"
+
+/* The lengths of the integer segment and the base length of the complex
+ * segment, which grows with the rank. */
+#define NINT 3
+#define NCPLX 5
+
+/* A stand-in for the field cache: a rank-dependent number of values that
+ * follow the registered segments. */
+static int fcval[4], fcnval = 0;
+
+long fcsize (void) {
+	return fcnval * sizeof(int);
+}
+
+int fcsave (MPI_File fh, MPI_Offset off) {
+	MPI_Status stat;
+
+	MPI_File_write_at (fh, off, fcval, fcnval, MPI_INT, &stat);
+	return fcnval;
+}
+
+int fcrestore (MPI_File fh, MPI_Offset off) {
+	MPI_Status stat;
+
+	MPI_File_read_at (fh, off, fcval, fcnval, MPI_INT, &stat);
+	return fcnval;
+}
+
+/* Fill the test state for the given rank, offset by seed. */
+static void fillstate (int *iv, cplx *cv, long nc, int rank, int seed) {
+	long j;
+
+	for (j = 0; j < NINT; ++j) iv[j] = seed + 100 * rank + j;
+	for (j = 0; j < nc; ++j) cv[j] = seed + rank + I * j;
+	for (j = 0; j < fcnval; ++j) fcval[j] = seed - rank - j;
+}
+
+int main (int argc, char **argv) {
+	int rank, ok = 1, iv[NINT], ref[NINT], fref[4];
+	cplx *cv, *cref;
+	long nc;
+
+	MPI_Init (&argc, &argv);
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+	fmaconf.comm = MPI_COMM_WORLD;
+
+	/* Processes hold different amounts of state. */
+	nc = NCPLX + rank;
+	fcnval = rank % 4;
+	cv = malloc (2 * nc * sizeof(cplx));
+	cref = cv + nc;
+
+	/* Write the state and the cache, then overwrite both. The checkpoint
+	 * calls are collective, so every process makes them. */
+	fillstate (ref, cref, nc, rank, 1);
+	memcpy (fref, fcval, sizeof(fcval));
+	memcpy (iv, ref, sizeof(ref));
+	memcpy (cv, cref, nc * sizeof(cplx));
+
+	ckclear ();
+	ckadd (iv, sizeof(iv));
+	ckadd (cv, nc * sizeof(cplx));
+	ok = ckwrite (CKFILE, 1) && ok;
+
+	fillstate (iv, cv, nc, rank, 7);
+
+	/* Reading only the first segment leaves the others alone. */
+	ckclear ();
+	ckadd (iv, sizeof(iv));
+	ok = ckread (CKFILE, 1) && ok;
+	ok = ok && !memcmp (iv, ref, sizeof(ref)) && cv[0] == 7 + rank;
+	ok = ok && (!fcnval || fcval[0] == 7 - rank);
+
+	/* Reading every segment restores the state and the cache. */
+	ckadd (cv, nc * sizeof(cplx));
+	ok = ckread (CKFILE, 1) && ok;
+	ok = ok && !memcmp (iv, ref, sizeof(ref)) && !memcmp (cv, cref, nc * sizeof(cplx));
+	ok = ok && !memcmp (fcval, fref, fcnval * sizeof(int));
+
+	/* A segment of the wrong size on any process rejects the checkpoint,
+	 * which ckread reports. */
+	if (!rank) fprintf (stderr, "Reading with a mismatched segment.\n");
+	ckclear ();
+	ckadd (iv, sizeof(iv));
+	ckadd (cv, (rank ? nc : nc - 1) * sizeof(cplx));
+	ok = !ckread (CKFILE, 1) && ok;
+
+	/* A missing checkpoint is not an error, but is not read. */
+	ok = !ckread (CKFILE ".missing", 1) && ok;
+
+	MPI_Allreduce (MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+	if (!rank) {
+		fprintf (stderr, "%s: %s\n", argv[0], ok ? "PASS" : "FAIL");
+		remove (CKFILE);
+	}
+
+	free (cv);
+	MPI_Finalize ();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
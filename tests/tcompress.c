@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "compress.h"
+#include "util.h"
+
+/* The local length of the test vectors. */
+#define NELT 4096
+
+/* Store v with the tolerance tol, reload it and check that the format is
+ * fmt and that the relative error of the distributed vector is within tol.
+ * Returns 1 on success. */
+static int roundtrip (cplx *v, cplx *w, real tol, int fmt) {
+	cvec cv;
+	real err, nrm;
+	int f, rank;
+
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+	cv.data = NULL;
+	f = cvstore (&cv, v, NELT, tol);
+	cvload (w, &cv, NELT);
+	cvfree (&cv);
+
+	vaxpby (w, -1., v, 1., NELT);
+	err = parnorm (w, NELT);
+	if ((nrm = parnorm (v, NELT)) > 0) err /= nrm;
+
+	if (!rank) fprintf (stderr, "Tolerance %g: format %d, relative error %g\n", tol, f, err);
+
+	if (f != fmt) return 0;
+	return tol > 0 ? (err <= tol) : (err == 0);
+}
+
+int main (int argc, char **argv) {
+	cplx *v, *w;
+	int rank, ok = 1;
+	long j;
+
+	MPI_Init (&argc, &argv);
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+	fmaconf.comm = MPI_COMM_WORLD;
+
+	v = malloc (2L * NELT * sizeof(cplx));
+	w = v + NELT;
+
+	/* Every process holds a different smooth vector. */
+	for (j = 0; j < NELT; ++j)
+		v[j] = (rank + 1) * cexp (I * 0.01 * j) / (1. + 1e-3 * j);
+
+	/* Eight bits give a relative error near 1e-2, sixteen bits near 1e-4. */
+	ok = ok && roundtrip (v, w, 0.05, CV_I8);
+	ok = ok && roundtrip (v, w, 1e-3, CV_I16);
+	ok = ok && roundtrip (v, w, 0., CV_FULL);
+
+	/* A zero vector must be stored without dividing by its scale. */
+	memset (v, 0, NELT * sizeof(cplx));
+	ok = ok && roundtrip (v, w, 0.05, CV_I8);
+
+	MPI_Allreduce (MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+	if (!rank) fprintf (stderr, "%s: %s\n", argv[0], ok ? "PASS" : "FAIL");
+
+	free (v);
+	MPI_Finalize ();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
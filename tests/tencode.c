@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "measure.h"
+#include "util.h"
+
+/* The number of sources and observers of the test measurements. */
+#define NSRC 6
+#define NOBS 5
+
+/* Return the largest relative difference between the n values in x and y. */
+static real reldiff (cplx *x, cplx *y, long n) {
+	real num = 0, den = 0;
+	long i;
+
+	for (i = 0; i < n; ++i) {
+		num += cabs(x[i] - y[i]) * cabs(x[i] - y[i]);
+		den += cabs(y[i]) * cabs(y[i]);
+	}
+
+	return sqrt(num / den);
+}
+
+/* Encode the fields of all sources with the first q rows of the unitary
+ * discrete Fourier transform and check that decoding undoes the encoding:
+ * exactly for a complete code and as a projection otherwise. Returns 1 on
+ * success. */
+static int codetest (cplx *field, int q) {
+	measdesc enc;
+	cplx *efld, *dfld, *rfld, *pfld;
+	real tol = 100 * REAL_EPSILON, err[2];
+	int k, t, ok;
+
+	enc.count = q;
+	enc.ncode = NSRC;
+	enc.code = malloc (q * NSRC * sizeof(cplx));
+	for (k = 0; k < q; ++k)
+		for (t = 0; t < NSRC; ++t)
+			enc.code[k * NSRC + t] = cexp (-2 * M_PI * I * k * t / NSRC) / sqrt(NSRC);
+
+	efld = malloc (2 * (q + NSRC) * NOBS * sizeof(cplx));
+	dfld = efld + q * NOBS;
+	rfld = dfld + NSRC * NOBS;
+	pfld = rfld + q * NOBS;
+
+	encfield (efld, field, &enc, NOBS);
+	decfield (dfld, efld, &enc, NOBS);
+
+	if (q == NSRC) {
+		/* A complete orthonormal code loses nothing. */
+		err[0] = reldiff (dfld, field, NSRC * NOBS);
+		ok = err[0] < tol;
+		fprintf (stderr, "Complete code: reconstruction error %g\n", err[0]);
+	} else {
+		/* Decoding projects onto the span of the codes, so encoding the
+		 * decoded fields recovers the encoded ones, and decoding them
+		 * again changes nothing. */
+		encfield (rfld, dfld, &enc, NOBS);
+		err[0] = reldiff (rfld, efld, q * NOBS);
+		decfield (pfld, rfld, &enc, NOBS);
+		err[1] = reldiff (pfld, dfld, NSRC * NOBS);
+		ok = err[0] < tol && err[1] < tol;
+		fprintf (stderr, "%d of %d codes: encoding error %g, projection error %g\n",
+				q, NSRC, err[0], err[1]);
+	}
+
+	free (efld);
+	free (enc.code);
+
+	return ok;
+}
+
+int main (int argc, char **argv) {
+	cplx *field;
+	int rank, ok = 1;
+	long j;
+
+	MPI_Init (&argc, &argv);
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+
+	fmaconf.comm = MPI_COMM_WORLD;
+
+	/* The encoding is not distributed, so only the root checks it. */
+	if (!rank) {
+		field = malloc (NSRC * NOBS * sizeof(cplx));
+		for (j = 0; j < NSRC * NOBS; ++j)
+			field[j] = cexp (I * 0.7 * j) * (1. + 0.1 * j);
+
+		ok = codetest (field, NSRC) && codetest (field, NSRC / 2);
+
+		free (field);
+	}
+
+	MPI_Bcast (&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+	if (!rank) fprintf (stderr, "%s: %s\n", argv[0], ok ? "PASS" : "FAIL");
+
+	MPI_Finalize ();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "lbfgs.h"
+#include "util.h"
+
+/* The local length of the vectors, the stored pairs and the pushed pairs. */
+#define NELT 4
+#define NMEM 3
+#define NPAIR 5
+
+/* The value at global index j of the k-th test vector. */
+static cplx testvec (int k, long j) {
+	return cexp (I * (0.3 * k + 0.7 * j)) * (1. + 0.1 * ((j + k) % 5));
+}
+
+/* Fill the local parts of the k-th step s and gradient change y = D s for
+ * a positive diagonal D. */
+static void testpair (cplx *s, cplx *y, int k, int rank) {
+	long j, gj;
+
+	for (j = 0, gj = rank * NELT; j < NELT; ++j, ++gj) {
+		s[j] = testvec (k, gj);
+		y[j] = (1. + 0.2 * k + 0.05 * gj) * s[j];
+	}
+}
+
+/* Gather the distributed complex vectors x as one real vector xr, with
+ * real and imaginary parts interleaved. */
+static void gather (double *xr, cplx *x) {
+	double lx[2 * NELT];
+	long j;
+
+	for (j = 0; j < NELT; ++j) {
+		lx[2 * j] = creal(x[j]);
+		lx[2 * j + 1] = cimag(x[j]);
+	}
+
+	MPI_Allgather (lx, 2 * NELT, MPI_DOUBLE, xr, 2 * NELT, MPI_DOUBLE, MPI_COMM_WORLD);
+}
+
+/* Return the inner product of the real vectors x and y of length n. */
+static double dot (double *x, double *y, long n) {
+	double d = 0;
+	long i;
+
+	for (i = 0; i < n; ++i) d += x[i] * y[i];
+	return d;
+}
+
+/* Apply the BFGS update for the pair (s, y) to the dense, symmetric inverse
+ * Hessian h of order n, using the work vector hy. */
+static void bfgsupd (double *h, double *s, double *y, double *hy, long n) {
+	double rho, yhy;
+	long i, j;
+
+	rho = 1. / dot (s, y, n);
+
+	for (i = 0; i < n; ++i) hy[i] = dot (h + i * n, y, n);
+	yhy = dot (y, hy, n);
+
+	for (i = 0; i < n; ++i)
+		for (j = 0; j < n; ++j)
+			h[i * n + j] += -rho * (s[i] * hy[j] + hy[i] * s[j])
+				+ (rho * rho * yhy + rho) * s[i] * s[j];
+}
+
+int main (int argc, char **argv) {
+	qnspace qn;
+	cplx *s, *y, *g, *p;
+	double *sr, *yr, *h, *pr, *hy, err, nrm, slope;
+	real d0, h0 = 0.5;
+	int rank, size, ok = 1, k;
+	long j, gj, n;
+
+	MPI_Init (&argc, &argv);
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_size (MPI_COMM_WORLD, &size);
+
+	fmaconf.comm = MPI_COMM_WORLD;
+
+	/* The order of the equivalent real problem. */
+	n = 2L * NELT * size;
+
+	s = malloc (4 * NELT * sizeof(cplx));
+	y = s + NELT;
+	g = y + NELT;
+	p = g + NELT;
+
+	sr = malloc ((5 * n + n * n) * sizeof(double));
+	yr = sr + n;
+	pr = yr + n;
+	hy = pr + n;
+	h = hy + n;
+
+	qninit (&qn, NMEM, NELT);
+
+	/* Without pairs, the direction is the scaled steepest descent. */
+	for (j = 0, gj = rank * NELT; j < NELT; ++j, ++gj) g[j] = testvec (-1, gj);
+	d0 = qndir (p, g, &qn, h0);
+	vaxpby (p, h0, g, 1., NELT);
+	err = parnorm (p, NELT) / parnorm (g, NELT);
+	ok = ok && err < 100 * REAL_EPSILON;
+	if (!rank) fprintf (stderr, "No pairs: error %g\n", err);
+
+	/* A pair with negative curvature is rejected. */
+	testpair (s, y, 0, rank);
+	vaxpby (y, -1., s, 0., NELT);
+	ok = ok && !qnpush (&qn, s, y);
+
+	/* Push more pairs than fit, each with y = D s for a positive diagonal
+	 * D that changes with the pair. */
+	for (k = 0; k < NPAIR; ++k) {
+		testpair (s, y, k, rank);
+		ok = ok && qnpush (&qn, s, y);
+	}
+
+	/* Build the dense inverse Hessian from the pairs that remain, starting
+	 * from the identity scaled by the newest pair. */
+	testpair (s, y, NPAIR - 1, rank);
+	gather (sr, s);
+	gather (yr, y);
+	memset (h, 0, n * n * sizeof(double));
+	for (j = 0; j < n; ++j) h[j * n + j] = dot (sr, yr, n) / dot (yr, yr, n);
+
+	for (k = NPAIR - NMEM; k < NPAIR; ++k) {
+		testpair (s, y, k, rank);
+		gather (sr, s);
+		gather (yr, y);
+		bfgsupd (h, sr, yr, hy, n);
+	}
+
+	/* Compare the two-loop direction with the dense product -H g. */
+	d0 = qndir (p, g, &qn, h0);
+	gather (pr, p);
+	gather (sr, g);
+	for (j = 0, err = 0, nrm = 0; j < n; ++j) {
+		yr[j] = -dot (h + j * n, sr, n);
+		err += (pr[j] - yr[j]) * (pr[j] - yr[j]);
+		nrm += yr[j] * yr[j];
+	}
+	err = sqrt(err / nrm);
+	slope = dot (sr, yr, n);
+
+	ok = ok && err < 1000 * REAL_EPSILON;
+	ok = ok && fabs(d0 - slope) < 1000 * REAL_EPSILON * fabs(slope);
+	ok = ok && d0 < 0;
+
+	if (!rank) {
+		fprintf (stderr, "%d pairs: direction error %g, slope %g (dense %g)\n",
+				qn.k, err, d0, slope);
+		fprintf (stderr, "%s: %s\n", argv[0], ok ? "PASS" : "FAIL");
+	}
+
+	qnfree (&qn);
+	free (s);
+	free (sr);
+
+	MPI_Finalize ();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
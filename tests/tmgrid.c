@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mpi.h>
+
+#include "precision.h"
+
+#include "mlfma.h"
+#include "mgrid.h"
+#include "util.h"
+
+/* The groups per dimension and fine cells per group dimension. */
+#define NGRP 3
+#define FBPB 4
+
+/* The coefficients of the linear test field. */
+#define FA 1.
+#define FB 0.25
+
+/* The global position, along dimension k, of local cell j of the current
+ * grid, in cell widths. */
+static int cellpos (long j, int k) {
+	int gi[3], c[3], bpb = fmaconf.bspbox;
+
+	GRID(gi, fmaconf.bslist[j / fmaconf.bspboxvol], fmaconf.nx, fmaconf.ny);
+	GRID(c, j % fmaconf.bspboxvol, bpb, bpb);
+
+	return gi[k] * bpb + c[k];
+}
+
+/* Fill the local cells of the current grid with a field that is linear
+ * along the first dimension, plus an imaginary constant. */
+static void linfield (cplx *crt) {
+	long j, nelt = (long)fmaconf.numbases * fmaconf.bspboxvol;
+
+	for (j = 0; j < nelt; ++j) crt[j] = FA + FB * cellpos (j, 0) + I;
+}
+
+int main (int argc, char **argv) {
+	cplx *fine, *coarse, *gct;
+	int rank, size, ok, g, cbpb, n;
+	long j, nelt;
+	real p, r, err[3] = { 0., 0., 0. };
+
+	MPI_Init (&argc, &argv);
+	MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+	MPI_Comm_size (MPI_COMM_WORLD, &size);
+
+	/* Distribute the groups of a cube cyclically. */
+	fmaconf.comm = MPI_COMM_WORLD;
+	fmaconf.nx = fmaconf.ny = fmaconf.nz = NGRP;
+	fmaconf.gnumbases = NGRP * NGRP * NGRP;
+	fmaconf.bslist = malloc (fmaconf.gnumbases * sizeof(int));
+	for (g = rank, fmaconf.numbases = 0; g < fmaconf.gnumbases; g += size)
+		fmaconf.bslist[fmaconf.numbases++] = g;
+	fmaconf.bspbox = FBPB;
+	fmaconf.cell = 1.;
+
+	ok = (mginit (2) == 2);
+
+	fine = malloc ((long)fmaconf.numbases * FBPB * FBPB * FBPB * sizeof(cplx));
+	coarse = malloc ((long)fmaconf.numbases * FBPB * FBPB * FBPB * sizeof(cplx));
+
+	/* Prolong a linear field from the coarsest grid. Trilinear
+	 * interpolation reproduces it, except that it is held constant
+	 * beyond the outermost coarse cell centers. */
+	cbpb = mgsetlev (2);
+	linfield (coarse);
+	gct = mggather (coarse);
+
+	mgsetlev (0);
+	mgprolong (fine, gct, cbpb);
+	free (gct);
+
+	nelt = (long)fmaconf.numbases * fmaconf.bspboxvol;
+	r = (real)FBPB / (real)cbpb;
+	n = NGRP * cbpb;
+	for (j = 0; j < nelt; ++j) {
+		p = ((real)cellpos (j, 0) + 0.5) / r - 0.5;
+		p = MIN(MAX(p, 0.), (real)(n - 1));
+		err[0] = MAX(err[0], cabs(fine[j] - (FA + FB * p + I)));
+	}
+
+	/* Restricting a field that is constant on each coarse cell recovers
+	 * the coarse values. */
+	for (j = 0; j < nelt; ++j) fine[j] = FA + FB * (cellpos (j, 0) / 2) + I;
+
+	mgsetlev (1);
+	mgrestrict (coarse, fine, FBPB);
+
+	nelt = (long)fmaconf.numbases * fmaconf.bspboxvol;
+	for (j = 0; j < nelt; ++j)
+		err[1] = MAX(err[1], cabs(coarse[j] - (FA + FB * cellpos (j, 0) + I)));
+
+	/* A constant field survives prolongation and restriction. */
+	for (j = 0; j < nelt; ++j) coarse[j] = FA + I;
+	gct = mggather (coarse);
+
+	mgsetlev (0);
+	mgprolong (fine, gct, 2);
+	free (gct);
+
+	mgsetlev (1);
+	mgrestrict (coarse, fine, FBPB);
+
+	for (j = 0; j < nelt; ++j) err[2] = MAX(err[2], cabs(coarse[j] - (FA + I)));
+
+	MPI_Allreduce (MPI_IN_PLACE, err, 3, MPIREAL, MPI_MAX, MPI_COMM_WORLD);
+	ok = ok && MAX(MAX(err[0], err[1]), err[2]) < 100 * REAL_EPSILON;
+
+	if (!rank) {
+		fprintf (stderr, "Errors: prolongation %g, restriction %g, round trip %g\n",
+				err[0], err[1], err[2]);
+		fprintf (stderr, "%s: %s\n", argv[0], ok ? "PASS" : "FAIL");
+	}
+
+	free (fine);
+	free (coarse);
+	free (fmaconf.bslist);
+
+	MPI_Finalize ();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,7 +1,21 @@
+#include <stdlib.h>
+
 #include <mpi.h>
 
+/* Pull in the CBLAS header. */
+#ifdef _MACOSX
+#include <Accelerate/Accelerate.h>
+#else
+#ifdef _ATLAS
+#include <cblas.h>
+#else
+#include <gsl_cblas.h>
+#endif /* _ATLAS */
+#endif /* _MACOSX */
+
 #include "precision.h"
 
+#include "mlfma.h"
 #include "util.h"
 
 /* Use the modified Gram-Schmidt process to compute (in place) the portion of
@@ -69,11 +83,39 @@ cplx pardot (cplx *x, cplx *y, long n) {
 	for (i = 0; i < n; ++i) dp += conj(x[i]) * y[i];
 
 	/* Add in the contributions from other processors. */
-	MPI_Allreduce (MPI_IN_PLACE, &dp, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce (MPI_IN_PLACE, &dp, 2, MPI_DOUBLE, MPI_SUM, fmaconf.comm);
 
 	return (cplx)dp;
 }
 
+/* Return the inner product of x and y, storing the squared norm of x, with
+ * a single pass over the vectors and a single reduction. */
+cplx pardotnrm (real *nrm, cplx *x, cplx *y, long n) {
+	double red[3], dr = 0.0, di = 0.0, ln = 0.0, xr, xi, yr, yi;
+	long i;
+
+#pragma omp parallel for default(shared) private(xr,xi,yr,yi,i) reduction(+: dr,di,ln)
+	for (i = 0; i < n; ++i) {
+		xr = creal(x[i]);
+		xi = cimag(x[i]);
+		yr = creal(y[i]);
+		yi = cimag(y[i]);
+		dr += xr * yr + xi * yi;
+		di += xr * yi - xi * yr;
+		ln += xr * xr + xi * xi;
+	}
+
+	red[0] = dr;
+	red[1] = di;
+	red[2] = ln;
+
+	/* Add in the contributions from other processors. */
+	MPI_Allreduce (MPI_IN_PLACE, red, 3, MPI_DOUBLE, MPI_SUM, fmaconf.comm);
+
+	*nrm = (real)red[2];
+	return (cplx)(red[0] + I * red[1]);
+}
+
 real parnorm (cplx *x, long n) {
 	/* Always compute the norm in double precision to avoid rounding errors. */
 	double nrm = 0.0, nr, ni;
@@ -89,26 +131,213 @@ real parnorm (cplx *x, long n) {
 	}
 
 	/* Sum over processors and reduce. */
-	MPI_Allreduce (MPI_IN_PLACE, &nrm, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce (MPI_IN_PLACE, &nrm, 1, MPI_DOUBLE, MPI_SUM, fmaconf.comm);
 
 	return (real)sqrt(nrm);
 }
 
+/* Compute the inner products of the nv pairs of distributed vectors stored
+ * consecutively in x and y, each of dimension n, with a single reduction. */
+int pardots (cplx *dp, cplx *x, cplx *y, long n, int nv) {
+	complex double *ldp, ld;
+	long i;
+	int k;
+
+	ldp = malloc (nv * sizeof(complex double));
+
+	for (k = 0; k < nv; ++k, x += n, y += n) {
+		/* Always accumulate in double precision. */
+		ld = 0.0;
+#pragma omp parallel for default(shared) private(i) reduction(+: ld)
+		for (i = 0; i < n; ++i) ld += conj(x[i]) * y[i];
+		ldp[k] = ld;
+	}
+
+	/* Add in the contributions from other processors all at once. */
+	MPI_Allreduce (MPI_IN_PLACE, ldp, 2 * nv, MPI_DOUBLE, MPI_SUM, fmaconf.comm);
+
+	for (k = 0; k < nv; ++k) dp[k] = (cplx)ldp[k];
+
+	free (ldp);
+	return nv;
+}
+
+/* Compute the norms of the nv distributed vectors stored consecutively in x,
+ * each of dimension n, with a single reduction. */
+int parnorms (real *nrm, cplx *x, long n, int nv) {
+	double *lnrm, ln, nr, ni;
+	long i;
+	int k;
+
+	lnrm = malloc (nv * sizeof(double));
+
+	for (k = 0; k < nv; ++k, x += n) {
+		ln = 0.0;
+#pragma omp parallel for default(shared) private(nr,ni,i) reduction(+: ln)
+		for (i = 0; i < n; ++i) {
+			nr = creal(x[i]);
+			nr *= nr;
+			ni = cimag(x[i]);
+			ni *= ni;
+			ln += nr + ni;
+		}
+		lnrm[k] = ln;
+	}
+
+	/* Sum over processors and reduce. */
+	MPI_Allreduce (MPI_IN_PLACE, lnrm, nv, MPI_DOUBLE, MPI_SUM, fmaconf.comm);
+
+	for (k = 0; k < nv; ++k) nrm[k] = (real)sqrt(lnrm[k]);
+
+	free (lnrm);
+	return nv;
+}
+
+/* Compute the na-by-nb matrix ip of inner products between the na distributed
+ * vectors in a and the nb distributed vectors in b, all of dimension n and
+ * stored consecutively, with a single reduction. */
+int parinner (cplx *ip, cplx *a, int na, cplx *b, int nb, long n) {
+	cplx cone = 1., czero = 0.;
+
+	if (na < 1 || nb < 1) return 0;
+
+	/* Compute the local contributions. */
+	GEMM (CblasColMajor, CblasConjTrans, CblasNoTrans, na, nb, n,
+			&cone, a, n, b, n, &czero, ip, na);
+
+	/* Add in the contributions from other processors. */
+	MPI_Allreduce (MPI_IN_PLACE, ip, 2 * na * nb, MPIREAL, MPI_SUM, fmaconf.comm);
+
+	return na * nb;
+}
+
+/* The following kernels fuse common element-wise vector operations so that
+ * each runs as a single parallel pass over its operands. Any norms or inner
+ * products are accumulated in double precision and returned as the local
+ * contributions; callers must reduce them across processors if necessary. */
+
+/* Compute y = a * x + b * y. When b is zero, y is not read. */
+void vaxpby (cplx *y, cplx a, cplx *x, cplx b, long n) {
+	long i;
+
+	if (b == 0) {
+#pragma omp parallel for default(shared) private(i)
+		for (i = 0; i < n; ++i) y[i] = a * x[i];
+	} else {
+#pragma omp parallel for default(shared) private(i)
+		for (i = 0; i < n; ++i) y[i] = a * x[i] + b * y[i];
+	}
+}
+
+/* Compute y += a * x + b * z and return the squared norm of the new y. */
+real vupdnrm (cplx *y, cplx a, cplx *x, cplx b, cplx *z, long n) {
+	double nrm = 0.0, nr, ni;
+	long i;
+
+#pragma omp parallel for default(shared) private(nr,ni,i) reduction(+: nrm)
+	for (i = 0; i < n; ++i) {
+		y[i] += a * x[i] + b * z[i];
+		nr = creal(y[i]);
+		ni = cimag(y[i]);
+		nrm += nr * nr + ni * ni;
+	}
+
+	return (real)nrm;
+}
+
+/* Compute the solution and residual updates x += a * p and r -= a * v
+ * common to Krylov methods, returning the squared norm of the new r. */
+real vsolupd (cplx *x, cplx *r, cplx a, cplx *p, cplx *v, long n) {
+	double nrm = 0.0, nr, ni;
+	long i;
+
+#pragma omp parallel for default(shared) private(nr,ni,i) reduction(+: nrm)
+	for (i = 0; i < n; ++i) {
+		x[i] += a * p[i];
+		r[i] -= a * v[i];
+		nr = creal(r[i]);
+		ni = cimag(r[i]);
+		nrm += nr * nr + ni * ni;
+	}
+
+	return (real)nrm;
+}
+
+/* Perform the conjugate-gradient updates x += a * p and p = r + b * p,
+ * returning the squared norm of the new p. */
+real vcgupd (cplx *x, cplx *p, cplx *r, cplx a, cplx b, long n) {
+	double nrm = 0.0, nr, ni;
+	long i;
+
+#pragma omp parallel for default(shared) private(nr,ni,i) reduction(+: nrm)
+	for (i = 0; i < n; ++i) {
+		x[i] += a * p[i];
+		p[i] = r[i] + b * p[i];
+		nr = creal(p[i]);
+		ni = cimag(p[i]);
+		nrm += nr * nr + ni * ni;
+	}
+
+	return (real)nrm;
+}
+
+/* Return the squared norm of x. */
+real vnrm2 (cplx *x, long n) {
+	double nrm = 0.0, nr, ni;
+	long i;
+
+#pragma omp parallel for default(shared) private(nr,ni,i) reduction(+: nrm)
+	for (i = 0; i < n; ++i) {
+		nr = creal(x[i]);
+		ni = cimag(x[i]);
+		nrm += nr * nr + ni * ni;
+	}
+
+	return (real)nrm;
+}
+
+/* Compute the element-wise product out = a .* b + c, where c may be NULL.
+ * The output may alias any input. */
+void vmuladd (cplx *out, cplx *a, cplx *b, cplx *c, long n) {
+	long i;
+
+	if (!c) {
+#pragma omp parallel for default(shared) private(i)
+		for (i = 0; i < n; ++i) out[i] = a[i] * b[i];
+	} else {
+#pragma omp parallel for default(shared) private(i)
+		for (i = 0; i < n; ++i) out[i] = a[i] * b[i] + c[i];
+	}
+}
+
+/* Augment y with the scaled conjugate product a * conj(x .* z). */
+void vcmuladd (cplx *y, cplx a, cplx *x, cplx *z, long n) {
+	long i;
+
+#pragma omp parallel for default(shared) private(i)
+	for (i = 0; i < n; ++i) y[i] += a * conj(x[i] * z[i]);
+}
+
 /* The RMS error between a test vector and a reference. */
 real mse (cplx *test, cplx *ref, long n, int nrm) {
 	long i;
-	real err[2] = {0.0, 0.0}, tmp;
+	real err[2], tmp;
+	double lerr = 0.0, lref = 0.0;
 
 	/* Calculate local contributions to the mean-squared error. */
+#pragma omp parallel for default(shared) private(i,tmp) reduction(+: lerr,lref)
 	for (i = 0; i < n; ++i) {
 		tmp = cabs(test[i] - ref[i]);
-		err[0] += tmp * tmp;
+		lerr += tmp * tmp;
 		tmp = cabs(ref[i]);
-		err[1] += tmp * tmp;
+		lref += tmp * tmp;
 	}
 
+	err[0] = lerr;
+	err[1] = lref;
+
 	/* Sum the local contributions. */
-	MPI_Allreduce (MPI_IN_PLACE, err, 2, MPIREAL, MPI_SUM, MPI_COMM_WORLD);
+	MPI_Allreduce (MPI_IN_PLACE, err, 2, MPIREAL, MPI_SUM, fmaconf.comm);
 
 	/* Return the normalized MSE if desired, otherwise just the difference. */
 	if (nrm) return sqrt(err[0] / err[1]);
@@ -39,7 +39,19 @@ int maxind (cplx *, int, int *, int);
 
 int cmgs (cplx *, cplx *, cplx *, long, int);
 cplx pardot (cplx *, cplx *, long);
+cplx pardotnrm (real *, cplx *, cplx *, long);
 real parnorm (cplx *, long);
+int pardots (cplx *, cplx *, cplx *, long, int);
+int parnorms (real *, cplx *, long, int);
+int parinner (cplx *, cplx *, int, cplx *, int, long);
+
+void vaxpby (cplx *, cplx, cplx *, cplx, long);
+real vupdnrm (cplx *, cplx, cplx *, cplx, cplx *, long);
+real vsolupd (cplx *, cplx *, cplx, cplx *, cplx *, long);
+real vcgupd (cplx *, cplx *, cplx *, cplx, cplx, long);
+real vnrm2 (cplx *, long);
+void vmuladd (cplx *, cplx *, cplx *, cplx *, long);
+void vcmuladd (cplx *, cplx, cplx *, cplx *, long);
 
 int gaussleg (real *, real *, int);
 #endif /* __UTIL_H_ */